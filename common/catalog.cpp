@@ -0,0 +1,255 @@
+/* ResidualVM - A 3D game interpreter
+*
+* ResidualVM is the legal property of its developers, whose names
+* are too numerous to list here. Please refer to the AUTHORS
+* file distributed with this source distribution.
+
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+
+* You should have received a copy of the GNU Lesser General Public
+* License along with this library; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*
+*/
+
+#include "common/catalog.h"
+#include "common/endian.h"
+
+#include <map>
+
+#ifdef POSIX
+#include <strings.h>
+#endif
+
+#define CATALOG_HEADER_SIZE 24
+#define CATALOG_VERSION 2
+#define CATALOG_LAB_SIZE 12
+#define CATALOG_ENTRY_SIZE 32
+#define CATALOG_FREE_SLOT 0xffffffff
+
+namespace Common {
+
+LabCatalog::LabCatalog() : _slots(0), _slotMask(0) {
+}
+
+LabCatalog::~LabCatalog() {
+	close();
+}
+
+bool LabCatalog::open(const char *filename) {
+	close();
+
+	FILE *infile = fopen(filename, "rb");
+	if (!infile) {
+		fprintf(stderr, "Can not open catalog %s\n", filename);
+		return false;
+	}
+	fseek(infile, 0, SEEK_END);
+	long size = ftell(infile);
+	fseek(infile, 0, SEEK_SET);
+	if (size < CATALOG_HEADER_SIZE) {
+		fprintf(stderr, "%s is not a lab catalog\n", filename);
+		fclose(infile);
+		return false;
+	}
+	_data.resize(size);
+	bool ok = fread(&_data[0], 1, size, infile) == (size_t)size;
+	fclose(infile);
+	if (!ok) {
+		fprintf(stderr, "Could not read %s\n", filename);
+		close();
+		return false;
+	}
+
+	const byte *data = &_data[0];
+	uint32 numLabs = READ_LE_UINT32(data + 8);
+	uint32 numEntries = READ_LE_UINT32(data + 12);
+	uint32 numSlots = READ_LE_UINT32(data + 16);
+	uint32 strTableSize = READ_LE_UINT32(data + 20);
+	uint64 labsOffset = CATALOG_HEADER_SIZE;
+	uint64 entriesOffset = labsOffset + (uint64)numLabs * CATALOG_LAB_SIZE;
+	uint64 slotsOffset = entriesOffset + (uint64)numEntries * CATALOG_ENTRY_SIZE;
+	uint64 strTableOffset = slotsOffset + (uint64)numSlots * 4;
+
+	if (READ_BE_UINT32(data) != MKTAG('L','C','A','T') || READ_LE_UINT16(data + 4) != CATALOG_VERSION ||
+			numSlots == 0 || (numSlots & (numSlots - 1)) != 0 ||
+			strTableOffset + strTableSize != (uint64)size || strTableSize == 0 || data[size - 1] != 0) {
+		fprintf(stderr, "%s is not a lab catalog\n", filename);
+		close();
+		return false;
+	}
+
+	const char *strTable = (const char *)data + strTableOffset;
+	const byte *rec = data + labsOffset;
+	for (uint32 i = 0; i < numLabs; i++, rec += CATALOG_LAB_SIZE) {
+		uint32 nameOffset = READ_LE_UINT32(rec);
+		_labNames.push_back(strTable + (nameOffset < strTableSize ? nameOffset : strTableSize - 1));
+		_labSizes.push_back(READ_LE_UINT64(rec + 4));
+	}
+	_labs.resize(numLabs, 0);
+
+	_entries.resize(numEntries);
+	for (uint32 i = 0; i < numEntries; i++, rec += CATALOG_ENTRY_SIZE) {
+		uint32 nameOffset = READ_LE_UINT32(rec);
+		CatalogEntry &entry = _entries[i];
+		entry.name = strTable + (nameOffset < strTableSize ? nameOffset : strTableSize - 1);
+		entry.lab = READ_LE_UINT32(rec + 4);
+		entry.entry.name = entry.name;
+		entry.entry.offset = READ_LE_UINT64(rec + 8);
+		entry.entry.size = READ_LE_UINT64(rec + 16);
+		entry.entry.rawSize = READ_LE_UINT64(rec + 24);
+		if (entry.lab >= numLabs) {
+			fprintf(stderr, "The catalog %s is corrupt\n", filename);
+			close();
+			return false;
+		}
+	}
+	_slots = data + slotsOffset;
+	_slotMask = numSlots - 1;
+
+	// The labs are found next to the catalog
+	_dirname = filename;
+	size_t sep = _dirname.find_last_of("/\\");
+	_dirname = (sep == std::string::npos) ? "" : _dirname.substr(0, sep + 1);
+	return true;
+}
+
+void LabCatalog::close() {
+	for (uint32 i = 0; i < _labs.size(); i++)
+		delete _labs[i];
+	_labs.clear();
+	_labNames.clear();
+	_labSizes.clear();
+	_entries.clear();
+	_data.clear();
+	_dirname.clear();
+	_slots = 0;
+	_slotMask = 0;
+}
+
+int LabCatalog::findEntry(const char *name) const {
+	if (!_slots)
+		return -1;
+
+	uint32 slot = hashLabName(name, true) & _slotMask;
+	for (uint32 probes = 0; probes <= _slotMask; probes++) {
+		uint32 index = READ_LE_UINT32(_slots + slot * 4);
+		if (index == CATALOG_FREE_SLOT || index >= _entries.size())
+			break;
+		if (strcasecmp(_entries[index].name, name) == 0)
+			return index;
+		slot = (slot + 1) & _slotMask;
+	}
+	return -1;
+}
+
+const LabFile *LabCatalog::getLab(const CatalogEntry &entry) {
+	uint32 lab = entry.lab;
+	if (_labs[lab])
+		return _labs[lab]->isOpen() ? _labs[lab] : 0;
+
+	_labs[lab] = new LabFile();
+	std::string path = _dirname + _labNames[lab];
+	if (!_labs[lab]->open(path.c_str(), true))
+		return 0;
+	if (_labs[lab]->getFileSize() != _labSizes[lab]) {
+		fprintf(stderr, "%s changed since the catalog was written, rebuild it\n", path.c_str());
+		_labs[lab]->close();
+		return 0;
+	}
+	return _labs[lab];
+}
+
+bool isLabCatalog(const char *filename) {
+	FILE *infile = fopen(filename, "rb");
+	if (!infile)
+		return false;
+	byte tag[4];
+	bool ok = fread(tag, 1, 4, infile) == 4 && READ_BE_UINT32(tag) == MKTAG('L','C','A','T');
+	fclose(infile);
+	return ok;
+}
+
+static std::string lowerName(const char *name) {
+	std::string lower(name);
+	for (size_t i = 0; i < lower.size(); i++)
+		lower[i] = tolower((byte)lower[i]);
+	return lower;
+}
+
+bool writeLabCatalog(const char *filename, const std::vector<CatalogLab> &labs) {
+	// Labs are walked in priority order, so the first lab holding a file
+	// is the one the catalog points at. The map also sorts the names.
+	std::map<std::string, std::pair<uint32, uint32> > merged;
+	for (uint32 l = 0; l < labs.size(); l++) {
+		const LabFile *lab = labs[l].lab;
+		for (uint32 i = 0; i < lab->getNumEntries(); i++)
+			merged.insert(std::make_pair(lowerName(lab->getEntry(i).name), std::make_pair(l, i)));
+	}
+
+	uint32 numLabs = labs.size();
+	uint32 numEntries = merged.size();
+	uint32 numSlots = 16;
+	while (numSlots < numEntries * 2)
+		numSlots <<= 1;
+
+	std::vector<byte> header(CATALOG_HEADER_SIZE + numLabs * CATALOG_LAB_SIZE + numEntries * CATALOG_ENTRY_SIZE);
+	std::vector<uint32> slots(numSlots, CATALOG_FREE_SLOT);
+	std::string strTable;
+
+	byte *rec = &header[CATALOG_HEADER_SIZE];
+	for (uint32 l = 0; l < numLabs; l++, rec += CATALOG_LAB_SIZE) {
+		WRITE_LE_UINT32(rec, strTable.size());
+		WRITE_LE_UINT64(rec + 4, labs[l].lab->getFileSize());
+		strTable.append(labs[l].name.c_str(), labs[l].name.size() + 1);
+	}
+
+	uint32 index = 0;
+	std::map<std::string, std::pair<uint32, uint32> >::const_iterator it;
+	for (it = merged.begin(); it != merged.end(); ++it, index++, rec += CATALOG_ENTRY_SIZE) {
+		const LabEntry &entry = labs[it->second.first].lab->getEntry(it->second.second);
+		WRITE_LE_UINT32(rec, strTable.size());
+		WRITE_LE_UINT32(rec + 4, it->second.first);
+		WRITE_LE_UINT64(rec + 8, entry.offset);
+		WRITE_LE_UINT64(rec + 16, entry.size);
+		WRITE_LE_UINT64(rec + 24, entry.rawSize);
+		strTable.append(entry.name, strlen(entry.name) + 1);
+
+		// Names are unique once lower-cased, no need to compare them here
+		uint32 slot = hashLabName(entry.name, true) & (numSlots - 1);
+		while (slots[slot] != CATALOG_FREE_SLOT)
+			slot = (slot + 1) & (numSlots - 1);
+		slots[slot] = index;
+	}
+
+	WRITE_BE_UINT32(&header[0], MKTAG('L','C','A','T'));
+	WRITE_LE_UINT16(&header[4], CATALOG_VERSION);
+	WRITE_LE_UINT16(&header[6], 0);
+	WRITE_LE_UINT32(&header[8], numLabs);
+	WRITE_LE_UINT32(&header[12], numEntries);
+	WRITE_LE_UINT32(&header[16], numSlots);
+	WRITE_LE_UINT32(&header[20], strTable.size());
+
+	std::vector<byte> slotData(numSlots * 4);
+	for (uint32 i = 0; i < numSlots; i++)
+		WRITE_LE_UINT32(&slotData[i * 4], slots[i]);
+
+	FILE *outfile = fopen(filename, "wb");
+	if (!outfile) {
+		fprintf(stderr, "Could not open file %s for writing\n", filename);
+		return false;
+	}
+	bool ok = fwrite(&header[0], 1, header.size(), outfile) == header.size() &&
+	          fwrite(&slotData[0], 1, slotData.size(), outfile) == slotData.size() &&
+	          (strTable.empty() || fwrite(strTable.data(), 1, strTable.size(), outfile) == strTable.size());
+	if (fclose(outfile) != 0 || !ok) {
+		fprintf(stderr, "Could not write to %s\n", filename);
+		return false;
+	}
+	return true;
+}
+
+} // End of namespace Common
@@ -0,0 +1,120 @@
+/* ResidualVM - A 3D game interpreter
+*
+* ResidualVM is the legal property of its developers, whose names
+* are too numerous to list here. Please refer to the AUTHORS
+* file distributed with this source distribution.
+
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+
+* You should have received a copy of the GNU Lesser General Public
+* License along with this library; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*
+*/
+
+/* Lab catalog: one merged directory for all the labs of a game.
+
+ The catalog lives next to the labs it indexes. It is little endian:
+
+ Offset	Size	Var
+ 0		4		Signature = 'LCAT'
+ 4		2		VersionMajor = 2
+ 6		2		VersionMinor = 0
+ 8		4		number of labs (l)
+ 12		4		number of entries (n)
+ 16		4		number of hash slots (s, a power of two)
+ 20		4		size of the string table
+ 24		12*l	one record per lab, highest priority first:
+				4 offset of its file name in the string table, 8 size of the lab
+ ..		32*n	one record per file, sorted by name:
+				4 offset of the name in the string table, 4 lab index,
+				8 offset, 8 size and 8 uncompressed size of the data in that lab
+ ..		4*s		open addressing hash table of entry indices, -1 for free slots,
+				indexed by Common::hashLabName(name, true)
+ ..				string table, zero terminated names
+
+ A file present in several labs is only listed once, for the lab with
+ the highest priority, so that patch labs override the base ones.
+*/
+
+#ifndef COMMON_CATALOG_H
+#define COMMON_CATALOG_H
+
+#include "common/lab.h"
+
+#include <string>
+#include <vector>
+
+namespace Common {
+
+struct CatalogEntry {
+	const char *name;
+	uint32 lab;
+	LabEntry entry;		// Where the data is, in that lab
+};
+
+/**
+ * Read-only view of a lab catalog. Names are looked up case-insensitively
+ * with a single probe in the stored hash table, and the labs themselves
+ * are only opened when their data is first asked for.
+ */
+class LabCatalog {
+public:
+	LabCatalog();
+	~LabCatalog();
+
+	/**
+	 * Load the given catalog. On failure a diagnostic is printed on
+	 * stderr and false is returned.
+	 */
+	bool open(const char *filename);
+	void close();
+
+	uint32 getNumLabs() const { return _labNames.size(); }
+	const char *getLabName(uint32 lab) const { return _labNames[lab]; }
+
+	uint32 getNumEntries() const { return _entries.size(); }
+	const CatalogEntry &getEntry(uint32 index) const { return _entries[index]; }
+
+	/** Return the index of the given file, or -1 if no lab holds it. */
+	int findEntry(const char *name) const;
+
+	/**
+	 * Return the opened lab holding the given entry, or 0 if it can't be
+	 * opened or changed since the catalog was written.
+	 */
+	const LabFile *getLab(const CatalogEntry &entry);
+
+private:
+	std::string _dirname;
+	std::vector<byte> _data;
+	std::vector<const char *> _labNames;
+	std::vector<uint64> _labSizes;
+	std::vector<LabFile *> _labs;
+	std::vector<CatalogEntry> _entries;
+	const byte *_slots;
+	uint32 _slotMask;
+};
+
+/** Tell whether the given file is a catalog rather than a lab. */
+bool isLabCatalog(const char *filename);
+
+/** A lab to put into a new catalog, in priority order. */
+struct CatalogLab {
+	std::string name;	// Relative to the directory of the catalog
+	const LabFile *lab;
+};
+
+/**
+ * Merge the directories of the given labs, the first one winning for
+ * files stored more than once, and write the result as a catalog.
+ * On failure a diagnostic is printed on stderr and false is returned.
+ */
+bool writeLabCatalog(const char *filename, const std::vector<CatalogLab> &labs);
+
+} // End of namespace Common
+
+#endif
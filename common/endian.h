@@ -396,6 +396,17 @@ inline uint32 READ_BE_UINT24(const void *ptr) {
 	return (b[0] << 16) | (b[1] << 8) | (b[2]);
 }
 
+inline uint64 READ_LE_UINT64(const void *ptr) {
+	const uint8 *b = (const uint8 *)ptr;
+	return (uint64)READ_LE_UINT32(b) | ((uint64)READ_LE_UINT32(b + 4) << 32);
+}
+
+inline void WRITE_LE_UINT64(void *ptr, uint64 value) {
+	uint8 *b = (uint8 *)ptr;
+	WRITE_LE_UINT32(b, (uint32)value);
+	WRITE_LE_UINT32(b + 4, (uint32)(value >> 32));
+}
+
 // ResidualVM specific:
 #if defined(SCUMM_BIG_ENDIAN)
 
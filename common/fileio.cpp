@@ -0,0 +1,99 @@
+/* ResidualVM - A 3D game interpreter
+*
+* ResidualVM is the legal property of its developers, whose names
+* are too numerous to list here. Please refer to the AUTHORS
+* file distributed with this source distribution.
+
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+
+* You should have received a copy of the GNU Lesser General Public
+* License along with this library; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*
+*/
+
+#include "common/fileio.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define HAVE_COPY_FILE_RANGE
+#endif
+
+#define COPY_BUFFER_SIZE 0x100000
+// Largest transfer asked for in one call, so that 64 bit sizes never get
+// truncated to a 32 bit size_t
+#define MAX_TRANSFER_SIZE 0x40000000
+
+namespace Common {
+
+bool writeAt(int fd, uint64 offset, const void *data, uint64 size) {
+	const byte *ptr = (const byte *)data;
+	while (size > 0) {
+		ssize_t written = pwrite(fd, ptr, size < MAX_TRANSFER_SIZE ? size : MAX_TRANSFER_SIZE, offset);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			return false;
+		ptr += written;
+		offset += written;
+		size -= written;
+	}
+	return true;
+}
+
+bool readAt(int fd, uint64 offset, void *data, uint64 size) {
+	byte *ptr = (byte *)data;
+	while (size > 0) {
+		ssize_t count = pread(fd, ptr, size < MAX_TRANSFER_SIZE ? size : MAX_TRANSFER_SIZE, offset);
+		if (count < 0 && errno == EINTR)
+			continue;
+		if (count <= 0)
+			return false;
+		ptr += count;
+		offset += count;
+		size -= count;
+	}
+	return true;
+}
+
+bool copyRange(int inFd, uint64 inOffset, int outFd, uint64 outOffset, uint64 size) {
+#ifdef HAVE_COPY_FILE_RANGE
+	while (size > 0) {
+		loff_t in = inOffset, out = outOffset;
+		ssize_t copied = copy_file_range(inFd, &in, outFd, &out, size < MAX_TRANSFER_SIZE ? size : MAX_TRANSFER_SIZE, 0);
+		if (copied < 0 && errno == EINTR)
+			continue;
+		if (copied <= 0)
+			break;	// Not supported between these files, or past EOF
+		inOffset += copied;
+		outOffset += copied;
+		size -= copied;
+	}
+	if (size == 0)
+		return true;
+#endif
+
+	byte *buf = (byte *)malloc(size < COPY_BUFFER_SIZE ? size : COPY_BUFFER_SIZE);
+	if (!buf)
+		return false;
+	while (size > 0) {
+		uint64 len = size < COPY_BUFFER_SIZE ? size : COPY_BUFFER_SIZE;
+		if (!readAt(inFd, inOffset, buf, len) || !writeAt(outFd, outOffset, buf, len)) {
+			free(buf);
+			return false;
+		}
+		inOffset += len;
+		outOffset += len;
+		size -= len;
+	}
+	free(buf);
+	return true;
+}
+
+} // End of namespace Common
@@ -0,0 +1,49 @@
+/* ResidualVM - A 3D game interpreter
+*
+* ResidualVM is the legal property of its developers, whose names
+* are too numerous to list here. Please refer to the AUTHORS
+* file distributed with this source distribution.
+
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+
+* You should have received a copy of the GNU Lesser General Public
+* License along with this library; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*
+*/
+
+#ifndef COMMON_FILEIO_H
+#define COMMON_FILEIO_H
+
+#include "common/scummsys.h"
+
+/**
+ *  \file fileio.h
+ *  Positional file I/O helpers working on plain file descriptors.
+ *
+ *  All functions retry on short transfers and return false on error.
+ *  Offsets never move the file position, so several threads may share
+ *  the same descriptors.
+ */
+
+namespace Common {
+
+/** Write size bytes of data at the given offset of fd. */
+bool writeAt(int fd, uint64 offset, const void *data, uint64 size);
+
+/** Read size bytes at the given offset of fd. */
+bool readAt(int fd, uint64 offset, void *data, uint64 size);
+
+/**
+ * Copy size bytes from inFd at inOffset to outFd at outOffset. The copy is
+ * done in the kernel with copy_file_range() where available, and falls back
+ * to pread()/pwrite() through a bounce buffer otherwise.
+ */
+bool copyRange(int inFd, uint64 inOffset, int outFd, uint64 outOffset, uint64 size);
+
+} // End of namespace Common
+
+#endif
@@ -0,0 +1,168 @@
+/* ResidualVM - A 3D game interpreter
+*
+* ResidualVM is the legal property of its developers, whose names
+* are too numerous to list here. Please refer to the AUTHORS
+* file distributed with this source distribution.
+
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+
+* You should have received a copy of the GNU Lesser General Public
+* License along with this library; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*
+*/
+
+// Implementation of the XXH64 algorithm by Yann Collet
+
+#include "common/hash.h"
+#include "common/endian.h"
+
+#include <stdio.h>
+#include <string.h>
+
+namespace Common {
+
+static const uint64 PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64 PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64 PRIME64_3 = 0x165667B19E3779F9ULL;
+static const uint64 PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64 PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64 rotl64(uint64 x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64 hash64_round(uint64 acc, uint64 input) {
+	acc += input * PRIME64_2;
+	acc = rotl64(acc, 31);
+	return acc * PRIME64_1;
+}
+
+static inline uint64 hash64_merge(uint64 acc, uint64 val) {
+	acc ^= hash64_round(0, val);
+	return acc * PRIME64_1 + PRIME64_4;
+}
+
+static void hash64_process(hash64_context *ctx, const uint8 data[32]) {
+	ctx->state[0] = hash64_round(ctx->state[0], READ_LE_UINT64(data));
+	ctx->state[1] = hash64_round(ctx->state[1], READ_LE_UINT64(data + 8));
+	ctx->state[2] = hash64_round(ctx->state[2], READ_LE_UINT64(data + 16));
+	ctx->state[3] = hash64_round(ctx->state[3], READ_LE_UINT64(data + 24));
+}
+
+void hash64_starts(hash64_context *ctx, uint64 seed) {
+	ctx->total = 0;
+	ctx->buffered = 0;
+	ctx->seed = seed;
+	ctx->state[0] = seed + PRIME64_1 + PRIME64_2;
+	ctx->state[1] = seed + PRIME64_2;
+	ctx->state[2] = seed;
+	ctx->state[3] = seed - PRIME64_1;
+}
+
+void hash64_update(hash64_context *ctx, const uint8 *input, uint32 length) {
+	ctx->total += length;
+
+	if (ctx->buffered) {
+		uint32 fill = 32 - ctx->buffered;
+		if (length < fill) {
+			memcpy(ctx->buffer + ctx->buffered, input, length);
+			ctx->buffered += length;
+			return;
+		}
+		memcpy(ctx->buffer + ctx->buffered, input, fill);
+		hash64_process(ctx, ctx->buffer);
+		input += fill;
+		length -= fill;
+		ctx->buffered = 0;
+	}
+
+	while (length >= 32) {
+		hash64_process(ctx, input);
+		input += 32;
+		length -= 32;
+	}
+
+	if (length) {
+		memcpy(ctx->buffer, input, length);
+		ctx->buffered = length;
+	}
+}
+
+uint64 hash64_finish(const hash64_context *ctx) {
+	uint64 h;
+
+	if (ctx->total >= 32) {
+		h = rotl64(ctx->state[0], 1) + rotl64(ctx->state[1], 7) +
+		    rotl64(ctx->state[2], 12) + rotl64(ctx->state[3], 18);
+		h = hash64_merge(h, ctx->state[0]);
+		h = hash64_merge(h, ctx->state[1]);
+		h = hash64_merge(h, ctx->state[2]);
+		h = hash64_merge(h, ctx->state[3]);
+	} else {
+		h = ctx->seed + PRIME64_5;
+	}
+	h += ctx->total;
+
+	const uint8 *p = ctx->buffer;
+	uint32 length = ctx->buffered;
+	for (; length >= 8; p += 8, length -= 8) {
+		h ^= hash64_round(0, READ_LE_UINT64(p));
+		h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+	}
+	if (length >= 4) {
+		h ^= (uint64)READ_LE_UINT32(p) * PRIME64_1;
+		h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+		p += 4;
+		length -= 4;
+	}
+	for (; length > 0; p++, length--) {
+		h ^= *p * PRIME64_5;
+		h = rotl64(h, 11) * PRIME64_1;
+	}
+
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+uint64 hash64(const void *data, uint64 length, uint64 seed) {
+	hash64_context ctx;
+	const uint8 *input = (const uint8 *)data;
+
+	hash64_starts(&ctx, seed);
+	while (length > 0) {
+		uint32 len = length > 0x40000000 ? 0x40000000 : (uint32)length;
+		hash64_update(&ctx, input, len);
+		input += len;
+		length -= len;
+	}
+	return hash64_finish(&ctx);
+}
+
+bool hash64_file(const char *name, uint64 &hash) {
+	FILE *f = fopen(name, "rb");
+	if (!f)
+		return false;
+
+	hash64_context ctx;
+	uint8 buf[0x10000];
+	size_t len;
+
+	hash64_starts(&ctx);
+	while ((len = fread(buf, 1, sizeof(buf), f)) > 0)
+		hash64_update(&ctx, buf, len);
+	bool ok = !ferror(f);
+	fclose(f);
+
+	hash = hash64_finish(&ctx);
+	return ok;
+}
+
+} // End of namespace Common
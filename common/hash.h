@@ -0,0 +1,49 @@
+/* ResidualVM - A 3D game interpreter
+*
+* ResidualVM is the legal property of its developers, whose names
+* are too numerous to list here. Please refer to the AUTHORS
+* file distributed with this source distribution.
+
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+
+* You should have received a copy of the GNU Lesser General Public
+* License along with this library; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*
+*/
+
+#ifndef COMMON_HASH_H
+#define COMMON_HASH_H
+
+#include "common/scummsys.h"
+
+namespace Common {
+
+/**
+ * Fast non-cryptographic 64 bit hash (XXH64). Meant to tell whether two
+ * blobs differ, use md5 where the hash has to resist tampering.
+ */
+typedef struct {
+	uint64 total;
+	uint64 state[4];
+	uint8 buffer[32];
+	uint32 buffered;
+	uint64 seed;
+} hash64_context;
+
+void hash64_starts(hash64_context *ctx, uint64 seed = 0);
+void hash64_update(hash64_context *ctx, const uint8 *input, uint32 length);
+uint64 hash64_finish(const hash64_context *ctx);
+
+/** Hash a buffer in one go. */
+uint64 hash64(const void *data, uint64 length, uint64 seed = 0);
+
+/** Hash the given file, or return false if it can't be read. */
+bool hash64_file(const char *name, uint64 &hash);
+
+} // End of namespace Common
+
+#endif
@@ -0,0 +1,447 @@
+/* ResidualVM - A 3D game interpreter
+*
+* ResidualVM is the legal property of its developers, whose names
+* are too numerous to list here. Please refer to the AUTHORS
+* file distributed with this source distribution.
+
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+
+* You should have received a copy of the GNU Lesser General Public
+* License along with this library; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*
+*/
+
+#include "common/lab.h"
+#include "common/endian.h"
+#include "common/zlib.h"
+
+#ifdef POSIX
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <unistd.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace Common {
+
+LabFile::LabFile() : _filename(0), _fd(-1), _data(0), _size(0), _dataOffset(0), _mapped(false),
+	_gameType(0), _flags(0), _strTable(0), _ignoreCase(false), _indexMask(0) {
+}
+
+LabFile::~LabFile() {
+	close();
+}
+
+bool LabFile::open(const char *filename, bool ignoreCase, bool salvage) {
+	close();
+
+	_ignoreCase = ignoreCase;
+	_filename = strdup(filename);
+
+#ifdef POSIX
+	_fd = ::open(filename, O_RDONLY);
+	if (_fd < 0) {
+		fprintf(stderr, "Can not open source file: %s\n", filename);
+		return false;
+	}
+	struct stat st;
+	if (fstat(_fd, &st) != 0 || st.st_size < 16) {
+		fprintf(stderr, "%s is too small to be a lab file\n", filename);
+		close();
+		return false;
+	}
+	_size = st.st_size;
+	if (_size != (size_t)_size) {
+		fprintf(stderr, "%s is too large to be mapped on this system\n", filename);
+		close();
+		return false;
+	}
+	void *map = mmap(0, _size, PROT_READ, MAP_PRIVATE, _fd, 0);
+	if (map == MAP_FAILED) {
+		close();
+		fprintf(stderr, "Could not map %s\n", filename);
+		return false;
+	}
+	_data = (const byte *)map;
+	_mapped = true;
+#else
+	FILE *infile = fopen(filename, "rb");
+	if (!infile) {
+		fprintf(stderr, "Can not open source file: %s\n", filename);
+		return false;
+	}
+	fseek(infile, 0, SEEK_END);
+	_size = ftell(infile);
+	fseek(infile, 0, SEEK_SET);
+	byte *buf = (byte *)malloc(_size);
+	if (!buf || fread(buf, 1, _size, infile) != _size) {
+		fprintf(stderr, "Could not read %s\n", filename);
+		free(buf);
+		fclose(infile);
+		return false;
+	}
+	fclose(infile);
+	_data = buf;
+#endif
+
+	if (!parse(salvage)) {
+		close();
+		return false;
+	}
+	return true;
+}
+
+void LabFile::close() {
+	if (_data) {
+#ifdef POSIX
+		if (_mapped)
+			munmap(const_cast<byte *>(_data), _size);
+		else
+#endif
+			free(const_cast<byte *>(_data));
+	}
+#ifdef POSIX
+	if (_fd >= 0)
+		::close(_fd);
+#endif
+	free(_filename);
+	delete[] _strTable;
+	_entries.clear();
+	_index.clear();
+
+	_filename = 0;
+	_fd = -1;
+	_data = 0;
+	_size = 0;
+	_dataOffset = 0;
+	_mapped = false;
+	_gameType = 0;
+	_flags = 0;
+	_strTable = 0;
+	_indexMask = 0;
+}
+
+bool LabFile::parse(bool salvage) {
+	if (_size < 20 || READ_BE_UINT32(_data) != MKTAG('L','A','B','N')) {
+		fprintf(stderr, "There is no LABN header in %s\n", _filename);
+		return false;
+	}
+
+	// The engine ignores the version, so other values are read as a plain
+	// lab. Flags are only trusted next to LAB_VERSION.
+	uint32 version = READ_LE_UINT32(_data + 4);
+	_flags = 0;
+	if ((version & ~LAB_FLAG_MASK) == LAB_VERSION) {
+		_flags = version & LAB_KNOWN_FLAGS;
+		if (version & LAB_FLAG_MASK & ~LAB_KNOWN_FLAGS)
+			fprintf(stderr, "%s has unknown flags %x, ignoring them\n", _filename, version & LAB_FLAG_MASK & ~LAB_KNOWN_FLAGS);
+	} else {
+		fprintf(stderr, "%s has an unknown version %x, reading it as a plain lab\n", _filename, version);
+	}
+#ifndef USE_ZLIB
+	if (_flags & LAB_FLAG_COMPRESSED) {
+		fprintf(stderr, "%s is compressed, but zlib support was not compiled in\n", _filename);
+		return false;
+	}
+#endif
+
+	uint32 numEntries = READ_LE_UINT32(_data + 8);
+	uint32 strTableSize = READ_LE_UINT32(_data + 12);
+	uint32 typeTest = READ_LE_UINT32(_data + 16);
+	uint32 entrySize = (_flags & LAB_FLAG_64BIT) ? 32 : 16;
+	uint64 dirSize = (uint64)numEntries * entrySize;
+	uint64 entriesOffset, strTableOffset;
+
+	if (typeTest == 0) {
+		// First entry of the table has offset 0 for Grim, and the string
+		// table directly follows the directory.
+		_gameType = GT_GRIM;
+		entriesOffset = 16;
+		strTableOffset = entriesOffset + dirSize;
+	} else {
+		// EMI has a biased string table offset instead, the directory
+		// starts right after it.
+		_gameType = GT_EMI;
+		entriesOffset = 20;
+		strTableOffset = (uint64)typeTest - LAB_EMI_OFFSET_BIAS;
+		if (typeTest < LAB_EMI_OFFSET_BIAS || strTableOffset < entriesOffset + dirSize) {
+			fprintf(stderr, "%s is neither a Grim nor an EMI lab\n", _filename);
+			return false;
+		}
+	}
+
+	if (entriesOffset + dirSize > _size || strTableOffset + strTableSize > _size) {
+		fprintf(stderr, "The directory of %s is truncated\n", _filename);
+		if (!salvage || entriesOffset > _size)
+			return false;
+		if (entriesOffset + dirSize > _size) {
+			numEntries = (_size - entriesOffset) / entrySize;
+			dirSize = (uint64)numEntries * entrySize;
+		}
+		if (strTableOffset > _size)
+			strTableOffset = _size;
+		if (strTableOffset + strTableSize > _size)
+			strTableSize = _size - strTableOffset;
+		fprintf(stderr, "Keeping the first %u entries and %u bytes of names\n", numEntries, strTableSize);
+	}
+
+	_dataOffset = entriesOffset + dirSize;
+	if (strTableOffset + strTableSize > _dataOffset)
+		_dataOffset = strTableOffset + strTableSize;
+
+	// Keep a terminated copy of the string table, so that names never
+	// run past its end, even in a damaged archive.
+	_strTable = new char[strTableSize + 1];
+	memcpy(_strTable, _data + strTableOffset, strTableSize);
+	_strTable[strTableSize] = 0;
+	if (_gameType == GT_EMI)
+		xorLabStringTable(_strTable, strTableSize);
+
+	_entries.resize(numEntries);
+	const byte *dir = _data + entriesOffset;
+	for (uint32 i = 0; i < numEntries; i++, dir += entrySize) {
+		uint32 nameOffset = READ_LE_UINT32(dir);
+		LabEntry &entry = _entries[i];
+		entry.name = _strTable + (nameOffset < strTableSize ? nameOffset : strTableSize);
+		if (_flags & LAB_FLAG_64BIT) {
+			entry.offset = READ_LE_UINT64(dir + 8);
+			entry.size = READ_LE_UINT64(dir + 16);
+			entry.rawSize = isCompressed() ? READ_LE_UINT64(dir + 24) : entry.size;
+		} else {
+			entry.offset = READ_LE_UINT32(dir + 4);
+			entry.size = READ_LE_UINT32(dir + 8);
+			entry.rawSize = isCompressed() ? READ_LE_UINT32(dir + 12) : entry.size;
+		}
+	}
+
+	buildIndex();
+	return true;
+}
+
+uint32 LabFile::hashName(const char *name) const {
+	return hashLabName(name, _ignoreCase);
+}
+
+uint32 hashLabName(const char *name, bool ignoreCase) {
+	// FNV-1a, on lower-cased characters when ignoring case
+	uint32 hash = 2166136261u;
+	if (ignoreCase) {
+		for (; *name; name++)
+			hash = (hash ^ (byte)tolower((byte)*name)) * 16777619u;
+	} else {
+		for (; *name; name++)
+			hash = (hash ^ (byte)*name) * 16777619u;
+	}
+	return hash;
+}
+
+bool LabFile::matchName(const char *a, const char *b) const {
+	return (_ignoreCase ? strcasecmp(a, b) : strcmp(a, b)) == 0;
+}
+
+void LabFile::buildIndex() {
+	// Keep the table at most half full, so that probe chains stay short
+	uint32 slots = 16;
+	while (slots < _entries.size() * 2)
+		slots <<= 1;
+	_indexMask = slots - 1;
+	_index.assign(slots, -1);
+
+	for (uint32 i = 0; i < _entries.size(); i++) {
+		uint32 slot = hashName(_entries[i].name) & _indexMask;
+		while (_index[slot] != -1) {
+			if (matchName(_entries[_index[slot]].name, _entries[i].name))
+				break;
+			slot = (slot + 1) & _indexMask;
+		}
+		if (_index[slot] == -1)
+			_index[slot] = i;
+	}
+}
+
+int LabFile::findEntry(const char *name) const {
+	if (_index.empty())
+		return -1;
+
+	uint32 slot = hashName(name) & _indexMask;
+	while (_index[slot] != -1) {
+		if (matchName(_entries[_index[slot]].name, name))
+			return _index[slot];
+		slot = (slot + 1) & _indexMask;
+	}
+	return -1;
+}
+
+const byte *LabFile::getData(const LabEntry &entry) const {
+	if (entry.offset > _size || entry.size > _size - entry.offset)
+		return 0;
+	return _data + entry.offset;
+}
+
+void LabFile::prefetch(const LabEntry &entry, uint32 readAhead) const {
+#if defined(POSIX) && defined(MADV_WILLNEED)
+	if (!_mapped || entry.offset >= _size)
+		return;
+	uint64 end = entry.offset + entry.size + readAhead;
+	if (end > _size || end < entry.offset)
+		end = _size;
+	uint64 start = entry.offset & ~(uint64)(sysconf(_SC_PAGESIZE) - 1);
+	madvise(const_cast<byte *>(_data) + start, end - start, MADV_WILLNEED);
+#endif
+}
+
+bool LabFile::readData(const LabEntry &entry, byte *out) const {
+	const byte *data = getData(entry);
+	if (!data) {
+		fprintf(stderr, "File \"%s\" past the end of lab \"%s\". Your game files may be corrupt.\n",
+		        entry.name, _filename);
+		return false;
+	}
+	if (entry.size == entry.rawSize) {
+		memcpy(out, data, entry.size);
+		return true;
+	}
+
+#ifdef USE_ZLIB
+	unsigned long len = entry.rawSize;
+	if (len == entry.rawSize && Common::uncompress(out, &len, data, entry.size) && len == entry.rawSize)
+		return true;
+	fprintf(stderr, "Could not decompress \"%s\" from lab \"%s\"\n", entry.name, _filename);
+#else
+	fprintf(stderr, "\"%s\" is compressed, but zlib support was not compiled in\n", entry.name);
+#endif
+	return false;
+}
+
+void xorLabStringTable(char *str, uint32 size) {
+#ifdef __SSE2__
+	xorLabStringTableSSE2(str, size);
+#else
+	xorLabStringTableSWAR(str, size);
+#endif
+}
+
+void xorLabStringTableScalar(char *str, uint32 size) {
+	byte *p = (byte *)str;
+	byte *end = p + size;
+	for (; p < end; p++)
+		*p ^= LAB_EMI_XOR_KEY & -(byte)(*p != 0);
+}
+
+void xorLabStringTableSWAR(char *str, uint32 size) {
+	byte *p = (byte *)str;
+	byte *end = p + size;
+
+	// Eight bytes at a time: the top bit of each byte of nonZero is set
+	// exactly when that byte of w is non-zero.
+	const uint64 low7 = 0x7f7f7f7f7f7f7f7fULL;
+	const uint64 key8 = 0x0101010101010101ULL * LAB_EMI_XOR_KEY;
+	for (; end - p >= 8; p += 8) {
+		uint64 w;
+		memcpy(&w, p, 8);
+		uint64 nonZero = (((w & low7) + low7) | w) & ~low7;
+		w ^= ((nonZero >> 7) * 0xff) & key8;
+		memcpy(p, &w, 8);
+	}
+
+	xorLabStringTableScalar((char *)p, end - p);
+}
+
+#ifdef __SSE2__
+void xorLabStringTableSSE2(char *str, uint32 size) {
+	byte *p = (byte *)str;
+	byte *end = p + size;
+
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i key = _mm_set1_epi8((char)LAB_EMI_XOR_KEY);
+	for (; end - p >= 16; p += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)p);
+		// Key where the byte is non-zero, 0 where it is zero
+		__m128i mask = _mm_andnot_si128(_mm_cmpeq_epi8(v, zero), key);
+		_mm_storeu_si128((__m128i *)p, _mm_xor_si128(v, mask));
+	}
+
+	xorLabStringTableSWAR((char *)p, end - p);
+}
+#endif
+
+static uint32 getStringTableSize(const std::vector<LabEntry> &entries) {
+	uint32 size = 0;
+	for (uint32 i = 0; i < entries.size(); i++)
+		size += strlen(entries[i].name) + 1;
+	return size;
+}
+
+static uint32 getLabEntrySize(uint32 flags) {
+	return (flags & LAB_FLAG_64BIT) ? 32 : 16;
+}
+
+uint32 getLabDataOffset(uint8 gameType, const std::vector<LabEntry> &entries, uint32 flags) {
+	// Grim has a 16 bytes header, EMI a 20 bytes one. Both are followed
+	// by the directory and the string table, then 16 bytes of padding.
+	return 16 + entries.size() * getLabEntrySize(flags) + getStringTableSize(entries) + 16;
+}
+
+bool needsLab64(const std::vector<LabEntry> &entries, uint64 end) {
+	if (end > 0xffffffffULL)
+		return true;
+	for (uint32 i = 0; i < entries.size(); i++)
+		if (entries[i].offset > 0xffffffffULL || entries[i].size > 0xffffffffULL ||
+				entries[i].rawSize > 0xffffffffULL)
+			return true;
+	return false;
+}
+
+void buildLabDirectory(uint8 gameType, const std::vector<LabEntry> &entries, std::vector<byte> &out, uint32 flags) {
+	uint32 numEntries = entries.size();
+	uint32 strTableSize = getStringTableSize(entries);
+	uint32 entriesOffset = (gameType == GT_EMI) ? 20 : 16;
+	uint32 entrySize = getLabEntrySize(flags);
+	uint32 strTableOffset = entriesOffset + numEntries * entrySize;
+
+	out.assign(getLabDataOffset(gameType, entries, flags), 0);
+	byte *buf = &out[0];
+
+	WRITE_BE_UINT32(buf, MKTAG('L','A','B','N'));
+	WRITE_LE_UINT32(buf + 4, LAB_VERSION | flags);
+	WRITE_LE_UINT32(buf + 8, numEntries);
+	WRITE_LE_UINT32(buf + 12, strTableSize);
+	if (gameType == GT_EMI)
+		WRITE_LE_UINT32(buf + 16, strTableOffset + LAB_EMI_OFFSET_BIAS);
+
+	byte *dir = buf + entriesOffset;
+	char *str = (char *)buf + strTableOffset;
+	uint32 nameOffset = 0;
+	for (uint32 i = 0; i < numEntries; i++, dir += entrySize) {
+		uint64 rawSize = (flags & LAB_FLAG_COMPRESSED) ? entries[i].rawSize : 0;
+		WRITE_LE_UINT32(dir, nameOffset);
+		if (flags & LAB_FLAG_64BIT) {
+			WRITE_LE_UINT64(dir + 8, entries[i].offset);
+			WRITE_LE_UINT64(dir + 16, entries[i].size);
+			WRITE_LE_UINT64(dir + 24, rawSize);
+		} else {
+			WRITE_LE_UINT32(dir + 4, entries[i].offset);
+			WRITE_LE_UINT32(dir + 8, entries[i].size);
+			WRITE_LE_UINT32(dir + 12, rawSize);
+		}
+
+		uint32 len = strlen(entries[i].name) + 1;
+		memcpy(str + nameOffset, entries[i].name, len);
+		nameOffset += len;
+	}
+
+	if (gameType == GT_EMI)
+		xorLabStringTable(str, strTableSize);
+}
+
+} // End of namespace Common
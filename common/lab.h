@@ -0,0 +1,202 @@
+/* ResidualVM - A 3D game interpreter
+*
+* ResidualVM is the legal property of its developers, whose names
+* are too numerous to list here. Please refer to the AUTHORS
+* file distributed with this source distribution.
+
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+
+* You should have received a copy of the GNU Lesser General Public
+* License along with this library; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*
+*/
+
+#ifndef COMMON_LAB_H
+#define COMMON_LAB_H
+
+#include "common/scummsys.h"
+
+#include <vector>
+
+#define GT_GRIM 1
+#define GT_EMI 2
+
+// The EMI header stores the string table offset biased by this value
+#define LAB_EMI_OFFSET_BIAS 0x13d0f
+// Every non-zero byte of the EMI string table is xored with this key
+#define LAB_EMI_XOR_KEY 0x96
+
+// The original engines write labs of version 0x10000, and don't check it.
+// The low bits of the version field flag the extensions these tools add on
+// top of it; labs with another version are read without any.
+#define LAB_VERSION 0x10000
+#define LAB_FLAG_MASK 0xffff
+// Every entry is deflated on its own, and the reserved field of its
+// directory entry holds the uncompressed size
+#define LAB_FLAG_COMPRESSED 0x0001
+// Directory entries are 32 bytes long and hold 64 bit offsets and sizes,
+// for labs past 4 GiB. Set by the writers only when it is needed.
+#define LAB_FLAG_64BIT 0x0002
+#define LAB_KNOWN_FLAGS (LAB_FLAG_COMPRESSED | LAB_FLAG_64BIT)
+
+namespace Common {
+
+/**
+ * A file stored into a lab. The name points into the (decrypted) string
+ * table owned by the LabFile, and stays valid until the archive is closed.
+ */
+struct LabEntry {
+	const char *name;
+	uint64 offset;
+	uint64 size;		// Bytes stored in the lab
+	uint64 rawSize;		// Bytes once decompressed, equal to size if stored as is
+};
+
+/**
+ * Read-only view of a Grim or EMI lab archive.
+ *
+ * The whole archive is mapped into memory once (or read in one go where
+ * mmap is not available) and the entries are handed out as pointer+length
+ * pairs into that mapping, so no data is copied when reading a file.
+ */
+class LabFile {
+public:
+	LabFile();
+	~LabFile();
+
+	/**
+	 * Map the given archive and parse its directory. On failure a
+	 * diagnostic is printed on stderr and false is returned.
+	 * If ignoreCase is set, findEntry() matches names case-insensitively,
+	 * the same way the engine resolves them.
+	 * If salvage is set, a directory or string table cut short by the end
+	 * of the file is only warned about, and the entries that fit are kept.
+	 */
+	bool open(const char *filename, bool ignoreCase = false, bool salvage = false);
+	void close();
+
+	bool isOpen() const { return _data != 0; }
+	const char *getFileName() const { return _filename; }
+	uint8 getGameType() const { return _gameType; }
+	uint32 getFlags() const { return _flags; }
+	bool isCompressed() const { return (_flags & LAB_FLAG_COMPRESSED) != 0; }
+	uint64 getFileSize() const { return _size; }
+	/** End of the header, directory and string table, where the data starts. */
+	uint32 getDataOffset() const { return _dataOffset; }
+
+	uint32 getNumEntries() const { return _entries.size(); }
+	const LabEntry &getEntry(uint32 index) const { return _entries[index]; }
+
+	/**
+	 * Return the index of the given file, or -1 if it isn't in the archive.
+	 * If a name is stored more than once the first entry is returned.
+	 */
+	int findEntry(const char *name) const;
+
+	/**
+	 * Return a pointer to the contents of the entry, or 0 if the entry
+	 * lies past the end of the archive. This is the data as stored, still
+	 * deflated in a compressed lab when size differs from rawSize.
+	 */
+	const byte *getData(const LabEntry &entry) const;
+	const byte *getData(uint32 index) const { return getData(_entries[index]); }
+
+	/**
+	 * Copy the contents of the entry, decompressed if needed, into out,
+	 * which must hold entry.rawSize bytes. On failure a diagnostic is
+	 * printed on stderr and false is returned.
+	 */
+	bool readData(const LabEntry &entry, byte *out) const;
+
+	/**
+	 * Ask the system to start reading the entry, plus readAhead bytes past
+	 * it, in the background, so that later accesses don't wait on the disk.
+	 * Does nothing where the archive isn't mapped.
+	 */
+	void prefetch(const LabEntry &entry, uint32 readAhead = 0) const;
+
+	/** Raw bytes of the whole archive. */
+	const byte *getRawData() const { return _data; }
+
+	/**
+	 * Descriptor of the open archive, for kernel side copies. It is -1
+	 * where the archive isn't backed by a descriptor.
+	 */
+	int getDescriptor() const { return _fd; }
+
+private:
+	bool parse(bool salvage);
+	void buildIndex();
+	uint32 hashName(const char *name) const;
+	bool matchName(const char *a, const char *b) const;
+
+	char *_filename;
+	int _fd;
+	const byte *_data;
+	uint64 _size;
+	uint32 _dataOffset;
+	bool _mapped;
+	uint8 _gameType;
+	uint32 _flags;
+	char *_strTable;
+	std::vector<LabEntry> _entries;
+
+	// Open addressing hash table of entry indices, -1 marks a free slot
+	bool _ignoreCase;
+	std::vector<int32> _index;
+	uint32 _indexMask;
+};
+
+/**
+ * Hash of a file name, as used by the lookup tables of LabFile and of
+ * lab catalogs. With ignoreCase the name is hashed lower-cased.
+ */
+uint32 hashLabName(const char *name, bool ignoreCase);
+
+/**
+ * Encrypt or decrypt, in place, an EMI string table: every non-zero byte
+ * is xored with LAB_EMI_XOR_KEY. The same call does both directions.
+ */
+void xorLabStringTable(char *str, uint32 size);
+
+/**
+ * The kernels xorLabStringTable() picks from: a byte loop, eight bytes at
+ * a time in a 64 bit word, and sixteen bytes at a time with SSE2, which is
+ * only built when the compiler targets it. They give the same results, and
+ * are only exposed to be compared by tools/labxorbench.
+ */
+void xorLabStringTableScalar(char *str, uint32 size);
+void xorLabStringTableSWAR(char *str, uint32 size);
+#ifdef __SSE2__
+void xorLabStringTableSSE2(char *str, uint32 size);
+#endif
+
+/**
+ * Offset of the first data byte of a new lab holding the given entries,
+ * i.e. the size of its header, directory and string table. The size of
+ * the directory depends on LAB_FLAG_64BIT in flags.
+ */
+uint32 getLabDataOffset(uint8 gameType, const std::vector<LabEntry> &entries, uint32 flags = 0);
+
+/**
+ * Whether a lab holding the given entries, with its data ending at the
+ * given offset, needs LAB_FLAG_64BIT, i.e. has offsets or sizes, stored or
+ * decompressed, that don't fit in 32 bits.
+ */
+bool needsLab64(const std::vector<LabEntry> &entries, uint64 end);
+
+/**
+ * Serialize the header, directory and string table of a lab holding the
+ * given entries, in the given order. The string table is encrypted for
+ * EMI. The result is getLabDataOffset() bytes long, zero padded.
+ * flags is a combination of the LAB_FLAG_* values.
+ */
+void buildLabDirectory(uint8 gameType, const std::vector<LabEntry> &entries, std::vector<byte> &out, uint32 flags = 0);
+
+} // End of namespace Common
+
+#endif
@@ -0,0 +1,356 @@
+/* ResidualVM - A 3D game interpreter
+*
+* ResidualVM is the legal property of its developers, whose names
+* are too numerous to list here. Please refer to the AUTHORS
+* file distributed with this source distribution.
+
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+
+* You should have received a copy of the GNU Lesser General Public
+* License along with this library; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*
+*/
+
+#include "common/patch.h"
+#include "common/endian.h"
+#include "common/fileio.h"
+#include "common/md5.h"
+#include "common/zlib.h"
+
+namespace Common {
+
+bool parsePatchHeader(const byte *data, uint64 size, PatchHeader &header) {
+	if (size < PATCH_HEADER_SIZE || READ_BE_UINT32(data) != MKTAG('P','A','T','R'))
+		return false;
+
+	header.versionMajor = READ_LE_UINT16(data + 4);
+	header.versionMinor = READ_LE_UINT16(data + 6);
+	header.flags = READ_LE_UINT32(data + 8);
+	memcpy(header.md5, data + 12, 16);
+
+	if (header.versionMajor == 2 && header.versionMinor == 0) {
+		header.oldSize = READ_LE_UINT32(data + 28);
+		header.newSize = READ_LE_UINT32(data + 32);
+		header.ctrlSize = READ_LE_UINT32(data + 36);
+		header.diffSize = READ_LE_UINT32(data + 40);
+		header.extraSize = READ_LE_UINT32(data + 44);
+		header.headerSize = PATCH_HEADER_SIZE;
+		header.ctrlEntrySize = 12;
+		return true;
+	}
+	if (header.versionMajor == 3 && header.versionMinor == 0 && size >= PATCH_HEADER64_SIZE) {
+		header.oldSize = READ_LE_UINT64(data + 28);
+		header.newSize = READ_LE_UINT64(data + 36);
+		header.ctrlSize = READ_LE_UINT64(data + 44);
+		header.diffSize = READ_LE_UINT64(data + 52);
+		header.extraSize = READ_LE_UINT64(data + 60);
+		header.headerSize = PATCH_HEADER64_SIZE;
+		header.ctrlEntrySize = 24;
+		return true;
+	}
+	return false;
+}
+
+// Whether the three blocks fit in a patch of patchSize bytes
+static bool checkBlockSizes(const PatchHeader &header, uint64 patchSize) {
+	uint64 left = patchSize - header.headerSize;
+	return header.ctrlSize <= left && header.diffSize <= left - header.ctrlSize &&
+	       header.extraSize <= left - header.ctrlSize - header.diffSize;
+}
+
+bool readPatchHeader(const byte *patch, uint64 patchSize, PatchHeader &header) {
+	return parsePatchHeader(patch, patchSize, header) && checkBlockSizes(header, patchSize);
+}
+
+void readPatchCtrl(const PatchHeader &header, const byte *data, uint64 &diffLen, uint64 &extraLen, int64 &seek) {
+	if (header.ctrlEntrySize == 24) {
+		diffLen = READ_LE_UINT64(data);
+		extraLen = READ_LE_UINT64(data + 8);
+		seek = (int64)READ_LE_UINT64(data + 16);
+	} else {
+		diffLen = READ_LE_UINT32(data);
+		extraLen = READ_LE_UINT32(data + 4);
+		seek = (int32)READ_LE_UINT32(data + 8);
+	}
+}
+
+// Compare the md5 of the first bytes of the old file, start holds up to
+// PATCH_MD5_LENGTH of them
+static bool checkMD5(const PatchHeader &header, const byte *start, uint32 len) {
+	md5_context ctx;
+	byte md5[16];
+	md5_starts(&ctx);
+	md5_update(&ctx, start, len);
+	md5_finish(&ctx, md5);
+	return memcmp(md5, header.md5, 16) == 0;
+}
+
+bool patchMatches(const PatchHeader &header, const byte *oldData, uint64 oldSize) {
+	if (oldSize != header.oldSize)
+		return false;
+	return checkMD5(header, oldData, oldSize < PATCH_MD5_LENGTH ? oldSize : PATCH_MD5_LENGTH);
+}
+
+bool DataRange::read(uint64 pos, byte *out, uint64 len) const {
+	if (pos > size || len > size - pos)
+		return false;
+	if (len == 0)
+		return true;
+	if (data) {
+		memcpy(out, data + pos, len);
+		return true;
+	}
+	return readAt(fd, offset + pos, out, len);
+}
+
+// Size of the buffer for the old data, and for blocks read from a file
+#define PATCH_BUFFER_SIZE 0x10000
+
+#if defined(USE_ZLIB)
+
+// Inflate one of the gzipped blocks of a patch as it is read, from memory
+// or from a file
+class BlockReader {
+public:
+	BlockReader(const DataRange &source, uint64 start, uint64 size, bool compressed) : _source(source),
+		_pos(start), _end(start + size), _compressed(compressed), _stream(), _zlibErr(Z_OK), _buf(0) {
+		if (_compressed) {
+			// Accept both gzip and zlib headers, as GZipReadStream does
+			_zlibErr = inflateInit2(&_stream, MAX_WBITS + 32);
+			if (!_source.data)
+				_buf = new byte[PATCH_BUFFER_SIZE];
+		}
+	}
+
+	~BlockReader() {
+		if (_compressed)
+			inflateEnd(&_stream);
+		delete[] _buf;
+	}
+
+	bool read(byte *out, uint64 len) {
+		if (!_compressed) {
+			if (len > _end - _pos || !_source.read(_pos, out, len))
+				return false;
+			_pos += len;
+			return true;
+		}
+
+		// zlib counts in 32 bits, 64 bit patches may ask for more
+		while (len) {
+			uint32 step = len < 0x40000000 ? len : 0x40000000;
+			_stream.next_out = out;
+			_stream.avail_out = step;
+			while (_zlibErr == Z_OK && _stream.avail_out) {
+				if (_stream.avail_in == 0 && !refill())
+					return false;
+				_zlibErr = inflate(&_stream, Z_NO_FLUSH);
+			}
+			if (_stream.avail_out != 0 || (_zlibErr != Z_OK && _zlibErr != Z_STREAM_END))
+				return false;
+			out += step;
+			len -= step;
+		}
+		return true;
+	}
+
+private:
+	bool refill() {
+		if (_pos >= _end)
+			return false;
+		uint64 left = _end - _pos;
+		if (_source.data) {
+			uint32 step = left < 0x40000000 ? left : 0x40000000;
+			_stream.next_in = const_cast<byte *>(_source.data + _pos);
+			_stream.avail_in = step;
+			_pos += step;
+			return true;
+		}
+		uint32 step = left < PATCH_BUFFER_SIZE ? left : PATCH_BUFFER_SIZE;
+		if (!_source.read(_pos, _buf, step))
+			return false;
+		_stream.next_in = _buf;
+		_stream.avail_in = step;
+		_pos += step;
+		return true;
+	}
+
+	const DataRange &_source;
+	uint64 _pos;
+	uint64 _end;
+	bool _compressed;
+	z_stream _stream;
+	int _zlibErr;
+	byte *_buf;
+};
+
+PatchReadStream::PatchReadStream(const DataRange &oldData, const DataRange &patch) : _old(oldData), _patch(patch),
+	_ctrl(0), _diff(0), _extra(0), _oldBuf(0), _oldPos(0), _newPos(0), _diffLeft(0), _extraLeft(0), _seek(0),
+	_err(true) {
+	memset(&_header, 0, sizeof(_header));
+
+	byte header[PATCH_HEADER64_SIZE];
+	uint32 headerSize = _patch.size < PATCH_HEADER64_SIZE ? _patch.size : PATCH_HEADER64_SIZE;
+	if (!_patch.read(0, header, headerSize) || !parsePatchHeader(header, headerSize, _header) ||
+			!checkBlockSizes(_header, _patch.size))
+		return;
+
+	uint64 ctrlStart = _header.headerSize;
+	uint64 diffStart = ctrlStart + _header.ctrlSize;
+	_ctrl = new BlockReader(_patch, ctrlStart, _header.ctrlSize, (_header.flags & PATCH_FLAG_COMPRESS_CTRL) != 0);
+	_diff = new BlockReader(_patch, diffStart, _header.diffSize, true);
+	if (_header.flags & PATCH_FLAG_MIX_DIFF_EXTRA)
+		_extra = _diff;
+	else
+		_extra = new BlockReader(_patch, diffStart + _header.diffSize, _header.extraSize, true);
+	_oldBuf = new byte[PATCH_BUFFER_SIZE];
+	_err = false;
+}
+
+PatchReadStream::~PatchReadStream() {
+	if (_extra != _diff)
+		delete _extra;
+	delete _diff;
+	delete _ctrl;
+	delete[] _oldBuf;
+}
+
+bool PatchReadStream::matches() const {
+	if (_err || _old.size != _header.oldSize)
+		return false;
+
+	byte start[PATCH_MD5_LENGTH];
+	uint32 len = _old.size < PATCH_MD5_LENGTH ? _old.size : PATCH_MD5_LENGTH;
+	return _old.read(0, start, len) && checkMD5(_header, start, len);
+}
+
+bool PatchReadStream::nextCommand(PatchCommand &command) {
+	if (_err || eos() || _diffLeft || _extraLeft)
+		return false;
+
+	byte buf[24];
+	uint64 diffLen, extraLen;
+	if (!_ctrl->read(buf, _header.ctrlEntrySize)) {
+		_err = true;
+		return false;
+	}
+	_oldPos += _seek;
+	readPatchCtrl(_header, buf, diffLen, extraLen, _seek);
+	uint64 left = _header.newSize - _newPos;
+	if (diffLen > left || extraLen > left - diffLen) {
+		_err = true;
+		return false;
+	}
+
+	_diffLeft = diffLen;
+	_extraLeft = extraLen;
+	command.diffLen = diffLen;
+	command.extraLen = extraLen;
+	command.seek = _seek;
+	command.oldPos = _oldPos;
+	return true;
+}
+
+// Xor out with the old data from _oldPos on. Bytes that fall outside of the
+// old file are taken as is.
+bool PatchReadStream::xorOldData(byte *out, uint64 len) {
+	int64 start = (int64)_oldPos;
+	int64 first = start < 0 ? 0 : start;
+	int64 last = start + (int64)len < (int64)_old.size ? start + (int64)len : (int64)_old.size;
+	for (int64 pos = first; pos < last; pos += PATCH_BUFFER_SIZE) {
+		uint32 step = last - pos < PATCH_BUFFER_SIZE ? last - pos : PATCH_BUFFER_SIZE;
+		if (!_old.read(pos, _oldBuf, step))
+			return false;
+		byte *dst = out + (pos - start);
+		for (uint32 i = 0; i < step; i++)
+			dst[i] ^= _oldBuf[i];
+	}
+	return true;
+}
+
+uint64 PatchReadStream::read(void *dataPtr, uint64 dataSize) {
+	byte *out = (byte *)dataPtr;
+	uint64 done = 0;
+	while (done < dataSize && !_err && !eos()) {
+		if (_diffLeft == 0 && _extraLeft == 0) {
+			PatchCommand command;
+			if (!nextCommand(command))
+				break;
+			continue;
+		}
+
+		uint64 len = dataSize - done;
+		if (_diffLeft) {
+			if (len > _diffLeft)
+				len = _diffLeft;
+			if (!_diff->read(out + done, len) || !xorOldData(out + done, len)) {
+				_err = true;
+				break;
+			}
+			_oldPos += len;
+			_diffLeft -= len;
+		} else {
+			if (len > _extraLeft)
+				len = _extraLeft;
+			if (!_extra->read(out + done, len)) {
+				_err = true;
+				break;
+			}
+			_extraLeft -= len;
+		}
+		_newPos += len;
+		done += len;
+	}
+	return done;
+}
+
+bool applyPatch(const byte *oldData, uint64 oldSize, const byte *patch, uint64 patchSize, std::vector<byte> &out) {
+	PatchReadStream stream(DataRange(oldData, oldSize), DataRange(patch, patchSize));
+	if (stream.size() != (size_t)stream.size()) {
+		fprintf(stderr, "The patched file is too large to be held in memory\n");
+		return false;
+	}
+	out.resize(stream.size());
+	if (stream.err() || (!out.empty() && stream.read(&out[0], out.size()) != out.size())) {
+		fprintf(stderr, "Corrupt patch\n");
+		return false;
+	}
+	return true;
+}
+
+#else
+
+PatchReadStream::PatchReadStream(const DataRange &oldData, const DataRange &patch) : _old(oldData), _patch(patch),
+	_ctrl(0), _diff(0), _extra(0), _oldBuf(0), _oldPos(0), _newPos(0), _diffLeft(0), _extraLeft(0), _seek(0),
+	_err(true) {
+	memset(&_header, 0, sizeof(_header));
+	fprintf(stderr, "Patches need zlib support\n");
+}
+
+PatchReadStream::~PatchReadStream() {
+}
+
+bool PatchReadStream::matches() const {
+	return false;
+}
+
+bool PatchReadStream::nextCommand(PatchCommand &command) {
+	return false;
+}
+
+uint64 PatchReadStream::read(void *dataPtr, uint64 dataSize) {
+	return 0;
+}
+
+bool applyPatch(const byte *oldData, uint64 oldSize, const byte *patch, uint64 patchSize, std::vector<byte> &out) {
+	fprintf(stderr, "Patches need zlib support\n");
+	return false;
+}
+
+#endif
+
+} // End of namespace Common
@@ -0,0 +1,165 @@
+/* ResidualVM - A 3D game interpreter
+*
+* ResidualVM is the legal property of its developers, whose names
+* are too numerous to list here. Please refer to the AUTHORS
+* file distributed with this source distribution.
+
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+
+* You should have received a copy of the GNU Lesser General Public
+* License along with this library; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*
+*/
+
+#ifndef COMMON_PATCH_H
+#define COMMON_PATCH_H
+
+#include "common/scummsys.h"
+
+#include <vector>
+
+// See doc/ResidualVM-Patch.txt for the layout of a patch
+#define PATCH_HEADER_SIZE 48
+#define PATCH_HEADER64_SIZE 68		// Version 3, with 64 bit sizes and positions
+#define PATCH_MD5_LENGTH 5000
+#define PATCH_FLAG_MIX_DIFF_EXTRA (1 << 0)
+#define PATCH_FLAG_COMPRESS_CTRL (1 << 1)
+
+namespace Common {
+
+/** The header of a patch built by diffr. */
+struct PatchHeader {
+	uint16 versionMajor;
+	uint16 versionMinor;
+	uint32 flags;
+	byte md5[16];		// Of the first PATCH_MD5_LENGTH bytes of the old file
+	uint64 oldSize;
+	uint64 newSize;
+	uint64 ctrlSize;
+	uint64 diffSize;
+	uint64 extraSize;
+	uint32 headerSize;	// Where the ctrl block starts
+	uint32 ctrlEntrySize;	// Size of a (diff, extra, seek) triple
+};
+
+/**
+ * Parse the header at the start of data, which needs to hold at least
+ * PATCH_HEADER64_SIZE bytes or the whole patch, whichever is smaller.
+ * The sizes of the blocks aren't checked against anything. Returns false
+ * if the data isn't a patch or uses a version this code can't apply.
+ */
+bool parsePatchHeader(const byte *data, uint64 size, PatchHeader &header);
+
+/**
+ * Parse the header of a patch held in memory. Returns false if the data
+ * isn't a patch, is truncated, or uses a version this code can't apply.
+ */
+bool readPatchHeader(const byte *patch, uint64 patchSize, PatchHeader &header);
+
+/** Decode the ctrl triple at data, of header.ctrlEntrySize bytes. */
+void readPatchCtrl(const PatchHeader &header, const byte *data, uint64 &diffLen, uint64 &extraLen, int64 &seek);
+
+/** Whether the patch targets the given old file, by size and md5. */
+bool patchMatches(const PatchHeader &header, const byte *oldData, uint64 oldSize);
+
+/**
+ * Apply a patch entirely in memory, without going through any file.
+ * out is resized to the size of the new file. The caller is expected to
+ * have checked patchMatches() first. On failure a diagnostic is printed
+ * on stderr and false is returned.
+ */
+bool applyPatch(const byte *oldData, uint64 oldSize, const byte *patch, uint64 patchSize, std::vector<byte> &out);
+
+/**
+ * A range of bytes to read from, either in memory or at some offset of a
+ * file descriptor, such as a file stored in a lab.
+ */
+struct DataRange {
+	DataRange(const byte *ptr, uint64 len) : data(ptr), fd(-1), offset(0), size(len) {}
+	DataRange(int file, uint64 start, uint64 len) : data(0), fd(file), offset(start), size(len) {}
+
+	/** Read len bytes at pos, relative to the start of the range. */
+	bool read(uint64 pos, byte *out, uint64 len) const;
+
+	const byte *data;
+	int fd;
+	uint64 offset;
+	uint64 size;
+};
+
+/** One command of the ctrl block of a patch. */
+struct PatchCommand {
+	uint64 diffLen;		// Bytes of the diff block, xored with the old data
+	uint64 extraLen;	// Bytes of the extra block, taken as is
+	int64 seek;			// Move in the old data once both are done
+	uint64 oldPos;		// Where the diff reads the old data
+};
+
+class BlockReader;
+
+/**
+ * The new file of a patch, produced on the fly from the old data as it is
+ * read. Only the inflate state of the blocks and a small buffer for the old
+ * data are kept, whatever the size of the files, so the result can be
+ * streamed straight to disk or into a lab. Reading is sequential.
+ */
+class PatchReadStream {
+public:
+	/**
+	 * Both ranges have to stay valid as long as the stream is used. A patch
+	 * that can't be parsed leaves the stream in the error state.
+	 */
+	PatchReadStream(const DataRange &oldData, const DataRange &patch);
+	~PatchReadStream();
+
+	const PatchHeader &getHeader() const { return _header; }
+
+	/** Whether the patch targets the old data, by size and md5. */
+	bool matches() const;
+
+	/**
+	 * Read up to dataSize bytes of the new file. Fewer are only returned at
+	 * the end of the file or if the patch turns out to be corrupt.
+	 */
+	uint64 read(void *dataPtr, uint64 dataSize);
+
+	/**
+	 * Start the next command of the ctrl block, and describe it. This is
+	 * only possible once the data of the previous command has been read in
+	 * full; read() otherwise moves on to the next command by itself.
+	 */
+	bool nextCommand(PatchCommand &command);
+
+	bool err() const { return _err; }
+	bool eos() const { return _newPos >= _header.newSize; }
+	uint64 pos() const { return _newPos; }
+	uint64 size() const { return _header.newSize; }
+
+private:
+	PatchReadStream(const PatchReadStream &);
+	PatchReadStream &operator=(const PatchReadStream &);
+
+	bool xorOldData(byte *out, uint64 len);
+
+	DataRange _old;
+	DataRange _patch;
+	PatchHeader _header;
+	BlockReader *_ctrl;
+	BlockReader *_diff;
+	BlockReader *_extra;
+	byte *_oldBuf;
+	uint64 _oldPos;
+	uint64 _newPos;
+	uint64 _diffLeft;
+	uint64 _extraLeft;
+	int64 _seek;
+	bool _err;
+};
+
+} // End of namespace Common
+
+#endif
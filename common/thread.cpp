@@ -0,0 +1,198 @@
+/* ResidualVM - A 3D game interpreter
+*
+* ResidualVM is the legal property of its developers, whose names
+* are too numerous to list here. Please refer to the AUTHORS
+* file distributed with this source distribution.
+
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+
+* You should have received a copy of the GNU Lesser General Public
+* License along with this library; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*
+*/
+
+#include "common/thread.h"
+
+#ifdef POSIX
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+namespace Common {
+
+uint32 getNumCPUs() {
+#if defined(POSIX) && defined(_SC_NPROCESSORS_ONLN)
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	if (count > 0)
+		return count;
+#endif
+	return 1;
+}
+
+#ifdef POSIX
+
+struct ParallelJob {
+	pthread_mutex_t mutex;
+	uint32 next;
+	uint32 count;
+	ParallelProc proc;
+	void *arg;
+};
+
+static void *parallelWorker(void *data) {
+	ParallelJob *job = (ParallelJob *)data;
+	for (;;) {
+		pthread_mutex_lock(&job->mutex);
+		uint32 index = job->next;
+		if (index < job->count)
+			job->next++;
+		pthread_mutex_unlock(&job->mutex);
+
+		if (index >= job->count)
+			break;
+		job->proc(index, job->arg);
+	}
+	return 0;
+}
+
+#endif
+
+void parallelFor(uint32 count, uint32 numThreads, ParallelProc proc, void *arg) {
+	if (numThreads > count)
+		numThreads = count;
+
+#ifdef POSIX
+	if (numThreads > 1) {
+		ParallelJob job;
+		pthread_mutex_init(&job.mutex, 0);
+		job.next = 0;
+		job.count = count;
+		job.proc = proc;
+		job.arg = arg;
+
+		// The calling thread is one of the workers
+		pthread_t *threads = new pthread_t[numThreads - 1];
+		uint32 started = 0;
+		for (; started < numThreads - 1; started++)
+			if (pthread_create(&threads[started], 0, parallelWorker, &job) != 0)
+				break;
+		parallelWorker(&job);
+		for (uint32 i = 0; i < started; i++)
+			pthread_join(threads[i], 0);
+
+		delete[] threads;
+		pthread_mutex_destroy(&job.mutex);
+		return;
+	}
+#endif
+
+	for (uint32 i = 0; i < count; i++)
+		proc(i, arg);
+}
+
+Mutex::Mutex() : _mutex(0) {
+#ifdef POSIX
+	pthread_mutex_t *mutex = new pthread_mutex_t;
+	pthread_mutex_init(mutex, 0);
+	_mutex = mutex;
+#endif
+}
+
+Mutex::~Mutex() {
+#ifdef POSIX
+	pthread_mutex_destroy((pthread_mutex_t *)_mutex);
+	delete (pthread_mutex_t *)_mutex;
+#endif
+}
+
+void Mutex::lock() {
+#ifdef POSIX
+	pthread_mutex_lock((pthread_mutex_t *)_mutex);
+#endif
+}
+
+void Mutex::unlock() {
+#ifdef POSIX
+	pthread_mutex_unlock((pthread_mutex_t *)_mutex);
+#endif
+}
+
+Condition::Condition() : _cond(0) {
+#ifdef POSIX
+	pthread_cond_t *cond = new pthread_cond_t;
+	pthread_cond_init(cond, 0);
+	_cond = cond;
+#endif
+}
+
+Condition::~Condition() {
+#ifdef POSIX
+	pthread_cond_destroy((pthread_cond_t *)_cond);
+	delete (pthread_cond_t *)_cond;
+#endif
+}
+
+void Condition::wait(Mutex &mutex) {
+#ifdef POSIX
+	pthread_cond_wait((pthread_cond_t *)_cond, (pthread_mutex_t *)mutex._mutex);
+#endif
+}
+
+void Condition::signal() {
+#ifdef POSIX
+	pthread_cond_signal((pthread_cond_t *)_cond);
+#endif
+}
+
+void Condition::broadcast() {
+#ifdef POSIX
+	pthread_cond_broadcast((pthread_cond_t *)_cond);
+#endif
+}
+
+Thread::Thread() : _thread(0), _proc(0), _arg(0) {
+}
+
+Thread::~Thread() {
+	join();
+}
+
+void *Thread::run(void *self) {
+	Thread *thread = (Thread *)self;
+	thread->_proc(thread->_arg);
+	return 0;
+}
+
+bool Thread::start(ThreadProc proc, void *arg) {
+	if (_thread)
+		return false;
+#ifdef POSIX
+	_proc = proc;
+	_arg = arg;
+	pthread_t *thread = new pthread_t;
+	if (pthread_create(thread, 0, run, this) != 0) {
+		delete thread;
+		return false;
+	}
+	_thread = thread;
+	return true;
+#else
+	return false;
+#endif
+}
+
+void Thread::join() {
+#ifdef POSIX
+	if (!_thread)
+		return;
+	pthread_join(*(pthread_t *)_thread, 0);
+	delete (pthread_t *)_thread;
+	_thread = 0;
+#endif
+}
+
+} // End of namespace Common
@@ -0,0 +1,112 @@
+/* ResidualVM - A 3D game interpreter
+*
+* ResidualVM is the legal property of its developers, whose names
+* are too numerous to list here. Please refer to the AUTHORS
+* file distributed with this source distribution.
+
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+
+* You should have received a copy of the GNU Lesser General Public
+* License along with this library; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*
+*/
+
+#ifndef COMMON_THREAD_H
+#define COMMON_THREAD_H
+
+#include "common/scummsys.h"
+
+namespace Common {
+
+typedef void (*ParallelProc)(uint32 index, void *arg);
+typedef void (*ThreadProc)(void *arg);
+
+/** Number of online processors, at least 1. */
+uint32 getNumCPUs();
+
+/**
+ * Call proc(i, arg) for every i in [0, count) on a pool of numThreads
+ * workers. Indices are handed out in increasing order as workers become
+ * free, so jobs sorted by file offset are still issued roughly sequentially.
+ * With numThreads <= 1, or without thread support, the loop runs serially
+ * on the calling thread.
+ */
+void parallelFor(uint32 count, uint32 numThreads, ParallelProc proc, void *arg);
+
+/**
+ * Plain non-recursive mutex, for the few places where parallelFor() workers
+ * have to share a resource. Without thread support it does nothing.
+ */
+class Mutex {
+public:
+	Mutex();
+	~Mutex();
+
+	void lock();
+	void unlock();
+
+private:
+	friend class Condition;
+
+	Mutex(const Mutex &);
+	Mutex &operator=(const Mutex &);
+
+	void *_mutex;
+};
+
+/**
+ * Condition variable, waited on with a locked Mutex. Without thread
+ * support waiting returns at once, there being nobody to wait for.
+ */
+class Condition {
+public:
+	Condition();
+	~Condition();
+
+	/** Unlock mutex, wait to be woken up, and lock it again. */
+	void wait(Mutex &mutex);
+	/** Wake up one waiting thread. */
+	void signal();
+	/** Wake up every waiting thread. */
+	void broadcast();
+
+private:
+	Condition(const Condition &);
+	Condition &operator=(const Condition &);
+
+	void *_cond;
+};
+
+/**
+ * A thread running proc(arg) in the background until join() is called.
+ * start() returns false if the thread could not be created, or without
+ * thread support, in which case callers do the work themselves.
+ */
+class Thread {
+public:
+	Thread();
+	~Thread();
+
+	bool start(ThreadProc proc, void *arg);
+	bool isRunning() const { return _thread != 0; }
+	/** Wait for proc to return. Does nothing if the thread isn't running. */
+	void join();
+
+private:
+	Thread(const Thread &);
+	Thread &operator=(const Thread &);
+
+	void *_thread;
+	ThreadProc _proc;
+	void *_arg;
+
+	static void *run(void *self);
+};
+
+} // End of namespace Common
+
+#endif
@@ -32,6 +32,46 @@
 
 #if defined(USE_ZLIB)
 
+namespace Common {
+
+bool uncompress(byte *dst, unsigned long *dstLen, const byte *src, unsigned long srcLen) {
+	return Z_OK == ::uncompress(dst, dstLen, src, srcLen);
+}
+
+bool decompress(std::vector<byte> &dst, const byte *src, unsigned long srcLen) {
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	// Detect the gzip or zlib header, as GZipReadStream does
+	if (inflateInit2(&stream, MAX_WBITS + 32) != Z_OK)
+		return false;
+
+	dst.resize(srcLen * 4 + 64);
+	stream.next_in = const_cast<byte *>(src);
+	stream.avail_in = srcLen;
+	int err = Z_OK;
+	while (err == Z_OK) {
+		if (stream.total_out == dst.size())
+			dst.resize(dst.size() * 2);
+		stream.next_out = &dst[stream.total_out];
+		stream.avail_out = dst.size() - stream.total_out;
+		err = inflate(&stream, Z_NO_FLUSH);
+	}
+	dst.resize(stream.total_out);
+	inflateEnd(&stream);
+	return err == Z_STREAM_END;
+}
+
+bool compress(std::vector<byte> &dst, const byte *src, unsigned long srcLen, int level) {
+	unsigned long dstLen = compressBound(srcLen);
+	dst.resize(dstLen ? dstLen : 1);
+	if (::compress2(&dst[0], &dstLen, src, srcLen, level) != Z_OK)
+		return false;
+	dst.resize(dstLen);
+	return true;
+}
+
+} // End of namespace Common
+
 GZipReadStream::GZipReadStream(std::ifstream *w, uint32 start, uint32 size_p) : _wrapped(w), _stream(), _start(start), _size(size_p) {
 	char buf[4];
 	assert(w != 0);
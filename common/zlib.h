@@ -35,6 +35,31 @@
   #error Version 1.2.0.4 or newer of zlib is required for this code
   #endif
 
+#include <fstream>
+#include <vector>
+
+namespace Common {
+
+/**
+ * Thin wrapper around the uncompress() function in zlib. The destination
+ * must be large enough for the whole result; on success dstLen is set to
+ * the number of bytes produced.
+ */
+bool uncompress(byte *dst, unsigned long *dstLen, const byte *src, unsigned long srcLen);
+
+/**
+ * Inflate a whole gzip or zlib stream into dst, whose size isn't known
+ * in advance. dst is resized to the number of bytes produced.
+ */
+bool decompress(std::vector<byte> &dst, const byte *src, unsigned long srcLen);
+
+/**
+ * Deflate a whole buffer into dst, in the zlib format, at the given level.
+ */
+bool compress(std::vector<byte> &dst, const byte *src, unsigned long srcLen, int level = Z_DEFAULT_COMPRESSION);
+
+} // End of namespace Common
+
 /**
  * A simple wrapper class which can be used to wrap around an arbitrary
  * other std::ifstream and will then provide on-the-fly decompression support.
@@ -0,0 +1,58 @@
+# -------- Generated by configure -----------
+
+CXX := g++
+CXXFLAGS :=   -g -ansi -W -Wno-unused-parameter -Wno-empty-body -pedantic 
+LD := g++
+LIBS +=  -lm  -lz
+RANLIB := ranlib
+STRIP := strip
+AR := ar cru
+AS := as
+ASFLAGS := 
+WINDRES := windres
+WINDRESFLAGS := 
+STAGINGPATH=staging
+WIN32PATH=C:/residualvm-tools
+AOS4PATH=Games:ResidualVM-tools
+STATICLIBPATH=/sw
+
+MODULES += 
+MODULE_DIRS += 
+EXEPRE := 
+EXEEXT := 
+
+prefix = /usr/local
+exec_prefix = ${prefix}
+bindir = ${exec_prefix}/bin
+libdir = ${exec_prefix}/lib
+datarootdir = ${prefix}/share
+datadir = ${datarootdir}/residualvm
+mandir = ${datarootdir}/man
+docdir = ${datarootdir}/doc/residualvm
+
+
+HAVE_GCC = 1
+HAVE_GCC3 = 1
+CXX_UPDATE_DEP_FLAG = -MMD -MF "$(*D)/$(DEPDIR)/$(*F).d" -MQ "$@" -MP
+POSIX = 1
+# VERBOSE_BUILD = 1
+# USE_VORBIS = 1
+# USE_TREMOR = 1
+# USE_FLAC = 1
+# USE_MAD = 1
+USE_ZLIB = 1
+
+INCLUDES +=  
+OBJS += 
+DEFINES +=  -DPOSIX -DDATA_PATH=\"${datarootdir}/residualvm\" -DPLUGIN_DIRECTORY=\"${exec_prefix}/lib/residualvm\"
+LDFLAGS += 
+
+port_mk = ports.mk
+
+SAVED_CONFIGFLAGS  := 
+SAVED_LDFLAGS      := 
+SAVED_CXX          := 
+SAVED_CXXFLAGS     := 
+SAVED_CPPFLAGS     := 
+SAVED_ASFLAGS      := 
+SAVED_WINDRESFLAGS := 
@@ -0,0 +1,230 @@
+#!/bin/sh
+# Round trip checks of the lab and patch tools: build labs and patches, read
+# them back with the other tools and compare with the original files.
+#
+# Usage: roundtrip.sh [TOOLS_DIR]  (default tools)
+
+TOOLS=${1:-tools}
+case $TOOLS in
+/*) ;;
+*) TOOLS=`pwd`/$TOOLS ;;
+esac
+
+WORK=`mktemp -d "${TMPDIR:-/tmp}/roundtrip.XXXXXX"` || exit 1
+trap 'rm -rf "$WORK"' 0
+trap 'exit 1' 1 2 15
+cd "$WORK" || exit 1
+
+failures=0
+
+pass() {
+	echo "ok   $1"
+}
+
+fail() {
+	echo "FAIL $1"
+	failures=`expr $failures + 1`
+}
+
+# Write N as a little endian 32 or 64 bit integer
+le32() {
+	printf "\\$(printf %03o $(($1 & 255)))\\$(printf %03o $(($1 >> 8 & 255)))"
+	printf "\\$(printf %03o $(($1 >> 16 & 255)))\\$(printf %03o $(($1 >> 24 & 255)))"
+}
+
+le64() {
+	le32 $(($1 & 4294967295))
+	le32 $(($1 >> 32))
+}
+
+# Extract LAB into directory OUT and compare it with directory REF
+check_unlab() {
+	rm -rf out && mkdir out || return 1
+	(cd out && "$TOOLS/unlab" "../$1" > /dev/null) || return 1
+	diff -r "$2" out > /dev/null
+}
+
+# Source files: text, a larger binary-ish file, an empty one and duplicates
+mkdir src
+awk 'BEGIN { for (i = 0; i < 4000; i++) printf "line %d of the dialog script, say %d\n", i, i * 7919 % 1000 }' > src/script.txt
+awk 'BEGIN { srand(1); for (i = 0; i < 20000; i++) printf "%c", 32 + int(rand() * 90) }' > src/noise.bin
+: > src/empty.dat
+cp src/script.txt src/copy.txt
+echo "short" > src/a.cfg
+
+# mklab -> unlab
+for game in grim emi; do
+	for opts in "" "--compress" "--align 4096" "--no-dedup" "--compress --align 512"; do
+		name="mklab --$game $opts"
+		rm -f test.lab test.lab.stamps
+		if "$TOOLS/mklab" $opts --$game src test.lab > /dev/null && check_unlab test.lab src; then
+			pass "$name"
+		else
+			fail "$name"
+		fi
+	done
+done
+
+# mklab --update after changing, adding and removing files
+for opts in "" "--compress"; do
+	name="mklab --update $opts"
+	rm -rf upd test.lab test.lab.stamps
+	cp -r src upd
+	"$TOOLS/mklab" $opts --grim upd test.lab > /dev/null
+	echo "changed" >> upd/script.txt
+	cp src/noise.bin upd/new.bin
+	rm upd/a.cfg
+	if "$TOOLS/mklab" --update test.lab upd > /dev/null && check_unlab test.lab upd; then
+		pass "$name"
+	else
+		fail "$name"
+	fi
+done
+
+# A hand made lab with a 64 bit directory (LAB_FLAG_64BIT)
+{
+	printf LABN; le32 65538; le32 2; le32 12
+	le64 0; le64 92; le64 5; le64 5
+	le64 6; le64 97; le64 6; le64 6
+	printf 'a.txt\000b.txt\000'
+	printf hello
+	printf 'world\n'
+} > wide.lab
+mkdir wide && printf hello > wide/a.txt && printf 'world\n' > wide/b.txt
+if check_unlab wide.lab wide; then
+	pass "unlab 64 bit directory"
+else
+	fail "unlab 64 bit directory"
+fi
+
+# The same with the data past 4 GiB, when the file system has sparse files
+{
+	printf LABN; le32 65538; le32 1; le32 6
+	le64 0; le64 5368709120; le64 5; le64 5
+	printf 'a.txt\000'
+} > far.lab
+if dd if=wide/a.txt of=far.lab bs=1 seek=5368709120 conv=notrunc 2> /dev/null &&
+   [ `du -k far.lab | cut -f1` -lt 1024 ]; then
+	rm -rf far && mkdir far && cp wide/a.txt far/
+	if check_unlab far.lab far; then
+		pass "unlab offsets past 4 GiB"
+	else
+		fail "unlab offsets past 4 GiB"
+	fi
+else
+	echo "skip unlab offsets past 4 GiB (no sparse files)"
+fi
+rm -f far.lab
+
+# labcompact -> labverify, plain and compressed
+for opts in "" "--compress"; do
+	rm -f test.lab test.lab.stamps
+	"$TOOLS/mklab" $opts --emi src test.lab > /dev/null
+	for sort in "" "--sort name" "--sort size --align 4096"; do
+		name="labcompact $sort ($opts)"
+		rm -f compact.lab compact.lab.sum
+		if "$TOOLS/labcompact" $sort test.lab compact.lab > /dev/null &&
+		   "$TOOLS/labverify" --create compact.lab > /dev/null &&
+		   "$TOOLS/labverify" compact.lab > /dev/null && check_unlab compact.lab src; then
+			pass "$name"
+		else
+			fail "$name"
+		fi
+	done
+done
+
+# labverify finds a damaged file
+rm -f test.lab test.lab.stamps test.lab.sum
+"$TOOLS/mklab" --grim src test.lab > /dev/null
+"$TOOLS/labverify" --create test.lab > /dev/null
+size=`wc -c < test.lab`
+printf X | dd of=test.lab bs=1 seek=`expr $size - 100` conv=notrunc 2> /dev/null
+if "$TOOLS/labverify" test.lab > /dev/null 2>&1; then
+	fail "labverify damaged lab"
+else
+	pass "labverify damaged lab"
+fi
+
+# labcopy
+rm -f test.lab test.lab.stamps copy.lab
+"$TOOLS/mklab" --grim src test.lab > /dev/null
+if "$TOOLS/labcopy" -a --verify test.lab copy.lab > /dev/null && cmp -s test.lab copy.lab; then
+	pass "labcopy"
+else
+	fail "labcopy"
+fi
+
+# mkcatalog: a file in two labs is read from the one given with -p, the
+# same way as from the lab itself and as a plain file
+sklb() {
+	le32 1
+	printf "$1"; head -c `expr 32 - ${#1}` /dev/zero
+	printf root; head -c 28 /dev/zero
+	le32 1065353216; le32 1073741824; le32 1077936128
+	le32 0; le32 0; le32 0; le32 1065353216
+}
+mkdir -p cat/one cat/two
+sklb first > cat/one/bone.sklb
+sklb second > cat/two/bone.sklb
+cp src/a.cfg cat/one/
+"$TOOLS/mklab" --emi cat/one cat/one.lab > /dev/null
+"$TOOLS/mklab" --emi cat/two cat/two.lab > /dev/null
+rm -rf cat/one cat/two cat/*.stamps
+"$TOOLS/sklb2txt" cat/two.lab bone.sklb > from_lab.txt
+mkdir plain && sklb second > plain/bone.sklb
+"$TOOLS/sklb2txt" plain/bone.sklb > from_file.txt
+if "$TOOLS/mkcatalog" -p two.lab cat > /dev/null &&
+   "$TOOLS/sklb2txt" cat/labs.cat bone.sklb > from_cat.txt &&
+   grep -q second from_file.txt && cmp -s from_file.txt from_lab.txt && cmp -s from_file.txt from_cat.txt; then
+	pass "mkcatalog"
+else
+	fail "mkcatalog"
+fi
+
+# diffr -> patchr and labpatch
+mkdir old new
+cp src/script.txt old/data.bin
+sed -e 's/dialog/DIALOG/; 500,700d; 2000a\
+an inserted line' src/script.txt > new/data.bin
+cat src/noise.bin >> old/data.bin
+cat src/noise.bin >> new/data.bin
+rm -f test.lab test.lab.stamps
+"$TOOLS/mklab" --grim old test.lab > /dev/null
+for opts in "" "-s sais" "-s qsufsort" "-j 2" "-M 1" "-w" "-m" "-n" "-m -n -w"; do
+	name="diffr $opts"
+	rm -rf data.bin.patchr patched.bin patched.lab
+	if "$TOOLS/diffr" $opts old/data.bin new/data.bin data.bin.patchr > /dev/null 2>&1 &&
+	   "$TOOLS/patchr" old/data.bin patched.bin data.bin.patchr > /dev/null &&
+	   cmp -s new/data.bin patched.bin &&
+	   "$TOOLS/labpatch" -q test.lab patched.lab data.bin.patchr > /dev/null &&
+	   check_unlab patched.lab new; then
+		pass "$name"
+	else
+		fail "$name"
+	fi
+	case $opts in
+	*-w*)
+		if "$TOOLS/patchr" -a old/data.bin patched.bin data.bin.patchr | grep -q "PatchR v3"; then
+			pass "$name writes version 3"
+		else
+			fail "$name writes version 3"
+		fi
+		;;
+	esac
+done
+
+# labpatch on a compressed lab
+rm -f test.lab test.lab.stamps data.bin.patchr patched.lab
+"$TOOLS/mklab" --compress --emi old test.lab > /dev/null
+"$TOOLS/diffr" old/data.bin new/data.bin data.bin.patchr > /dev/null 2>&1
+if "$TOOLS/labpatch" -q test.lab patched.lab data.bin.patchr > /dev/null && check_unlab patched.lab new; then
+	pass "labpatch compressed lab"
+else
+	fail "labpatch compressed lab"
+fi
+
+if [ $failures -ne 0 ]; then
+	echo "$failures round trip checks failed"
+	exit 1
+fi
+echo "All round trip checks passed"
@@ -24,10 +24,13 @@
 #include <tools/lua/lundump.h>
 #include <tools/lua/lopcodes.h>
 #include <tools/lua/lzio.h>
+#include <tools/lua/lstate.h>
+#include <tools/delua.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <setjmp.h>
 #include <ctype.h>
 #include <iostream>
 #include <sstream>
@@ -1313,6 +1316,28 @@ void decompile(std::ostream &os, TProtoFunc *tf, std::string indent_str,
   }
 }
 
+bool decompileChunk(std::ostream &os, const char *data, int32 size, const char *name) {
+  ZIO z;
+  luaZ_mopen(&z, data, size, name);
+
+  // A damaged chunk makes the loader raise a Lua error. Catch it here
+  // instead of letting it end the process.
+  jmp_buf errorJmp;
+  jmp_buf *oldJmp = lua_state->errorJmp;
+  lua_state->errorJmp = &errorJmp;
+  TProtoFunc *tf = NULL;
+  if (setjmp(errorJmp) == 0)
+    tf = luaU_undump1(&z);
+  lua_state->errorJmp = oldJmp;
+
+  if (tf == NULL)
+    return false;
+  decompile(os, tf, "", NULL, 0);
+  return true;
+}
+
+#ifndef DELUA_NO_MAIN
+
 int main(int argc, char *argv[]) {
   int filename_pos = 1;
 
@@ -1343,3 +1368,5 @@ int main(int argc, char *argv[]) {
   lua_close();
   return 0;
 }
+
+#endif
@@ -0,0 +1,38 @@
+/* Residual - A 3D game interpreter
+ *
+ * Residual is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the AUTHORS
+ * file distributed with this source distribution.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ *
+ */
+
+#ifndef TOOLS_DELUA_H
+#define TOOLS_DELUA_H
+
+#include "common/scummsys.h"
+
+#include <iostream>
+
+/**
+ * Decompile a compiled Lua chunk held in memory and write the source to os.
+ * lua_open() must have been called first. The Lua state is global, so
+ * calls must not run concurrently. Returns false if the data isn't a valid
+ * chunk.
+ */
+bool decompileChunk(std::ostream &os, const char *data, int32 size, const char *name);
+
+#endif
@@ -44,10 +44,25 @@
 
 #include <iostream>
 #include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "common/endian.h"
 #include "common/zlib.h"
 #include "common/md5.h"
 #include "common/getopt.h"
+#include "common/thread.h"
+#include "common/fileio.h"
+#include "common/patch.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define MIN(x,y) (((x)<(y)) ? (x) : (y))
 
@@ -162,216 +177,437 @@ static void qsufsort(int32 *I, int32 *V, byte *old, int32 oldsize) {
 		I[V[i]] = i;
 }
 
-static int32 matchlen(byte *old, int32 oldsize, byte *new_block, int32 new_size) {
-	int32 i;
-
-	for (i = 0; (i < oldsize) && (i < new_size); i++)
-		if (old[i] != new_block[i])
-			break;
-
-	return i;
+// Bucket parallel qsufsort. Every pass refines the unsorted groups, the
+// buckets of suffixes sharing their first h bytes, independently of each
+// other. The keys of a pass are copied to K before any group is split, so
+// that a worker never reads the group numbers another one is updating.
+
+struct SortGroup {
+	int32 start;
+	int32 len;
+};
+
+struct SortPass {
+	int32 *I, *V, *K;
+	int32 h;
+	std::vector<SortGroup> groups;
+	std::vector<uint32> batches;	// First group of every batch, then the end
+};
+
+static void swapSuffixes(int32 *I, int32 *K, int32 a, int32 b) {
+	int32 tmp = I[a];
+	I[a] = I[b];
+	I[b] = tmp;
+	tmp = K[a];
+	K[a] = K[b];
+	K[b] = tmp;
 }
 
-static int32 search(int32 *I, byte *old, int32 oldsize,
-                    byte *new_block, int32 newsize, int32 st, int32 en, int32 *pos) {
-	int32 x, y;
+// split() with the keys taken from K, which moves along with I
+static void splitKeyed(int32 *I, int32 *V, int32 *K, int32 start, int32 len) {
+	int32 i, j, k, x, jj, kk;
 
-	if (en - st < 2) {
-		x = matchlen(old + I[st], oldsize - I[st], new_block, newsize);
-		y = matchlen(old + I[en], oldsize - I[en], new_block, newsize);
+	if (len < 16) {
+		for (k = start; k < start + len; k += j) {
+			j = 1;
+			x = K[k];
+			for (i = 1; k + i < start + len; i++) {
+				if (K[k + i] < x) {
+					x = K[k + i];
+					j = 0;
+				};
+				if (K[k + i] == x) {
+					swapSuffixes(I, K, k + j, k + i);
+					j++;
+				};
+			};
+			for (i = 0; i < j; i++) V[I[k + i]] = k + j - 1;
+			if (j == 1) I[k] = -1;
+		};
+		return;
+	};
+
+	x = K[start + len/2];
+	jj = 0;
+	kk = 0;
+	for (i = start; i < start + len; i++) {
+		if (K[i] < x) jj++;
+		if (K[i] == x) kk++;
+	};
+	jj += start;
+	kk += jj;
 
-		if (x > y) {
-			*pos = I[st];
-			return x;
+	i = start;
+	j = 0;
+	k = 0;
+	while (i < jj) {
+		if (K[i] < x) {
+			i++;
+		} else if (K[i] == x) {
+			swapSuffixes(I, K, i, jj + j);
+			j++;
 		} else {
-			*pos = I[en];
-			return y;
-		}
+			swapSuffixes(I, K, i, kk + k);
+			k++;
+		};
 	};
 
-	x = st + (en - st) / 2;
-	if (memcmp(old + I[x], new_block, MIN(oldsize - I[x], newsize)) < 0) {
-		return search(I, old, oldsize, new_block, newsize, x, en, pos);
-	} else {
-		return search(I, old, oldsize, new_block, newsize, st, x, pos);
+	while (jj + j < kk) {
+		if (K[jj + j] == x) {
+			j++;
+		} else {
+			swapSuffixes(I, K, jj + j, kk + k);
+			k++;
+		};
 	};
+
+	if (jj > start) splitKeyed(I, V, K, start, jj - start);
+
+	for (i = 0; i < kk - jj; i++) V[I[jj + i]] = kk - 1;
+	if (jj == kk - 1) I[jj] = -1;
+
+	if (start + len > kk) splitKeyed(I, V, K, kk, start + len - kk);
 }
 
-typedef struct {
-	char *oldfile;
-	char *newfile;
-	char *patchfile;
-	bool mix;
-	bool comp_ctrl;
-} arguments;
+static void takeKeys(uint32 index, void *arg) {
+	SortPass *pass = (SortPass *)arg;
+	for (uint32 g = pass->batches[index]; g < pass->batches[index + 1]; g++) {
+		const SortGroup &group = pass->groups[g];
+		for (int32 i = group.start; i < group.start + group.len; i++)
+			pass->K[i] = pass->V[pass->I[i] + pass->h];
+	}
+}
 
-void show_usage(char *name) {
-	printf("usage: %s [-m][-n] oldfile newfile patchfile\n", name);
+static void splitGroups(uint32 index, void *arg) {
+	SortPass *pass = (SortPass *)arg;
+	for (uint32 g = pass->batches[index]; g < pass->batches[index + 1]; g++)
+		splitKeyed(pass->I, pass->V, pass->K, pass->groups[g].start, pass->groups[g].len);
 }
 
-arguments parse_args(int argc, char *argv[]) {
-	arguments arg;
-	arg.comp_ctrl = true;
-	arg.mix = false;
+static void qsufsortParallel(int32 *I, int32 *V, byte *old, int32 oldsize, uint32 numThreads) {
+	int32 buckets[256];
+	int32 i, len;
 
-	int c;
-	while ((c = getopt (argc, argv, "nm")) != -1)
-		switch (c) {
-		case 'n':
-			arg.comp_ctrl = false;
-			break;
-		case 'm':
-			arg.mix = true;
+	for (i = 0; i < 256; i++) buckets[i] = 0;
+	for (i = 0; i < oldsize; i++) buckets[old[i]]++;
+	for (i = 1; i < 256; i++) buckets[i] += buckets[i-1];
+	for (i = 255; i > 0; i--) buckets[i] = buckets[i-1];
+	buckets[0] = 0;
+
+	for (i = 0; i < oldsize; i++) I[++buckets[old[i]]] = i;
+	I[0] = oldsize;
+	for (i = 0; i < oldsize; i++) V[i] = buckets[old[i]];
+	V[oldsize] = 0;
+	for (i = 1; i < 256; i++) if (buckets[i] == buckets[i-1] + 1) I[buckets[i]] = -1;
+	I[0] = -1;
+
+	SortPass pass;
+	pass.I = I;
+	pass.V = V;
+	pass.K = new int32[oldsize + 1];
+	for (pass.h = 1; ; pass.h += pass.h) {
+		// Merge the sorted runs and list the groups left to split
+		pass.groups.clear();
+		len = 0;
+		for (i = 0; i < oldsize + 1;) {
+			if (I[i] < 0) {
+				len -= I[i];
+				i -= I[i];
+			} else {
+				if (len) I[i-len] = -len;
+				len = 0;
+				SortGroup group = { i, V[I[i]] + 1 - i };
+				pass.groups.push_back(group);
+				i += group.len;
+			};
+		};
+		if (len) I[i-len] = -len;
+		if (pass.groups.empty())
 			break;
-		case '?':
-			show_usage(argv[0]);
-			exit(0);
-		default:
-			fprintf (stderr, "Internal error\n");
-			exit(1);
+
+		// Batches of groups of about the same total size
+		int64 total = 0;
+		for (uint32 g = 0; g < pass.groups.size(); g++)
+			total += pass.groups[g].len;
+		int64 batchSize = total / (numThreads * 16) + 1, sum = 0;
+		pass.batches.clear();
+		pass.batches.push_back(0);
+		for (uint32 g = 0; g < pass.groups.size(); g++) {
+			sum += pass.groups[g].len;
+			if (sum >= batchSize) {
+				pass.batches.push_back(g + 1);
+				sum = 0;
+			}
 		}
+		if (pass.batches.back() != pass.groups.size())
+			pass.batches.push_back(pass.groups.size());
 
-	if (argc - optind < 3) {
-		show_usage(argv[0]);
-		exit(0);
+		Common::parallelFor(pass.batches.size() - 1, numThreads, takeKeys, &pass);
+		Common::parallelFor(pass.batches.size() - 1, numThreads, splitGroups, &pass);
 	}
+	delete[] pass.K;
 
-	arg.oldfile = argv[optind++];
-	arg.newfile = argv[optind++];
-	arg.patchfile = argv[optind++];
-
-	return arg;
+	for (i = 0; i < oldsize + 1; i++)
+		I[V[i]] = i;
 }
 
-int main(int argc, char *argv[]) {
-	byte *old, *new_block;
-	int32 oldsize, newsize, newsize2;
-	int32 *I, *V;
-	int32 scan, pos, len;
-	int32 lastscan, lastpos, lastoffset;
-	int32 oldscore, scsc;
-	int32 s, Sf, lenf, Sb, lenb;
-	int32 overlap, Ss, lens;
-	int32 i;
-	int32 dblen, eblen;
-	uint32 flags = 0;
-	byte *db, *eb;
-	byte buf[4];
-	byte header[48];
-	std::ofstream patch;
-	std::ifstream in;
-	arguments args;
-
-	args = parse_args(argc, argv);
-
-	//Set flags
-	if (args.mix)
-		flags |= 1 << 0;
-	if (args.comp_ctrl)
-		flags |= 1 << 1;
+// Linear time suffix sorting by induced sorting (SA-IS, Nong, Zhang and
+// Chan, 2009). It produces the same array as qsufsort, with the empty
+// suffix first, but needs no V array: only the type of each position (one
+// bit) and the buckets, the reduced problem being solved inside SA itself.
+
+// The old file seen with the empty suffix as a sentinel smaller than any byte
+struct ByteText {
+	const byte *s;
+	int32 size;
+	int32 operator[](int32 i) const { return i < size ? s[i] + 1 : 0; }
+};
+
+// A reduced problem, ending with its own sentinel
+struct NameText {
+	const int32 *s;
+	int32 operator[](int32 i) const { return s[i]; }
+};
+
+#define TYPE_GET(t, i) ((t[(i) >> 3] >> ((i) & 7)) & 1)
+#define TYPE_SET(t, i, b) (t[(i) >> 3] = (b) ? (t[(i) >> 3] | (1 << ((i) & 7))) : (t[(i) >> 3] & ~(1 << ((i) & 7))))
+#define IS_LMS(t, i) ((i) > 0 && TYPE_GET(t, i) && !TYPE_GET(t, (i) - 1))
+
+template<class Text>
+static void getBuckets(const Text &s, int32 *bkt, int32 n, int32 k, bool end) {
+	int32 i, sum = 0;
+
+	for (i = 0; i <= k; i++) bkt[i] = 0;
+	for (i = 0; i < n; i++) bkt[s[i]]++;
+	for (i = 0; i <= k; i++) {
+		sum += bkt[i];
+		bkt[i] = end ? sum : sum - bkt[i];
+	}
+}
 
-	/* Allocate oldsize+1 bytes instead of oldsize bytes to ensure
-	    that we never try to alloc zero elements and get a NULL pointer */
+template<class Text>
+static void induceSA(const Text &s, const byte *t, int32 *SA, int32 *bkt, int32 n, int32 k) {
+	int32 i, j;
 
-	//Read old file
-	in.open(args.oldfile, std::ios::in | std::ios::binary);
-	if (in.fail()) {
-		std::cerr << "Unable to open " << args.oldfile << std::endl;
-		return 1;
+	// L type suffixes from the left, S type ones from the right
+	getBuckets(s, bkt, n, k, false);
+	for (i = 0; i < n; i++) {
+		j = SA[i] - 1;
+		if (j >= 0 && !TYPE_GET(t, j)) SA[bkt[s[j]]++] = j;
 	}
-	in.seekg(0, std::ios::end);
-	oldsize = in.tellg();
-	in.seekg(0);
-	if ((old = new byte[oldsize + 1]) == NULL) {
-		std::cerr << "Unable to allocate memory" << std::endl;
-		return 1;
+	getBuckets(s, bkt, n, k, true);
+	for (i = n - 1; i >= 0; i--) {
+		j = SA[i] - 1;
+		if (j >= 0 && TYPE_GET(t, j)) SA[--bkt[s[j]]] = j;
 	}
-	in.read((char*)old, oldsize);
-	if (in.fail()) {
-		std::cerr << "Unable to read from " << args.oldfile << std::endl;
-		return 1;
+}
+
+// Sort the n suffixes of s, whose characters are in [0, k] and whose last
+// character is a unique sentinel 0
+template<class Text>
+static void sais(const Text &s, int32 *SA, int32 n, int32 k) {
+	int32 i, j;
+	byte *t = new byte[n / 8 + 1];
+	int32 *bkt = new int32[k + 1];
+
+	// S type is 1, L type is 0
+	TYPE_SET(t, n - 1, 1);
+	TYPE_SET(t, n - 2, 0);
+	for (i = n - 3; i >= 0; i--)
+		TYPE_SET(t, i, s[i] < s[i + 1] || (s[i] == s[i + 1] && TYPE_GET(t, i + 1)));
+
+	// Sort the LMS substrings
+	getBuckets(s, bkt, n, k, true);
+	for (i = 0; i < n; i++) SA[i] = -1;
+	for (i = 1; i < n; i++)
+		if (IS_LMS(t, i)) SA[--bkt[s[i]]] = i;
+	induceSA(s, t, SA, bkt, n, k);
+
+	// Compact them at the start of SA and name them
+	int32 n1 = 0;
+	for (i = 0; i < n; i++)
+		if (IS_LMS(t, SA[i])) SA[n1++] = SA[i];
+	for (i = n1; i < n; i++) SA[i] = -1;
+
+	int32 name = 0, prev = -1;
+	for (i = 0; i < n1; i++) {
+		int32 pos = SA[i];
+		bool diff = false;
+		for (int32 d = 0; d < n; d++) {
+			if (prev == -1 || s[pos + d] != s[prev + d] || TYPE_GET(t, pos + d) != TYPE_GET(t, prev + d)) {
+				diff = true;
+				break;
+			} else if (d > 0 && (IS_LMS(t, pos + d) || IS_LMS(t, prev + d))) {
+				break;
+			}
+		}
+		if (diff) {
+			name++;
+			prev = pos;
+		}
+		SA[n1 + pos / 2] = name - 1;
+	}
+	for (i = n - 1, j = n - 1; i >= n1; i--)
+		if (SA[i] >= 0) SA[j--] = SA[i];
+
+	// Sort the LMS suffixes, recursing while their names aren't unique
+	int32 *SA1 = SA, *s1 = SA + n - n1;
+	if (name < n1) {
+		delete[] bkt;
+		NameText reduced = { s1 };
+		sais(reduced, SA1, n1, name - 1);
+		bkt = new int32[k + 1];
+	} else {
+		for (i = 0; i < n1; i++) SA1[s1[i]] = i;
 	}
-	in.close();
 
-	I = new int32[oldsize + 1];
-	V = new int32[oldsize + 1];
-	if (I == NULL || V == NULL) {
-		std::cerr << "Unable to allocate memory" << std::endl;
-		return 1;
+	// Induce the order of all the suffixes from the sorted LMS ones
+	for (i = 1, j = 0; i < n; i++)
+		if (IS_LMS(t, i)) s1[j++] = i;
+	for (i = 0; i < n1; i++) SA1[i] = s1[SA1[i]];
+	for (i = n1; i < n; i++) SA[i] = -1;
+	getBuckets(s, bkt, n, k, true);
+	for (i = n1 - 1; i >= 0; i--) {
+		j = SA[i];
+		SA[i] = -1;
+		SA[--bkt[s[j]]] = j;
 	}
-	qsufsort(I, V, old, oldsize);
+	induceSA(s, t, SA, bkt, n, k);
 
-	delete[] V;
+	delete[] bkt;
+	delete[] t;
+}
 
-	//Read new file
-	in.open(args.newfile, std::ios::in | std::ios::binary);
-	if (in.fail()) {
-		std::cerr << "Unable to open " << args.newfile << std::endl;
-		return 1;
+static void saissort(int32 *I, byte *old, int32 oldsize) {
+	if (oldsize == 0) {
+		I[0] = 0;
+		return;
 	}
-	in.seekg(0, std::ios::end);
-	newsize = in.tellg();
-	in.seekg(0);
-	if ((new_block = new byte[newsize + 1]) == NULL) {
-		std::cerr << "Unable to allocate memory" << std::endl;
-		return 1;
+	ByteText text = { old, oldsize };
+	sais(text, I, oldsize + 1, 256);
+}
+
+// Length of the common prefix of two buffers, comparing 16 or 8 bytes at a
+// time and locating the first difference within the block
+static int32 matchlen(byte *old, int32 oldsize, byte *new_block, int32 new_size) {
+	int32 len = MIN(oldsize, new_size);
+	int32 i = 0;
+
+#if defined(__SSE2__)
+	for (; i + 16 <= len; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(old + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(new_block + i));
+		uint32 mask = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) ^ 0xffff;
+		if (mask)
+			return i + __builtin_ctz(mask);
 	}
-	in.read((char*)new_block, newsize);
-	if (in.fail()) {
-		std::cerr << "Unable to read from " << args.newfile << std::endl;
-		return 1;
+#elif defined(__GNUC__) && defined(SCUMM_LITTLE_ENDIAN)
+	for (; i + 8 <= len; i += 8) {
+		uint64 a, b;
+		memcpy(&a, old + i, 8);
+		memcpy(&b, new_block + i, 8);
+		if (a != b)
+			return i + __builtin_ctzll(a ^ b) / 8;
 	}
-	in.close();
+#endif
+	for (; i < len; i++)
+		if (old[i] != new_block[i])
+			break;
 
+	return i;
+}
 
-	db = new byte[newsize + 1];
-	if (db == NULL) {
-		std::cerr << "Unable to allocate memory" << std::endl;
-		return 1;
-	}
-	if (!args.mix) {
-		eb = new byte[newsize + 1];
-		if (eb == NULL) {
-			std::cerr << "Unable to allocate memory" << std::endl;
-			return 1;
+// Binary search of the suffix in I[st..en] sharing the longest prefix with
+// new_block. All the suffixes between the bounds share the shorter of the
+// bounds' matches with new_block, so every probe skips that prefix and only
+// compares the bytes past it. The decisions are those of a memcmp() over
+// the shorter of the two buffers.
+static int32 search(int32 *I, byte *old, int32 oldsize,
+                    byte *new_block, int32 newsize, int32 st, int32 en, int32 *pos) {
+	int32 x, skip, len;
+	int32 lenst = matchlen(old + I[st], oldsize - I[st], new_block, newsize);
+	int32 lenen = matchlen(old + I[en], oldsize - I[en], new_block, newsize);
+
+	while (en - st >= 2) {
+		x = st + (en - st) / 2;
+		skip = MIN(lenst, lenen);
+		len = skip + matchlen(old + I[x] + skip, oldsize - I[x] - skip,
+		                      new_block + skip, newsize - skip);
+		if (len < oldsize - I[x] && len < newsize && old[I[x] + len] < new_block[len]) {
+			st = x;
+			lenst = len;
+		} else {
+			en = x;
+			lenen = len;
 		}
 	}
-	dblen = 0;
-	eblen = 0;
 
-	/* Create the patch file */
-	patch.open(args.patchfile, std::ios::out | std::ios::binary);
-	if (patch.fail()) {
-		std::cerr << "Unable to open " << args.patchfile << std::endl;
-		return 1;
-	}
-
-	memcpy(header, "PATR", 4);							//Signature
-	WRITE_LE_UINT16(header + 4, 2);						//Version major
-	WRITE_LE_UINT16(header + 6, 0);						//Version minor
-	WRITE_LE_UINT32(header + 8, flags);					//flags
-	Common::md5_file(args.oldfile, header + 12, 5000);	//Md5sum
-	WRITE_LE_UINT32(header + 28, oldsize);				//oldsize
-	WRITE_LE_UINT32(header + 32, newsize);				//newsize
-	//WRITE_LE_UINT32(header + 36, 0);					//ctrl compressed size
-	//WRITE_LE_UINT32(header + 40, 0);					//diff compressed size
-	//WRITE_LE_UINT32(header + 44, 0);					//extra compressed size
-	patch.write((char *)header, 48);
-	if (patch.bad()) {
-		std::cerr << "Write error on " << args.patchfile << std::endl;
-		return 1;
+	if (lenst > lenen) {
+		*pos = I[st];
+		return lenst;
+	} else {
+		*pos = I[en];
+		return lenen;
 	}
+}
 
-	/* Compute the differences, writing ctrl as we go */
-	GZipWriteStream *ctrlBlock;
-	if (args.comp_ctrl)
-		ctrlBlock = new GZipWriteStream(&patch);
+// A slice of the new file chunk, scanned on its own. Its diff and extra bytes are
+// written to db and eb at the offset of the slice, which always has room for
+// them, and packed together once every region is done.
+struct Region {
+	int32 start;
+	int32 end;
+	int32 startPos;				// Old position the first diff starts at
+	int32 endPos;				// Old position after the last diff
+	int32 bestLen;				// Longest diff of the region
+	int32 bestOffset;			// Old minus new position of that diff
+	std::vector<int32> ctrl;	// (diff length, extra length, seek) triples
+	int32 dblen;
+	int32 eblen;
+};
+
+struct DiffContext {
+	int32 *I;
+	byte *old;
+	int32 oldsize;
+	byte *new_block;
+	byte *db;
+	byte *eb;
+	bool mix;
+	std::vector<Region> regions;
+};
+
+// New files are cut in regions of this size to be scanned in parallel. It
+// doesn't depend on the number of workers, so neither does the patch.
+#define REGION_SIZE (4 << 20)
+
+static void scanRegion(uint32 index, void *arg) {
+	DiffContext *ctx = (DiffContext *)arg;
+	Region &region = ctx->regions[index];
+	int32 *I = ctx->I;
+	byte *old = ctx->old;
+	int32 oldsize = ctx->oldsize;
+	byte *new_block = ctx->new_block;
+	byte *db = ctx->db + region.start;
+	byte *eb = ctx->eb + region.start;
+	// Matches never run past the end of the region
+	int32 newsize = region.end;
+	int32 scan, pos, len;
+	int32 lastscan, lastpos, lastoffset;
+	int32 oldscore, scsc;
+	int32 s, Sf, lenf, Sb, lenb;
+	int32 overlap, Ss, lens;
+	int32 i;
+	int32 dblen, eblen;
 
-	scan = 0;
+	dblen = 0;
+	eblen = 0;
+	pos = 0;
+	scan = region.start;
 	len = 0;
-	lastscan = 0;
-	lastpos = 0;
-	lastoffset = 0;
+	lastscan = region.start;
+	lastpos = region.startPos;
+	lastoffset = lastpos - lastscan;
 	while (scan < newsize) {
 		oldscore = 0;
 
@@ -442,7 +678,7 @@ int main(int argc, char *argv[]) {
 				db[dblen + i] = new_block[lastscan + i] ^ old[lastpos + i];
 			dblen += lenf;
 
-			if (!args.mix) {
+			if (!ctx->mix) {
 				for (i = 0; i < (scan - lenb) - (lastscan + lenf); i++)
 					eb[eblen + i] = new_block[lastscan + lenf + i];
 				eblen += (scan - lenb) - (lastscan + lenf);
@@ -452,105 +688,457 @@ int main(int argc, char *argv[]) {
 				dblen += (scan - lenb) - (lastscan + lenf);
 			}
 
-			WRITE_LE_UINT32(buf, lenf);
-			if (args.comp_ctrl) {
-				ctrlBlock->write(buf, 4);
-				if (ctrlBlock->err()) {
-					std::cerr << "Write error on " << args.patchfile << std::endl;
-					return 1;
-				}
-			} else
-				patch.write((char*)buf, 4);
-
-
-			WRITE_LE_UINT32(buf, (scan - lenb) - (lastscan + lenf));
-			if (args.comp_ctrl) {
-				ctrlBlock->write(buf, 4);
-				if (ctrlBlock->err()) {
-					std::cerr << "Write error on " << args.patchfile << std::endl;
-					return 1;
-				}
-			} else
-				patch.write((char*)buf, 4);
-
-			WRITE_LE_UINT32(buf, int32((pos - lenb) - (lastpos + lenf)));
-			if (args.comp_ctrl) {
-				ctrlBlock->write(buf, 4);
-				if (ctrlBlock->err()) {
-					std::cerr << "Write error on " << args.patchfile << std::endl;
-					return 1;
-				}
-			} else
-				patch.write((char*)buf, 4);
+			region.ctrl.push_back(lenf);
+			region.ctrl.push_back((scan - lenb) - (lastscan + lenf));
+			region.ctrl.push_back((pos - lenb) - (lastpos + lenf));
+			region.endPos = lastpos + lenf;
+			if (lenf > region.bestLen) {
+				region.bestLen = lenf;
+				region.bestOffset = lastpos - lastscan;
+			}
 
 			lastscan = scan - lenb;
 			lastpos = pos - lenb;
 			lastoffset = pos - scan;
 		};
 	};
-	if (args.comp_ctrl)
-		delete ctrlBlock;
 
-	/* Compute size of ctrl data (compressed or not)*/
-	if ((len = patch.tellp()) == -1) {
-		std::cerr << "Read error on " << args.patchfile << std::endl;
-		return 1;
+	region.dblen = dblen;
+	region.eblen = eblen;
+}
+
+// One of the blocks of the patch. It is written to a temporary file as the
+// chunks of the new file are diffed, and copied into the patch at the end.
+struct BlockSink {
+	std::string path;
+	std::ofstream file;
+	GZipWriteStream *stream;	// Null when the block isn't compressed
+	const byte *data;			// What the current chunk adds to the block
+	uint32 size;
+	bool ok;
+};
+
+static void writeSink(uint32 index, void *arg) {
+	BlockSink &sink = ((BlockSink *)arg)[index];
+	if (sink.size == 0)
+		return;
+	if (sink.stream) {
+		sink.stream->write(sink.data, sink.size);
+		sink.ok = sink.ok && !sink.stream->err();
+	} else {
+		sink.file.write((const char *)sink.data, sink.size);
+		sink.ok = sink.ok && !sink.file.bad();
+	}
+}
+
+static void putCtrl(std::vector<byte> &out, int64 diffLen, int64 extraLen, int64 seek, bool wide) {
+	byte buf[24];
+	if (wide) {
+		WRITE_LE_UINT64(buf, diffLen);
+		WRITE_LE_UINT64(buf + 8, extraLen);
+		WRITE_LE_UINT64(buf + 16, seek);
+		out.insert(out.end(), buf, buf + 24);
+	} else {
+		WRITE_LE_UINT32(buf, diffLen);
+		WRITE_LE_UINT32(buf + 4, extraLen);
+		WRITE_LE_UINT32(buf + 8, int32(seek));
+		out.insert(out.end(), buf, buf + 12);
 	}
+}
 
-	WRITE_LE_UINT32(header + 36, len - 48);
+static bool getFileSize(int fd, uint64 &size) {
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+		return false;
+	size = st.st_size;
+	return true;
+}
 
-	/* Write compressed diff data */
-	GZipWriteStream *diffBlock = new GZipWriteStream(&patch);
-	diffBlock->write(db, dblen);
-	if (diffBlock->err()) {
-		std::cerr << "Write error on " << args.patchfile << std::endl;
-		return 1;
+// Temporary files of the blocks, removed however diffr exits
+static std::vector<std::string> tempFiles;
+
+static void removeTempFiles() {
+	for (uint32 n = 0; n < tempFiles.size(); n++)
+		unlink(tempFiles[n].c_str());
+}
+
+// Bytes of memory needed per byte of the old window, for the suffix array
+// and its construction, and per byte of the new chunk
+static uint64 oldWindowCost(bool qsufsort, uint32 threads) {
+	if (qsufsort)
+		return threads > 1 ? 13 : 9;
+	return 7;
+}
+
+// Files bigger than this don't fit the version 2 format and are always
+// diffed in windows
+#define MAX_V2_SIZE 0x7fffffff
+#define DEFAULT_BUDGET (1024ULL << 20)
+#define MIN_WINDOW (64 << 10)
+
+typedef struct {
+	char *oldfile;
+	char *newfile;
+	char *patchfile;
+	bool mix;
+	bool comp_ctrl;
+	bool qsufsort;
+	bool wide;
+	uint32 threads;
+	uint64 budget;
+} arguments;
+
+void show_usage(char *name) {
+	printf("usage: %s [-m][-n][-w][-s sais|qsufsort][-j threads][-M megabytes] oldfile newfile patchfile\n", name);
+}
+
+arguments parse_args(int argc, char *argv[]) {
+	arguments arg;
+	arg.comp_ctrl = true;
+	arg.mix = false;
+	arg.qsufsort = false;
+	arg.wide = false;
+	arg.threads = 1;
+	arg.budget = 0;
+
+	int c;
+	while ((c = getopt (argc, argv, "nmws:j:M:")) != -1)
+		switch (c) {
+		case 'n':
+			arg.comp_ctrl = false;
+			break;
+		case 'w':
+			arg.wide = true;
+			break;
+		case 'm':
+			arg.mix = true;
+			break;
+		case 's':
+			if (!strcmp(optarg, "qsufsort")) {
+				arg.qsufsort = true;
+			} else if (strcmp(optarg, "sais")) {
+				show_usage(argv[0]);
+				exit(0);
+			}
+			break;
+		case 'j':
+			arg.threads = atoi(optarg);
+			if (arg.threads == 0)
+				arg.threads = Common::getNumCPUs();
+			break;
+		case 'M': {
+			char *end;
+			long megabytes = strtol(optarg, &end, 10);
+			if (end == optarg || *end || megabytes <= 0) {
+				fprintf(stderr, "-M takes a positive number of megabytes\n");
+				exit(1);
+			}
+			arg.budget = (uint64)megabytes << 20;
+			break;
+		}
+		case '?':
+			show_usage(argv[0]);
+			exit(0);
+		default:
+			fprintf (stderr, "Internal error\n");
+			exit(1);
+		}
+
+	if (argc - optind < 3) {
+		show_usage(argv[0]);
+		exit(0);
 	}
-	delete diffBlock;
 
-	/* Compute size of compressed diff data */
-	if ((newsize = patch.tellp()) == -1) {
-		std::cerr << "Read error on " << args.patchfile << std::endl;
+	arg.oldfile = argv[optind++];
+	arg.newfile = argv[optind++];
+	arg.patchfile = argv[optind++];
+
+	return arg;
+}
+
+int main(int argc, char *argv[]) {
+	byte *old, *new_block;
+	uint64 oldsize, newsize;
+	int32 *I, *V;
+	int32 i;
+	uint32 flags = 0;
+	byte *db, *eb;
+	byte header[PATCH_HEADER64_SIZE];
+	std::ofstream patch;
+	arguments args;
+
+	args = parse_args(argc, argv);
+	atexit(removeTempFiles);
+
+	//Set flags
+	if (args.mix)
+		flags |= 1 << 0;
+	if (args.comp_ctrl)
+		flags |= 1 << 1;
+
+	int oldfd = open(args.oldfile, O_RDONLY);
+	if (oldfd < 0 || !getFileSize(oldfd, oldsize)) {
+		std::cerr << "Unable to open " << args.oldfile << std::endl;
+		return 1;
+	}
+	int newfd = open(args.newfile, O_RDONLY);
+	if (newfd < 0 || !getFileSize(newfd, newsize)) {
+		std::cerr << "Unable to open " << args.newfile << std::endl;
 		return 1;
 	}
-	WRITE_LE_UINT32(header + 40, newsize - len);
-
-	/* Write compressed extra data */
-	if (!args.mix) {
-		GZipWriteStream *extraBlock = new GZipWriteStream(&patch);
-		extraBlock->write(eb, eblen);
-		if (extraBlock->err()) {
-			std::cerr << "Write error on " << args.patchfile << std::endl;
+
+	/* Plan the windows: the old file is indexed one window at a time, and
+	   the new file diffed in chunks against the window around the place
+	   the chunk is expected to come from. Without a memory budget, and
+	   when everything fits in it, there is a single window and a single
+	   chunk holding the whole files. */
+	bool wide = args.wide || oldsize > MAX_V2_SIZE || newsize > MAX_V2_SIZE;
+	uint64 oldCost = oldWindowCost(args.qsufsort, args.threads);
+	uint64 newCost = args.mix ? 2 : 3;
+	uint64 budget = args.budget;
+	if ((oldsize > MAX_V2_SIZE || newsize > MAX_V2_SIZE) && !budget)
+		budget = DEFAULT_BUDGET;
+	uint64 window = oldsize, chunk = newsize;
+	if (budget && oldCost * oldsize + newCost * newsize > budget) {
+		window = budget / (oldCost + newCost);
+		if (window < MIN_WINDOW)
+			window = MIN_WINDOW;
+		if (window > MAX_V2_SIZE)
+			window = MAX_V2_SIZE;
+		if (window > oldsize)
+			window = oldsize;
+		// The chunks get whatever the window leaves, but at least the
+		// window should be wider than them so that moved data is found
+		chunk = budget > oldCost * window ? (budget - oldCost * window) / newCost : 0;
+		if (window > MIN_WINDOW && chunk > window / 2)
+			chunk = window / 2;
+		if (chunk < MIN_WINDOW)
+			chunk = MIN_WINDOW;
+		if (chunk > MAX_V2_SIZE)
+			chunk = MAX_V2_SIZE;
+
+		// The patch may grow a lot, say so when it wasn't asked for
+		if (!args.budget)
+			std::cerr << "Files over 2GB are diffed in windows of " << (window >> 20)
+			          << "MB, data moved farther apart is stored as new data. Use -M to raise the budget.\n";
+	}
+
+	/* Allocate one byte more to ensure that we never try to alloc zero
+	    elements and get a NULL pointer */
+	old = new byte[window + 1];
+	I = new int32[window + 1];
+	new_block = new byte[chunk + 1];
+	db = new byte[chunk + 1];
+	eb = args.mix ? db : new byte[chunk + 1];
+
+	/* The blocks are written to temporary files next to the patch */
+	BlockSink sinks[3];
+	const char *suffixes[3] = { ".ctrl", ".diff", ".extra" };
+	for (i = 0; i < 3; i++) {
+		sinks[i].path = std::string(args.patchfile) + suffixes[i];
+		tempFiles.push_back(sinks[i].path);
+		sinks[i].file.open(sinks[i].path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+		if (sinks[i].file.fail()) {
+			std::cerr << "Unable to open " << sinks[i].path << std::endl;
 			return 1;
 		}
-		delete extraBlock;
+		sinks[i].stream = (i > 0 || args.comp_ctrl) ? new GZipWriteStream(&sinks[i].file) : 0;
+		sinks[i].size = 0;
+		sinks[i].ok = true;
+	}
+	uint32 numSinks = args.mix ? 2 : 3;
+
+	uint64 windowStart = 0;
+	bool haveWindow = false;
+	int64 offset = 0;				// Old minus new position the data is expected at
+	int64 pending[3];				// Last triple, its seek leads to the next chunk
+	uint64 pendingEnd = 0;
+	bool havePending = false;
+	uint64 chunkStart = 0;
+	std::vector<byte> ctrl;
+	do {
+		uint64 chunkEnd = newsize - chunkStart > chunk ? chunkStart + chunk : newsize;
+		int32 chunkSize = chunkEnd - chunkStart;
+
+		/* Center the window on where the chunk is expected to be found */
+		int64 start = (int64)chunkStart + offset - (int64)(window > (uint64)chunkSize ? (window - chunkSize) / 2 : 0);
+		if (start > (int64)(oldsize - window))
+			start = oldsize - window;
+		if (start < 0)
+			start = 0;
+		if (!haveWindow || (uint64)start != windowStart) {
+			windowStart = start;
+			if (!Common::readAt(oldfd, windowStart, old, window)) {
+				std::cerr << "Unable to read from " << args.oldfile << std::endl;
+				return 1;
+			}
+			if (args.qsufsort) {
+				V = new int32[window + 1];
+				if (args.threads > 1)
+					qsufsortParallel(I, V, old, window, args.threads);
+				else
+					qsufsort(I, V, old, window);
+				delete[] V;
+			} else {
+				saissort(I, old, window);
+			}
+			haveWindow = true;
+		}
 
-		/* Compute size of compressed extra data */
-		if ((newsize2 = patch.tellp()) == -1) {
-			std::cerr << "Read error on " << args.patchfile << std::endl;
+		if (!Common::readAt(newfd, chunkStart, new_block, chunkSize)) {
+			std::cerr << "Unable to read from " << args.newfile << std::endl;
 			return 1;
 		}
-		WRITE_LE_UINT32(header + 44, newsize2 - newsize);
 
+		/* Compute the differences, one region at a time or in parallel */
+		DiffContext ctx;
+		ctx.I = I;
+		ctx.old = old;
+		ctx.oldsize = window;
+		ctx.new_block = new_block;
+		ctx.db = db;
+		ctx.eb = eb;
+		ctx.mix = args.mix;
+		int32 regionSize = args.threads > 1 ? REGION_SIZE : chunkSize;
+		i = 0;
+		do {
+			Region region;
+			region.start = i;
+			region.end = chunkSize - i > regionSize ? i + regionSize : chunkSize;
+			// Every region starts out assuming the data is where the
+			// previous chunk suggests, as the first one does
+			int64 startPos = (int64)(chunkStart + i) + offset - (int64)windowStart;
+			if (startPos < 0)
+				startPos = 0;
+			if (startPos > (int64)window)
+				startPos = window;
+			region.startPos = startPos;
+			region.endPos = startPos;
+			region.bestLen = 0;
+			region.bestOffset = 0;
+			ctx.regions.push_back(region);
+			i = region.end;
+		} while (i < chunkSize);
+		Common::parallelFor(ctx.regions.size(), args.threads, scanRegion, &ctx);
+
+		/* Chain the regions: the last seek of each one leads to where the
+		   next one starts, then pack their diff and extra bytes */
+		ctrl.clear();
+		int32 dblen = 0, eblen = 0;
+		for (uint32 r = 0; r < ctx.regions.size(); r++) {
+			Region &region = ctx.regions[r];
+			if (region.ctrl.empty())
+				continue;
+			if (havePending)
+				putCtrl(ctrl, pending[0], pending[1], windowStart + region.startPos - pendingEnd, wide);
+			for (uint32 n = 0; n + 3 < region.ctrl.size(); n += 3)
+				putCtrl(ctrl, region.ctrl[n], region.ctrl[n + 1], region.ctrl[n + 2], wide);
+			for (uint32 n = 0; n < 3; n++)
+				pending[n] = region.ctrl[region.ctrl.size() - 3 + n];
+			pendingEnd = windowStart + region.endPos;
+			havePending = true;
+
+			memmove(db + dblen, db + region.start, region.dblen);
+			dblen += region.dblen;
+			if (!args.mix) {
+				memmove(eb + eblen, eb + region.start, region.eblen);
+				eblen += region.eblen;
+			}
+		}
+
+		// The next chunk is looked for along the longest diff of this one.
+		// Following the last match instead can make the window wander off
+		// to any copy of data repeated in the old file.
+		const Region *best = &ctx.regions[0];
+		for (uint32 r = 1; r < ctx.regions.size(); r++)
+			if (ctx.regions[r].bestLen > best->bestLen)
+				best = &ctx.regions[r];
+		if (best->bestLen > 0)
+			offset = (int64)windowStart + best->bestOffset - (int64)chunkStart;
+
+		/* Deflate the ctrl, diff and extra blocks concurrently */
+		sinks[0].data = ctrl.empty() ? 0 : &ctrl[0];
+		sinks[0].size = ctrl.size();
+		sinks[1].data = db;
+		sinks[1].size = dblen;
+		sinks[2].data = eb;
+		sinks[2].size = eblen;
+		Common::parallelFor(numSinks, args.threads, writeSink, sinks);
+
+		chunkStart = chunkEnd;
+	} while (chunkStart < newsize);
+
+	/* The seek of the very last triple is never used */
+	ctrl.clear();
+	if (havePending)
+		putCtrl(ctrl, pending[0], pending[1], pending[2], wide);
+	sinks[0].data = ctrl.empty() ? 0 : &ctrl[0];
+	sinks[0].size = ctrl.size();
+	writeSink(0, sinks);
+
+	close(oldfd);
+	close(newfd);
+	delete[] I;
+	delete[] old;
+	delete[] new_block;
+	if (!args.mix)
 		delete[] eb;
+	delete[] db;
+
+	uint64 blockSizes[3];
+	for (i = 0; i < 3; i++) {
+		delete sinks[i].stream;
+		sinks[i].ok = sinks[i].ok && !sinks[i].file.bad();
+		blockSizes[i] = sinks[i].file.tellp();
+		sinks[i].file.close();
+		if (!sinks[i].ok) {
+			std::cerr << "Write error on " << sinks[i].path << std::endl;
+			return 1;
+		}
+	}
+	if (args.mix)
+		blockSizes[2] = 0;
+
+	/* Create the patch file */
+	patch.open(args.patchfile, std::ios::out | std::ios::binary);
+	if (patch.fail()) {
+		std::cerr << "Unable to open " << args.patchfile << std::endl;
+		return 1;
 	}
-	else
-		WRITE_LE_UINT32(header + 44, 0);
 
-	/* Seek to the beginning, write the header, and close the file */
-	patch.seekp(0, std::ios::beg);
-	patch.write((char *)header, 48);
+	uint32 headerSize = wide ? PATCH_HEADER64_SIZE : PATCH_HEADER_SIZE;
+	memcpy(header, "PATR", 4);								//Signature
+	WRITE_LE_UINT16(header + 4, wide ? 3 : 2);				//Version major
+	WRITE_LE_UINT16(header + 6, 0);							//Version minor
+	WRITE_LE_UINT32(header + 8, flags);						//flags
+	Common::md5_file(args.oldfile, header + 12, 5000);		//Md5sum
+	if (wide) {
+		WRITE_LE_UINT64(header + 28, oldsize);				//oldsize
+		WRITE_LE_UINT64(header + 36, newsize);				//newsize
+		WRITE_LE_UINT64(header + 44, blockSizes[0]);		//ctrl compressed size
+		WRITE_LE_UINT64(header + 52, blockSizes[1]);		//diff compressed size
+		WRITE_LE_UINT64(header + 60, blockSizes[2]);		//extra compressed size
+	} else {
+		WRITE_LE_UINT32(header + 28, oldsize);				//oldsize
+		WRITE_LE_UINT32(header + 32, newsize);				//newsize
+		WRITE_LE_UINT32(header + 36, blockSizes[0]);		//ctrl compressed size
+		WRITE_LE_UINT32(header + 40, blockSizes[1]);		//diff compressed size
+		WRITE_LE_UINT32(header + 44, blockSizes[2]);		//extra compressed size
+	}
+	patch.write((char *)header, headerSize);
+
+	/* Append the blocks, their temporary files are removed on exit */
+	for (i = 0; i < (int32)numSinks; i++) {
+		std::ifstream block(sinks[i].path.c_str(), std::ios::in | std::ios::binary);
+		char buf[65536];
+		while (block.read(buf, sizeof(buf)) || block.gcount())
+			patch.write(buf, block.gcount());
+	}
 	if (patch.bad()) {
 		std::cerr << "Write error on " << args.patchfile << std::endl;
 		return 1;
 	}
 	patch.close();
 
-	/* Free the memory we used */
-	delete[] db;
-	delete[] I;
-	delete[] old;
-	delete[] new_block;
-
 	return 0;
 }
@@ -18,125 +18,433 @@
 #include <cstring>
 #include <cstdlib>
 #include <cstdio>
-#include <cassert>
 #include <iostream>
 #include <fstream>
 #include <string>
 #include "lab.h"
+#include "common/fileio.h"
 
-// TODO: Use common/endian for this
-uint16 READ_LE_UINT16(const void *ptr) {
-	const uint8 *b = (const uint8 *)ptr;
-	return (b[1] << 8) + b[0];
+LabStreamBuf::LabStreamBuf(Lab *lab, const Common::LabFile *file, const Common::LabEntry &entry) :
+	_lab(lab), _file(file), _offset(entry.offset), _size(entry.size), _rawSize(entry.rawSize),
+	_start(0), _seekPos(0), _block(0), _compressed(entry.size != entry.rawSize) {
+#ifdef USE_ZLIB
+	_inflating = false;
+	_inPos = 0;
+#endif
+	setg(0, 0, 0);
 }
 
-uint32 READ_LE_UINT32(const void *ptr) {
-	const uint8 *b = (const uint8 *)ptr;
-	return (b[3] << 24) + (b[2] << 16) + (b[1] << 8) + (b[0]);
+LabStreamBuf::~LabStreamBuf() {
+	if (_block)
+		_lab->releaseBlock(_block);
+#ifdef USE_ZLIB
+	if (_inflating)
+		inflateEnd(&_stream);
+#endif
+}
+
+void LabStreamBuf::setWindow(const byte *data, uint64 start, uint64 length, uint64 pos) {
+	char *begin = (char *)const_cast<byte *>(data);
+	setg(begin, begin + (pos - start), begin + length);
+	_start = start;
+}
+
+bool LabStreamBuf::fill(uint64 pos) {
+	if (pos >= _rawSize)
+		return false;
+	return _compressed ? fillInflated(pos) : fillStored(pos);
+}
+
+// Point the get area at the part of the entry held by the block of pos
+bool LabStreamBuf::fillStored(uint64 pos) {
+	uint64 at = _offset + pos;
+	uint64 index = at / Lab::BLOCK_SIZE;
+	if (!_block || _block->index != index) {
+		Lab::Block *block = _lab->acquireBlock(_file, index);
+		if (_block)
+			_lab->releaseBlock(_block);
+		_block = block;
+	}
+	if (_block->failed)
+		return false;
+
+	uint64 blockStart = index * Lab::BLOCK_SIZE;
+	uint64 from = blockStart > _offset ? blockStart : _offset;
+	uint64 to = blockStart + _block->data.size();
+	if (to > _offset + _size)
+		to = _offset + _size;
+	if (to <= at)
+		return false;
+	setWindow(&_block->data[from - blockStart], from - _offset, to - from, pos);
+	return true;
+}
+
+// Inflate windows of the entry from the stored blocks until the one
+// holding pos
+bool LabStreamBuf::fillInflated(uint64 pos) {
+#ifdef USE_ZLIB
+	if (!_inflating || pos < _start) {
+		if (_inflating) {
+			inflateReset(&_stream);
+		} else {
+			memset(&_stream, 0, sizeof(_stream));
+			if (inflateInit(&_stream) != Z_OK)
+				return false;
+			_inflating = true;
+		}
+		_inPos = 0;
+		_start = 0;
+		_window.clear();
+	}
+
+	while (pos >= _start + _window.size()) {
+		_start += _window.size();
+		uint64 length = _rawSize - _start < (uint64)WINDOW_SIZE ? _rawSize - _start : (uint64)WINDOW_SIZE;
+		_window.resize(length);
+		_stream.next_out = &_window[0];
+		_stream.avail_out = length;
+
+		while (_stream.avail_out > 0) {
+			uint64 at = _offset + _inPos;
+			uint64 index = at / Lab::BLOCK_SIZE;
+			if (!_block || _block->index != index) {
+				Lab::Block *block = _lab->acquireBlock(_file, index);
+				if (_block)
+					_lab->releaseBlock(_block);
+				_block = block;
+			}
+			uint64 blockStart = index * Lab::BLOCK_SIZE;
+			uint64 to = blockStart + _block->data.size();
+			if (to > _offset + _size)
+				to = _offset + _size;
+			if (_block->failed || to <= at)
+				break;
+
+			_stream.next_in = &_block->data[at - blockStart];
+			_stream.avail_in = to - at;
+			int err = inflate(&_stream, Z_NO_FLUSH);
+			_inPos += (to - at) - _stream.avail_in;
+			if (err != Z_OK)
+				break;
+		}
+
+		if (_stream.avail_out > 0) {
+			// Damaged data, start over on the next read
+			inflateEnd(&_stream);
+			_inflating = false;
+			return false;
+		}
+	}
+
+	setWindow(&_window[0], _start, _window.size(), pos);
+	return true;
+#else
+	return false;
+#endif
+}
+
+LabStreamBuf::int_type LabStreamBuf::underflow() {
+	if (gptr() < egptr())
+		return traits_type::to_int_type(*gptr());
+
+	uint64 pos = eback() ? _start + (egptr() - eback()) : _seekPos;
+	if (!fill(pos)) {
+		_seekPos = pos;
+		setg(0, 0, 0);
+		return traits_type::eof();
+	}
+	return traits_type::to_int_type(*gptr());
+}
+
+LabStreamBuf::pos_type LabStreamBuf::seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) {
+	if (!(which & std::ios_base::in))
+		return pos_type(off_type(-1));
+
+	off_type pos;
+	if (dir == std::ios_base::beg)
+		pos = off;
+	else if (dir == std::ios_base::cur)
+		pos = (eback() ? _start + (gptr() - eback()) : _seekPos) + off;
+	else
+		pos = _rawSize + off;
+	if (pos < 0 || (uint64)pos > _rawSize)
+		return pos_type(off_type(-1));
+
+	// Stay in the get area if we can, the next read fills it otherwise
+	if (eback() && (uint64)pos >= _start && (uint64)pos < _start + (egptr() - eback())) {
+		setg(eback(), eback() + (pos - _start), egptr());
+	} else {
+		_seekPos = pos;
+		setg(0, 0, 0);
+	}
+	return pos_type(pos);
+}
+
+LabStreamBuf::pos_type LabStreamBuf::seekpos(pos_type pos, std::ios_base::openmode which) {
+	return seekoff(off_type(pos), std::ios_base::beg, which);
+}
+
+Lab::Lab(std::string filename) : _filename(filename), _isCatalog(false), _readAhead(DEFAULT_READ_AHEAD),
+	_cacheSize(DEFAULT_CACHE_SIZE), _cacheUsed(0), _prefetchedUnused(0), _background(true), _stop(false) {
+	Load(filename);
+}
+
+Lab::~Lab() {
+	stopPrefetch();
 }
 
 void Lab::Load(std::string filename) {
-	g_type = GT_EMI; // FIXME, detect game-type properly.
-	
-	infile = fopen(filename.c_str(), "rb");
-	if (infile == 0) {
-		std::cout << "Can not open source file: " << filename << std::endl;
-		exit(1);
+	if (Common::isLabCatalog(filename.c_str())) {
+		if (!_catalog.open(filename.c_str()))
+			exit(1);
+		_isCatalog = true;
+		return;
 	}
-	
-	fread(&head.magic, 1, 4, infile);
-	fread(&head.magic2, 1, 4, infile);
-	uint32 num, s_size, s_offset;
-	fread(&num, 1, 4, infile);
-	fread(&s_size, 1, 4, infile);
-	if(g_type == GT_EMI)
-		fread(&s_offset,1,4,infile);
-	head.num_entries = READ_LE_UINT32(&num);
-	head.string_table_size = READ_LE_UINT32(&s_size);
-	if (0 != memcmp(&head.magic, "LABN", 4)) {
-		std::cout << "There is no LABN header in source lab-file\n";
+
+	// The engine resolves file names case-insensitively, so do the same
+	if (!_lab.open(filename.c_str(), true))
 		exit(1);
+}
+
+int Lab::getIndex(std::string filename) {
+	if (_isCatalog)
+		return _catalog.findEntry(filename.c_str());
+	return _lab.findEntry(filename.c_str());
+}
+
+const Common::LabFile *Lab::findFile(const std::string &filename, const Common::LabEntry *&entry) {
+	int index = getIndex(filename);
+	if (index == -1)
+		return NULL;
+
+	if (_isCatalog) {
+		const Common::CatalogEntry &found = _catalog.getEntry(index);
+		entry = &found.entry;
+		return _catalog.getLab(found);
 	}
-	
-	entries = new lab_entry[head.num_entries];
-	str_table = new char[head.string_table_size];
-	if (!str_table || !entries) {
-		std::cout << "Could not allocate memory\n";
-		exit(1);
+	entry = &_lab.getEntry(index);
+	return &_lab;
+}
+
+void Lab::setReadAhead(uint64 bytes) {
+	_readAhead = bytes;
+}
+
+void Lab::setCacheSize(uint64 bytes) {
+	_mutex.lock();
+	_cacheSize = bytes;
+	trimCache();
+	_wake.signal();
+	_mutex.unlock();
+}
+
+void Lab::setBackgroundPrefetch(bool enable) {
+	if (!enable)
+		stopPrefetch();
+	_mutex.lock();
+	_background = enable;
+	_mutex.unlock();
+}
+
+void Lab::stopPrefetch() {
+	_mutex.lock();
+	_stop = true;
+	_queue.clear();
+	_wake.signal();
+	_mutex.unlock();
+
+	_thread.join();
+	_stop = false;
+}
+
+// Called with _mutex held, which is released while the block is read.
+// The block is returned referenced and ready, failed if it couldn't be read.
+Lab::Block *Lab::loadBlock(const Common::LabFile *lab, uint64 index) {
+	BlockKey key(lab, index);
+	std::map<BlockKey, BlockList::iterator>::iterator found = _blockIndex.find(key);
+	if (found != _blockIndex.end()) {
+		_blocks.splice(_blocks.begin(), _blocks, found->second);
+		Block *block = &*found->second;
+		block->refs++;
+		while (!block->ready)
+			_loaded.wait(_mutex);
+		return block;
 	}
-	// Grim-stuff
-	if(g_type == GT_GRIM) {
-		fread(entries, 1, head.num_entries * sizeof(lab_entry), infile);
-		
-		fread(str_table, 1, head.string_table_size, infile);
-		
-	} else if(g_type == GT_EMI) { // EMI-stuff
-		// EMI has a string-table-offset
-		head.string_table_offset = READ_LE_UINT32(&s_offset) - 0x13d0f;
-		// Find the string-table
-		fseek(infile, head.string_table_offset, SEEK_SET);
-		// Read the entire string table into str-table
-		fread(str_table, 1, head.string_table_size, infile);
-		fseek(infile, 20, SEEK_SET);
-		
-		// Decrypt the string table
-		uint32 j;
-		for (j = 0; j < head.string_table_size; j++)
-			if (str_table[j] != 0)
-				str_table[j] ^= 0x96;
-		fread(entries, 1, head.num_entries * sizeof(lab_entry), infile);
+
+	uint64 start = index * BLOCK_SIZE;
+	uint64 length = lab->getFileSize() > start ? lab->getFileSize() - start : 0;
+	if (length > BLOCK_SIZE)
+		length = BLOCK_SIZE;
+
+	_blocks.push_front(Block());
+	_blockIndex[key] = _blocks.begin();
+	Block *block = &_blocks.front();
+	block->lab = lab;
+	block->index = index;
+	block->refs = 1;
+	block->ready = false;
+	block->failed = false;
+	block->prefetched = false;
+	block->data.resize(length);
+	_cacheUsed += length;
+	trimCache();
+
+	// Nobody else touches the data of a block until it is ready
+	_mutex.unlock();
+	bool ok = length > 0;
+	if (ok && lab->getDescriptor() >= 0)
+		ok = Common::readAt(lab->getDescriptor(), start, &block->data[0], length);
+	else if (ok)
+		memcpy(&block->data[0], lab->getRawData() + start, length);
+	_mutex.lock();
+
+	block->ready = true;
+	block->failed = !ok;
+	_loaded.broadcast();
+	return block;
+}
+
+Lab::Block *Lab::acquireBlock(const Common::LabFile *lab, uint64 index) {
+	_mutex.lock();
+	Block *block = loadBlock(lab, index);
+	if (block->prefetched) {
+		block->prefetched = false;
+		_prefetchedUnused -= block->data.size();
+		_wake.signal();
 	}
+	_mutex.unlock();
+	return block;
 }
 
-int Lab::getIndex(std::string filename) {
-	for (i = 0; i < head.num_entries; i++) {
-		const char *fname = str_table + READ_LE_UINT32(&entries[i].fname_offset);
-		std::string test = std::string(fname);
-		if (test != filename)
-			continue;
-		else
-		{
-			return i;
+void Lab::releaseBlock(Block *block) {
+	_mutex.lock();
+	block->refs--;
+	if (block->refs == 0 && block->failed)
+		eraseBlock(_blockIndex[BlockKey(block->lab, block->index)]);
+	trimCache();
+	_mutex.unlock();
+}
+
+void Lab::eraseBlock(BlockList::iterator it) {
+	_cacheUsed -= it->data.size();
+	if (it->prefetched) {
+		_prefetchedUnused -= it->data.size();
+		_wake.signal();
+	}
+	_blockIndex.erase(BlockKey(it->lab, it->index));
+	_blocks.erase(it);
+}
+
+// Drop least recently used blocks until the cache fits its size again.
+// Called with _mutex held.
+void Lab::trimCache() {
+	BlockList::iterator it = _blocks.end();
+	while (_cacheUsed > _cacheSize && it != _blocks.begin()) {
+		--it;
+		if (it->refs == 0 && it->ready) {
+			BlockList::iterator victim = it++;
+			eraseBlock(victim);
 		}
 	}
-	return -1;
 }
 
-std::istream* Lab::getFile(std::string filename) {
-	if (!buf) {
-		printf("Could not allocate memory\n");
-		exit(1);
+void Lab::queueRange(const Common::LabFile *lab, uint64 offset, uint64 size, bool first) {
+	if (offset >= lab->getFileSize() || size == 0)
+		return;
+	if (size > lab->getFileSize() - offset)
+		size = lab->getFileSize() - offset;
+
+	_mutex.lock();
+	if (_background && !_thread.isRunning() && !_thread.start(prefetchThread, this))
+		_background = false;
+	if (!_background) {
+		_mutex.unlock();
+		// Leave it to the system then
+		Common::LabEntry range;
+		range.name = "";
+		range.offset = offset;
+		range.size = range.rawSize = size;
+		lab->prefetch(range);
+		return;
 	}
-	int index = getIndex(filename);
-	if (index == -1) {
-		return NULL;
-	} else {
-		offset = READ_LE_UINT32(&entries[i].start);
-		uint32 size = READ_LE_UINT32(&entries[i].size);
-		if (bufSize < size) {
-			bufSize = size;
-			char *newBuf = (char *)realloc(buf, bufSize);
-			if (!newBuf) {
-				printf("Could not reallocate memory\n");
-				exit(1);
-			} else {
-				buf = newBuf;
-			}
+
+	Range range;
+	range.lab = lab;
+	range.offset = offset;
+	range.end = offset + size;
+	if (first)
+		_queue.push_front(range);
+	else
+		_queue.push_back(range);
+	_wake.signal();
+	_mutex.unlock();
+}
+
+void Lab::prefetchThread(void *arg) {
+	((Lab *)arg)->runPrefetch();
+}
+
+// Read the queued ranges a block at a time, so that a range queued first
+// is read next, and stop while half of the cache holds blocks read ahead
+// and not used yet, so that they don't evict each other.
+void Lab::runPrefetch() {
+	_mutex.lock();
+	while (!_stop) {
+		if (_queue.empty() || _prefetchedUnused + BLOCK_SIZE > _cacheSize / 2) {
+			_wake.wait(_mutex);
+			continue;
 		}
-		std::fstream *stream;
-		stream = new std::fstream(_filename.c_str(), std::ios::in | std::ios::binary);
-		stream->seekg(offset, std::ios::beg);
-		return stream;
+
+		Range &range = _queue.front();
+		const Common::LabFile *lab = range.lab;
+		uint64 index = range.offset / BLOCK_SIZE;
+		range.offset = (index + 1) * BLOCK_SIZE;
+		if (range.offset >= range.end)
+			_queue.pop_front();
+		if (_blockIndex.find(BlockKey(lab, index)) != _blockIndex.end())
+			continue;
+
+		Block *block = loadBlock(lab, index);
+		if (block->refs == 1 && !block->failed) {
+			block->prefetched = true;
+			_prefetchedUnused += block->data.size();
+		}
+		block->refs--;
+		if (block->refs == 0 && block->failed)
+			eraseBlock(_blockIndex[BlockKey(lab, index)]);
+		trimCache();
 	}
-	
-	return NULL;
+	_mutex.unlock();
+}
+
+void Lab::prefetch(std::string filename) {
+	const Common::LabEntry *entry;
+	const Common::LabFile *lab = findFile(filename, entry);
+	if (lab)
+		queueRange(lab, entry->offset, entry->size, false);
+}
+
+std::istream* Lab::getFile(std::string filename) {
+	const Common::LabEntry *entry;
+	const Common::LabFile *lab = findFile(filename, entry);
+	if (!lab || !lab->getData(*entry))
+		return NULL;
+#ifndef USE_ZLIB
+	if (entry->size != entry->rawSize)
+		return NULL;
+#endif
+
+	// Files are usually read whole and the next one is often stored
+	// right after, so fetch a bit more than asked, before anything queued.
+	queueRange(lab, entry->offset, entry->size + _readAhead, true);
+	return new LabStream(this, lab, *entry);
 }
 
 int Lab::getLength(std::string filename) {
-	int index = getIndex(filename);
-	if (index == -1)
+	const Common::LabEntry *entry;
+	if (!findFile(filename, entry))
 		return 0;
-	return entries[i].size;
+	return entry->rawSize;
 }
 
 std::istream *getFile(std::string filename, Lab* lab) {
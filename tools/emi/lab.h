@@ -18,56 +18,183 @@
 #ifndef LAB_H
 #define LAB_H
 
-#include "config.h"
+#include "common/lab.h"
+#include "common/catalog.h"
+#include "common/thread.h"
+#include "common/zlib.h"
 #include <string>
 #include <iostream>
+#include <deque>
+#include <list>
+#include <map>
+#include <vector>
 
-#define GT_GRIM 1
-#define GT_EMI 2
-
-struct lab_header {
-	uint32 magic;
-	uint32 magic2;
-	uint32 num_entries;
-	uint32 string_table_size;
-	uint32 string_table_offset;
-};
-
-struct lab_entry {
-	uint32 fname_offset;
-	uint32 start;
-	uint32 size;
-	uint32 reserved;
-};
+class LabStreamBuf;
 
+/**
+ * A lab, or a catalog of all the labs of a game, in which case files are
+ * looked up across all of them.
+ *
+ * The stored data of the labs is read in blocks of BLOCK_SIZE bytes, kept
+ * in a cache of a configurable size and dropped least recently used first,
+ * so that conversions reading the same parts of a lab over and over only
+ * hit the disk once per block. Streams read straight from the cached
+ * blocks, and entries of compressed labs are inflated from them as they
+ * are read.
+ *
+ * A background thread fills the cache ahead of the reads: with the files
+ * queued by prefetch(), in order, and with the data following each file
+ * opened by getFile(), which is often the next one to be read.
+ */
 class Lab {
-	std::string _filename;
-	uint8 g_type;
-	uint32 i;
-	uint32 offset;
-	uint32 bufSize;
-	lab_header head;
-	lab_entry *entries;
-	char *buf;
-	char *str_table;
-	FILE *infile;
-	void Load(std::string filename);
 public:
-	Lab(std::string filename) : _filename(filename) {
-		// allocate a 1mb buffer to start with
-		bufSize = 1024*1024;
-		buf = (char *)malloc(bufSize);
-		Load(filename);
-	}
-	~Lab() {
-		free(buf);
-		delete[] str_table;
-		delete[] entries;
-	}
+	Lab(std::string filename);
+	~Lab();
+
+	enum {
+		BLOCK_SIZE = 64 * 1024,
+		DEFAULT_READ_AHEAD = 256 * 1024,
+		DEFAULT_CACHE_SIZE = 16 * 1024 * 1024
+	};
 
+	/** Bytes past each file to read ahead, 0 to only read the file itself. */
+	void setReadAhead(uint64 bytes);
+	/**
+	 * Bytes of blocks kept around. Blocks still being read are kept even
+	 * past it, 0 only keeps those.
+	 */
+	void setCacheSize(uint64 bytes);
+	/**
+	 * Whether prefetch() and read-ahead are done by a background thread,
+	 * the default where threads are supported. Otherwise they are only
+	 * hinted to the system.
+	 */
+	void setBackgroundPrefetch(bool enable);
+
+	/**
+	 * Start reading the given file in the background, for a getFile()
+	 * coming later. Queue the files a conversion will need up front, in
+	 * the order it will read them.
+	 */
+	void prefetch(std::string filename);
+
+	/** The returned stream reads from the lab, which must outlive it. */
 	std::istream *getFile(std::string filename);
 	int getIndex(std::string filename);
 	int getLength(std::string filename);
+
+private:
+	friend class LabStreamBuf;
+
+	// A block of the stored data of a lab, shared by all the streams
+	// reading it. Blocks in use or still being read are never evicted.
+	struct Block {
+		const Common::LabFile *lab;
+		uint64 index;
+		std::vector<byte> data;
+		uint32 refs;
+		bool ready;
+		bool failed;
+		bool prefetched;	// Read by the background thread, not used yet
+	};
+	typedef std::pair<const Common::LabFile *, uint64> BlockKey;
+	typedef std::list<Block> BlockList;
+
+	// Part of a lab the background thread has to read
+	struct Range {
+		const Common::LabFile *lab;
+		uint64 offset;
+		uint64 end;
+	};
+
+	std::string _filename;
+	Common::LabFile _lab;
+	Common::LabCatalog _catalog;
+	bool _isCatalog;
+	uint64 _readAhead;
+
+	// Everything below is shared with the background thread
+	Common::Mutex _mutex;
+	Common::Condition _loaded;	// A block finished reading
+	Common::Condition _wake;	// Work for the background thread
+	uint64 _cacheSize;
+	uint64 _cacheUsed;
+	uint64 _prefetchedUnused;
+	BlockList _blocks;	// Most recently used first
+	std::map<BlockKey, BlockList::iterator> _blockIndex;
+	std::deque<Range> _queue;
+	bool _background;
+	bool _stop;
+	Common::Thread _thread;
+
+	void Load(std::string filename);
+	const Common::LabFile *findFile(const std::string &filename, const Common::LabEntry *&entry);
+
+	Block *acquireBlock(const Common::LabFile *lab, uint64 index);
+	void releaseBlock(Block *block);
+	Block *loadBlock(const Common::LabFile *lab, uint64 index);
+	void eraseBlock(BlockList::iterator it);
+	void trimCache();
+	void stopPrefetch();
+	void queueRange(const Common::LabFile *lab, uint64 offset, uint64 size, bool first);
+	static void prefetchThread(void *arg);
+	void runPrefetch();
+};
+
+/**
+ * Read-only stream buffer over one lab entry, reading from the blocks
+ * cached by the Lab and holding on to the block it is in. Compressed
+ * entries are inflated a window at a time, and seeking backwards in them
+ * starts inflating from the beginning again.
+ * Positions are relative to the start of the entry and reads stop at its end.
+ */
+class LabStreamBuf : public std::streambuf {
+public:
+	LabStreamBuf(Lab *lab, const Common::LabFile *file, const Common::LabEntry &entry);
+	~LabStreamBuf();
+
+protected:
+	int_type underflow();
+	pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which);
+	pos_type seekpos(pos_type pos, std::ios_base::openmode which);
+
+private:
+	enum {
+		WINDOW_SIZE = 64 * 1024
+	};
+
+	Lab *_lab;
+	const Common::LabFile *_file;
+	uint64 _offset;		// Of the entry in the lab
+	uint64 _size;		// Stored
+	uint64 _rawSize;
+	uint64 _start;		// Position of eback() in the entry
+	uint64 _seekPos;	// Next position to read when there is no get area
+	Lab::Block *_block;
+	bool _compressed;
+#ifdef USE_ZLIB
+	z_stream _stream;
+	bool _inflating;
+	uint64 _inPos;		// Stored bytes fed to the inflater
+	std::vector<byte> _window;
+#endif
+
+	bool fill(uint64 pos);
+	bool fillStored(uint64 pos);
+	bool fillInflated(uint64 pos);
+	void setWindow(const byte *data, uint64 start, uint64 length, uint64 pos);
+
+	LabStreamBuf(const LabStreamBuf &);
+	LabStreamBuf &operator=(const LabStreamBuf &);
+};
+
+class LabStream : public std::istream {
+	LabStreamBuf _buf;
+public:
+	LabStream(Lab *lab, const Common::LabFile *file, const Common::LabEntry &entry) :
+		std::istream(0), _buf(lab, file, entry) {
+		rdbuf(&_buf);
+	}
 };
 
 std::istream *getFile(std::string filename, Lab* lab);
@@ -122,7 +122,7 @@ void Material::loadSURTexture(string filename) {
 void Material::loadTGATexture(string filename) {
 	std::istream *file = getFile(filename, _lab);
 
-	if (!((fstream*)file)->is_open()) {
+	if (!file) {
 		std::cout << "Unable to open file " << filename << std::endl;
 		return;
 	}
@@ -369,6 +369,8 @@ void Mesh::loadAnimation(std::string filename) {
 
 void Mesh::prepare() {
 	_mats = new Material[_numTextures];
+	for (int i = 0; _lab && i < _numTextures; i++)
+		_lab->prefetch(_texNames[i]);
 	for (int i = 0; i < _numTextures; i++) {
 		_mats[i].setLab(_lab);
 		_mats[i].loadTexture(_texNames[i]);
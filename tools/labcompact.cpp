@@ -0,0 +1,275 @@
+/* ResidualVM - A 3D game interpreter
+*
+* ResidualVM is the legal property of its developers, whose names
+* are too numerous to list here. Please refer to the AUTHORS
+* file distributed with this source distribution.
+
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+
+* You should have received a copy of the GNU Lesser General Public
+* License along with this library; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*
+*/
+
+/* labcompact: rewrite a lab without the dead space left behind by updates
+ * and patches, optionally laying its data out in a new order. The data is
+ * copied range by range, in the kernel where possible, so memory use
+ * doesn't depend on the size of the lab.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <fcntl.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "common/lab.h"
+#include "common/fileio.h"
+
+enum SortOrder {
+	kSortOffset,	// Keep the order the data already has
+	kSortName,
+	kSortSize
+};
+
+struct Slot {
+	uint32 entry;	// First entry using this data
+	uint32 sizeClass;
+	uint32 rank;	// Position in the access trace, or past its end
+};
+
+static const Common::LabFile *g_lab = 0;
+static SortOrder g_order = kSortOffset;
+
+void usage() {
+	printf("Usage: labcompact [OPTIONS] INPUT [OUTPUT]\n");
+	printf("Rewrite the lab INPUT without unused space, into OUTPUT or in place.\n\n");
+	printf("\t--sort name\tLay the data out in file name order.\n");
+	printf("\t--sort size\tGroup the data by size class, smallest first.\n");
+	printf("\t--order TRACE\tLay the data out in the order the files are listed in TRACE,\n");
+	printf("\t\t\tone name per line in first access order. Unlisted files follow.\n");
+	printf("\t--align BYTES\tStart the data of every file on a multiple of BYTES, e.g. 4096.\n");
+	printf("\tWithout --sort or --order the data keeps its current order.\n");
+}
+
+static std::string toLower(const char *name) {
+	std::string lower(name);
+	for (size_t i = 0; i < lower.size(); i++)
+		lower[i] = tolower((byte)lower[i]);
+	return lower;
+}
+
+static uint32 getSizeClass(uint64 size) {
+	uint32 sizeClass = 0;
+	while (size > 1) {
+		size >>= 1;
+		sizeClass++;
+	}
+	return sizeClass;
+}
+
+static bool compareSlots(const Slot &a, const Slot &b) {
+	const Common::LabEntry &ea = g_lab->getEntry(a.entry);
+	const Common::LabEntry &eb = g_lab->getEntry(b.entry);
+	if (a.rank != b.rank)
+		return a.rank < b.rank;
+	if (g_order == kSortName) {
+		int cmp = strcasecmp(ea.name, eb.name);
+		if (cmp != 0)
+			return cmp < 0;
+	} else if (g_order == kSortSize && a.sizeClass != b.sizeClass) {
+		return a.sizeClass < b.sizeClass;
+	}
+	return ea.offset < eb.offset;
+}
+
+static void readTrace(const char *tracename, const Common::LabFile &lab, std::vector<uint32> &ranks) {
+	FILE *trace = fopen(tracename, "r");
+	if (!trace) {
+		printf("Can not open trace file %s\n", tracename);
+		exit(2);
+	}
+
+	std::map<std::string, uint32> byName;
+	for (uint32 i = 0; i < lab.getNumEntries(); i++)
+		byName.insert(std::make_pair(toLower(lab.getEntry(i).name), i));
+
+	char line[1024];
+	uint32 rank = 0;
+	while (fgets(line, sizeof(line), trace)) {
+		line[strcspn(line, "\r\n")] = 0;
+		if (!line[0] || line[0] == '#')
+			continue;
+		std::map<std::string, uint32>::iterator it = byName.find(toLower(line));
+		if (it != byName.end() && ranks[it->second] > rank)
+			ranks[it->second] = rank++;
+	}
+	fclose(trace);
+}
+
+static uint64 alignOffset(uint64 offset, uint32 align) {
+	return (offset + align - 1) & ~(uint64)(align - 1);
+}
+
+// Assign the new offsets following the order of the slots, and return
+// the end of the new lab.
+static uint64 layoutData(const Common::LabFile &lab, const std::vector<Slot> &slots, uint32 align,
+                         uint32 flags, std::vector<Common::LabEntry> &entries, std::vector<uint64> &newOffsets) {
+	uint64 offset = Common::getLabDataOffset(lab.getGameType(), entries, flags);
+	for (uint32 n = 0; n < slots.size(); n++) {
+		offset = alignOffset(offset, align);
+		newOffsets[n] = offset;
+		offset += lab.getEntry(slots[n].entry).size;
+	}
+	return offset;
+}
+
+int main(int argc, char *argv[]) {
+	const char *tracename = 0;
+	uint32 align = 1;
+	int arg = 1;
+
+	while (arg + 1 < argc) {
+		if (!strcmp(argv[arg], "--sort")) {
+			if (!strcmp(argv[arg + 1], "name")) {
+				g_order = kSortName;
+			} else if (!strcmp(argv[arg + 1], "size")) {
+				g_order = kSortSize;
+			} else {
+				usage();
+				return 1;
+			}
+		} else if (!strcmp(argv[arg], "--order")) {
+			tracename = argv[arg + 1];
+		} else if (!strcmp(argv[arg], "--align")) {
+			align = atoi(argv[arg + 1]);
+			if (align == 0 || (align & (align - 1)) != 0) {
+				printf("The alignment must be a power of two\n");
+				return 1;
+			}
+		} else {
+			break;
+		}
+		arg += 2;
+	}
+	if (arg >= argc || argc - arg > 2 || argv[arg][0] == '-') {
+		usage();
+		return 1;
+	}
+	const char *inName = argv[arg];
+	const char *finalName = (arg + 1 < argc) ? argv[arg + 1] : inName;
+
+	// Writing over the input while it is being read would lose it, so an
+	// output naming the same file is compacted in place too
+	struct stat inSt, outSt;
+	bool inPlace = finalName == inName || (stat(finalName, &outSt) == 0 && stat(inName, &inSt) == 0 &&
+	               inSt.st_dev == outSt.st_dev && inSt.st_ino == outSt.st_ino);
+	std::string outName = inPlace ? std::string(finalName) + ".tmp" : finalName;
+
+	Common::LabFile lab;
+	if (!lab.open(inName))
+		return 2;
+	g_lab = &lab;
+	uint32 numEntries = lab.getNumEntries();
+
+	std::vector<uint32> ranks(numEntries, numEntries);
+	if (tracename)
+		readTrace(tracename, lab, ranks);
+
+	// Entries pointing at the same data, as mklab stores duplicates, keep
+	// sharing one copy of it
+	std::map<std::pair<uint64, uint64>, uint32> slotOf;
+	std::vector<Slot> slots;
+	std::vector<uint32> entrySlot(numEntries);
+	for (uint32 i = 0; i < numEntries; i++) {
+		const Common::LabEntry &entry = lab.getEntry(i);
+		if (!lab.getData(entry)) {
+			printf("%s lies past the end of %s\n", entry.name, inName);
+			return 2;
+		}
+		std::pair<uint64, uint64> key(entry.offset, entry.size);
+		std::map<std::pair<uint64, uint64>, uint32>::iterator it = slotOf.find(key);
+		if (it != slotOf.end()) {
+			entrySlot[i] = it->second;
+			if (ranks[i] < slots[it->second].rank)
+				slots[it->second].rank = ranks[i];
+			continue;
+		}
+		Slot slot;
+		slot.entry = i;
+		slot.sizeClass = getSizeClass(entry.size);
+		slot.rank = ranks[i];
+		entrySlot[i] = slots.size();
+		slotOf[key] = slots.size();
+		slots.push_back(slot);
+	}
+
+	// Sort a permutation, so that the entries can still find their slot
+	std::vector<Slot> sorted(slots);
+	std::stable_sort(sorted.begin(), sorted.end(), compareSlots);
+	std::vector<uint32> position(slots.size());
+	for (uint32 n = 0; n < sorted.size(); n++)
+		position[entrySlot[sorted[n].entry]] = n;
+
+	// The new offsets all lie below the end of the new lab, the old ones
+	// mustn't make it look like it needs a 64 bit directory
+	std::vector<Common::LabEntry> entries(numEntries);
+	for (uint32 i = 0; i < numEntries; i++) {
+		entries[i] = lab.getEntry(i);
+		entries[i].offset = 0;
+	}
+
+	// Drop the 64 bit directory if the compacted lab no longer needs it
+	uint32 flags = lab.getFlags() & ~LAB_FLAG_64BIT;
+	std::vector<uint64> newOffsets(sorted.size());
+	uint64 end = layoutData(lab, sorted, align, flags, entries, newOffsets);
+	if (Common::needsLab64(entries, end)) {
+		flags |= LAB_FLAG_64BIT;
+		end = layoutData(lab, sorted, align, flags, entries, newOffsets);
+	}
+	for (uint32 i = 0; i < numEntries; i++)
+		entries[i].offset = newOffsets[position[entrySlot[i]]];
+
+	int outfd = open(outName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (outfd < 0) {
+		printf("Could not open file %s for writing\n", outName.c_str());
+		return 2;
+	}
+
+	std::vector<byte> directory;
+	Common::buildLabDirectory(lab.getGameType(), entries, directory, flags);
+	bool ok = ftruncate(outfd, end) == 0 && Common::writeAt(outfd, 0, &directory[0], directory.size());
+	for (uint32 n = 0; ok && n < sorted.size(); n++) {
+		const Common::LabEntry &entry = lab.getEntry(sorted[n].entry);
+		ok = Common::copyRange(lab.getDescriptor(), entry.offset, outfd, newOffsets[n], entry.size);
+	}
+	// The rename replaces the input, keep its permissions
+	if (ok && inPlace)
+		ok = fstat(lab.getDescriptor(), &inSt) == 0 && fchmod(outfd, inSt.st_mode & 07777) == 0;
+	ok = close(outfd) == 0 && ok;
+
+	uint64 before = lab.getFileSize();
+	lab.close();
+	if (!ok || (inPlace && rename(outName.c_str(), finalName) != 0)) {
+		printf("Could not write to %s\n", outName.c_str());
+		unlink(outName.c_str());
+		return 2;
+	}
+
+	printf("%s: %llu bytes, was %llu\n", finalName,
+	       (unsigned long long)end, (unsigned long long)before);
+	return 0;
+}
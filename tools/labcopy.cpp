@@ -28,135 +28,245 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
-#include "common/endian.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "common/lab.h"
+#include "common/fileio.h"
+#include "common/hash.h"
 
 #define BUFFER_SIZE 		0x100000
-FILE *inLab = NULL, *outLab = NULL;
-void *buffer = NULL;
-
-struct lab_entry {
-	uint32 fname_offset;
-	uint32 start;
-	uint32 size;
-	uint32 reserved;
+
+// Entries skipped when no skip list is given: the file that can't be read
+// on Grim Fandango discs with an illegal TOC.
+#define DEFAULT_SKIP		"cp_0_intha.bm"
+
+// A copied range and the hash of the data read from the original
+struct CopiedRange {
+	const char *name;
+	uint64 offset;
+	uint64 lenght;
+	uint64 hash;
 };
 
+int inLab = -1, outLab = -1;
+bool verify = false;
+uint32 verifyErrors = 0;
+uint32 copyErrors = 0;
+std::vector<std::string> skipList;
+std::vector<CopiedRange> copied;
 
-bool copyFile(uint32 offset, uint32 lenght) {
-	uint32 copied_bytes, count, bytesToRead;
+static bool compareByOffset(const Common::LabEntry *a, const Common::LabEntry *b) {
+	return a->offset < b->offset;
+}
+
+static bool hashRange(int fd, uint64 offset, uint64 lenght, byte *buffer, uint64 &hash) {
+	Common::hash64_context ctx;
+	Common::hash64_starts(&ctx);
+	while (lenght > 0) {
+		uint32 bytesToRead = lenght < BUFFER_SIZE ? lenght : BUFFER_SIZE;
+		if (!Common::readAt(fd, offset, buffer, bytesToRead))
+			return false;
+		Common::hash64_update(&ctx, buffer, bytesToRead);
+		offset += bytesToRead;
+		lenght -= bytesToRead;
+	}
+	hash = Common::hash64_finish(&ctx);
+	return true;
+}
 
-	copied_bytes = 0;
-	fseek(inLab, offset, SEEK_SET);
-	fseek(outLab, offset, SEEK_SET);
+// Copy a range of the lab. Plain copies are left to the kernel; when
+// verifying, the data is streamed through a buffer and hashed on the way,
+// to be checked by verifyCopy() once everything is written.
+bool copyFile(const char *name, uint64 offset, uint64 lenght, byte *buffer) {
+	if (!verify)
+		return Common::copyRange(inLab, offset, outLab, offset, lenght);
 
-	while (copied_bytes < lenght) {
-		bytesToRead = (lenght - copied_bytes < BUFFER_SIZE) ? lenght - copied_bytes : BUFFER_SIZE;
-		count = (uint32)fread(buffer, 1, bytesToRead, inLab);
-		fwrite(buffer, count, 1, outLab);
-		copied_bytes += count;
-		if(ferror(inLab) != 0 || ferror(outLab) != 0)
+	Common::hash64_context ctx;
+	Common::hash64_starts(&ctx);
+	for (uint64 copied_bytes = 0; copied_bytes < lenght;) {
+		uint32 bytesToRead = (lenght - copied_bytes < BUFFER_SIZE) ? lenght - copied_bytes : BUFFER_SIZE;
+		if (!Common::readAt(inLab, offset + copied_bytes, buffer, bytesToRead) ||
+				!Common::writeAt(outLab, offset + copied_bytes, buffer, bytesToRead))
 			return false;
+		Common::hash64_update(&ctx, buffer, bytesToRead);
+		copied_bytes += bytesToRead;
 	}
 
+	CopiedRange range;
+	range.name = name;
+	range.offset = offset;
+	range.lenght = lenght;
+	range.hash = Common::hash64_finish(&ctx);
+	copied.push_back(range);
 	return true;
 }
 
-bool copyLab() {
-	char header[16];
-	uint32 num_entries, string_table_size;
-	char *string_table;
-	lab_entry *lab_entries;
+// Flush the copy to the disk and drop it from the page cache, so that
+// reading it back checks what the disk holds rather than the buffers that
+// were just written, then compare every range against its hash.
+static bool verifyCopy(byte *buffer) {
+	if (fdatasync(outLab) != 0)
+		return false;
+#ifdef POSIX_FADV_DONTNEED
+	posix_fadvise(outLab, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+	for (uint32 i = 0; i < copied.size(); i++) {
+		uint64 written;
+		if (!hashRange(outLab, copied[i].offset, copied[i].lenght, buffer, written))
+			return false;
+		if (written != copied[i].hash) {
+			printf("Verification failed for %s\n", copied[i].name);
+			verifyErrors++;
+		}
+	}
+	return true;
+}
+
+static bool isSkipped(const char *name) {
+	for (uint32 i = 0; i < skipList.size(); i++)
+		if (skipList[i] == name)
+			return true;
+	return false;
+}
 
-	//Read and parse header
-	fseek(inLab, 0, SEEK_SET);
-	fread(header, 16, 1, inLab);
-	if (READ_BE_UINT32(header) != MKTAG('L','A','B','N')) {
+// Damaged entries are reported and skipped, or copied as far as they go,
+// and the rest of the lab is still copied. Only failing to write the copy
+// stops it.
+bool copyLab(const char *filename) {
+	Common::LabFile lab;
+	if (!lab.open(filename, false, true)) {
 		printf("This isn't a valid .lab file!\n");
 		exit(1);
 	}
+	inLab = lab.getDescriptor();
 
-	num_entries = READ_LE_UINT32(header + 8);
-	string_table_size = READ_LE_UINT32(header + 12);
-
-	//Read files entries
-	lab_entries = (lab_entry *)calloc(sizeof(lab_entry), num_entries);
-	fread(lab_entries, 1, num_entries * sizeof(struct lab_entry), inLab);
-	
-	//Read string table
-	string_table = (char *)malloc(string_table_size);
-	fread(string_table, 1, string_table_size, inLab);
-
-	//Write out new lab
-	fwrite(header, 16, 1, outLab);
-	fwrite(lab_entries, sizeof(struct lab_entry), num_entries, outLab);
-	fwrite(string_table, string_table_size, 1, outLab);
-
-	//Check for errors
-	if(ferror(inLab) != 0 || ferror(outLab) != 0) {
-		free(lab_entries);
-		free(string_table);
+	byte *buffer = (byte *)malloc(BUFFER_SIZE);
+	if (!buffer) {
+		printf("Unable to allocate memory!\n");
 		return false;
 	}
 
-	//Copy the files, except cp_0_intha.bm
-	for (uint32 i = 0; i < num_entries; i++)
-		if(strcmp(string_table + READ_LE_UINT32(&lab_entries[i].fname_offset), "cp_0_intha.bm") != 0)
-			if (!copyFile(lab_entries[i].start, lab_entries[i].size)) {
-				free(lab_entries);
-				free(string_table);
-				return false;
+	// Size the copy like the original, anything not copied below,
+	// skipped files included, is left as a hole.
+	bool ok = ftruncate(outLab, lab.getFileSize()) == 0;
+
+	//Copy the header, the directory and the string table
+	ok = ok && copyFile("the lab directory", 0, lab.getDataOffset(), buffer);
+
+	//Copy the files, in the order they are stored
+	std::vector<const Common::LabEntry *> entries;
+	for (uint32 i = 0; i < lab.getNumEntries(); i++)
+		if (!isSkipped(lab.getEntry(i).name))
+			entries.push_back(&lab.getEntry(i));
+	std::sort(entries.begin(), entries.end(), compareByOffset);
+
+	for (uint32 i = 0; ok && i < entries.size(); i++) {
+		const Common::LabEntry &entry = *entries[i];
+		uint64 size = entry.size;
+		if (!lab.getData(entry)) {
+			if (entry.offset >= lab.getFileSize()) {
+				printf("%s lies past the end of the lab, skipping it!\n", entry.name);
+				copyErrors++;
+				continue;
+			}
+			size = lab.getFileSize() - entry.offset;
+			printf("%s is truncated, copying its first %llu bytes!\n", entry.name, (unsigned long long)size);
+			copyErrors++;
+		}
+		if (!copyFile(entry.name, entry.offset, size, buffer)) {
+			// Unreadable data in the original is skipped, failing writes
+			// to the copy are fatal
+			uint64 hash;
+			if (hashRange(inLab, entry.offset, size, buffer, hash)) {
+				ok = false;
+			} else {
+				printf("Could not read %s, skipping it!\n", entry.name);
+				copyErrors++;
 			}
+		}
+	}
 
-	free(lab_entries);
-	free(string_table);
-	return true;
+	if (ok && verify)
+		ok = verifyCopy(buffer);
+
+	free(buffer);
+	inLab = -1;
+	return ok;
 }
 
 void cleanup() {
-	if (inLab)
-		fclose(inLab);
-
-	if (outLab)
-		fclose(outLab);
+	if (outLab >= 0)
+		close(outLab);
+}
 
-	if (buffer)
-		free(buffer);
+void usage() {
+	printf("Usage: labcopy [-s file]... [-a] [--verify] original.lab destination.lab\n");
+	printf("Copy original.lab from Grimfandango cd with illegal-toc protection.\n\n");
+	printf("\t-s file\t\tDon't copy file, leave a hole in its place. Can be given more than once,\n");
+	printf("\t\t\tdefaults to " DEFAULT_SKIP ".\n");
+	printf("\t-a\t\tCopy all the files.\n");
+	printf("\t--verify\tCheck every copied file against a checksum of the original,\n");
+	printf("\t\t\treading the copy back from the disk once it is flushed.\n");
 }
 
 int main(int argc, char *argv[]) {
+	const char *source = 0, *destination = 0;
+	bool defaultSkip = true;
+
 	atexit(cleanup);
-	
+
 	//Argument checks and usage display
-	if (argc != 3) {
-		printf("Usage: labcopy original.lab destination.lab\n");
-		printf("Copy original.lab from Grimfandango cd with illegal-toc protection.\n");
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+			skipList.push_back(argv[++i]);
+			defaultSkip = false;
+		} else if (!strcmp(argv[i], "-a")) {
+			defaultSkip = false;
+		} else if (!strcmp(argv[i], "--verify")) {
+			verify = true;
+		} else if (!source) {
+			source = argv[i];
+		} else if (!destination) {
+			destination = argv[i];
+		} else {
+			source = 0;
+			break;
+		}
+	}
+	if (!source || !destination) {
+		usage();
 		return 1;
 	}
-	
-	//Files opening
-	inLab = fopen(argv[1], "rb");
-	if (!inLab) {
-		printf("Couldn't open %s!\n", argv[1]);
+	if (defaultSkip)
+		skipList.push_back(DEFAULT_SKIP);
+
+	outLab = open(destination, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (outLab < 0) {
+		printf("Couldn't write to %s!\n", destination);
 		return 1;
 	}
 
-	outLab = fopen(argv[2], "wb");
-	if (!outLab) {
-		printf("Couldn't write to %s!\n", argv[2]);
+	if (!copyLab(source)) {
+		printf("I/O error!\n");
 		return 1;
 	}
 
-	buffer = malloc(BUFFER_SIZE);
-	if (!buffer) {
-		printf("Unable to allocate memory!\n");
+	if (copyErrors) {
+		printf("%s copied to %s, but %u files could not be copied whole!\n", source, destination, copyErrors);
 		return 1;
 	}
 
-	if (!copyLab()) {
-		printf("I/O error!\n");
+	if (verifyErrors) {
+		printf("%u files differ between %s and %s!\n", verifyErrors, source, destination);
 		return 1;
 	}
 
-	printf("%s successfully copied to %s.\n", argv[1], argv[2]);
+	printf("%s successfully copied to %s.\n", source, destination);
 	return 0;
 }
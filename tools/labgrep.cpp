@@ -0,0 +1,297 @@
+/* ResidualVM - A 3D game interpreter
+*
+* ResidualVM is the legal property of its developers, whose names
+* are too numerous to list here. Please refer to the AUTHORS
+* file distributed with this source distribution.
+
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+
+* You should have received a copy of the GNU Lesser General Public
+* License along with this library; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*
+*/
+
+/* labgrep: search the files stored in one or more labs for fixed strings,
+ * without extracting them. Files are searched in parallel, straight from
+ * the lab mapping.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+
+#include <algorithm>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "common/lab.h"
+#include "common/thread.h"
+#include "common/zlib.h"
+#include "tools/lua/lua.h"
+#include "tools/delua.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+struct Options {
+	std::vector<std::string> patterns;
+	bool ignoreCase;
+	bool listOnly;
+	bool gzip;
+	bool lua;
+	bool printLab;
+};
+
+struct Job {
+	Common::LabFile *lab;
+	uint32 entry;
+	// Sorted (offset, pattern) pairs found in the searched text
+	std::vector<std::pair<uint64, uint32> > hits;
+	bool failed;
+};
+
+struct SearchContext {
+	const Options *options;
+	std::vector<Job> jobs;
+	Common::Mutex luaMutex;
+};
+
+void usage() {
+	printf("Usage: labgrep [OPTIONS] PATTERN LAB...\n");
+	printf("       labgrep [OPTIONS] -e PATTERN [-e PATTERN]... LAB...\n");
+	printf("Print the name of every file in the labs containing one of the patterns,\n");
+	printf("followed by the offset of each match.\n\n");
+	printf("\t-e PATTERN\tSearch for PATTERN, can be given more than once.\n");
+	printf("\t-i\tIgnore case.\n");
+	printf("\t-l\tOnly print the names of the matching files.\n");
+	printf("\t-z\tSearch inside gzipped files, like the EMI .til ones. The offsets\n");
+	printf("\t\tare then in the inflated data.\n");
+	printf("\t--lua\tSearch compiled Lua scripts in their decompiled form. The offsets\n");
+	printf("\t\tare then in the source printed by delua.\n");
+	printf("\t-j N\tSearch with N parallel workers, 0 uses one per processor (default).\n");
+}
+
+// Append the offset of every occurrence of pattern in data. Candidates are
+// found by comparing the first and last byte of the pattern against 16
+// positions at a time, only those are then checked in full.
+static void findAll(const byte *data, uint64 size, const std::string &pattern, uint32 id,
+                    std::vector<std::pair<uint64, uint32> > &hits) {
+	const byte *p = (const byte *)pattern.data();
+	uint32 len = pattern.size();
+	if (len == 0 || len > size)
+		return;
+
+	uint64 last = size - len;	// Last position a match may start at
+	uint64 pos = 0;
+#ifdef __SSE2__
+	const __m128i first = _mm_set1_epi8((char)p[0]);
+	const __m128i lastByte = _mm_set1_epi8((char)p[len - 1]);
+	for (; pos + 16 <= last + 1; pos += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(data + pos));
+		__m128i b = _mm_loadu_si128((const __m128i *)(data + pos + len - 1));
+		uint32 mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, lastByte)));
+		while (mask) {
+			uint32 bit = __builtin_ctz(mask);
+			if (len <= 2 || memcmp(data + pos + bit + 1, p + 1, len - 2) == 0)
+				hits.push_back(std::make_pair(pos + bit, id));
+			mask &= mask - 1;
+		}
+	}
+#endif
+	while (pos <= last) {
+		const byte *found = (const byte *)memchr(data + pos, p[0], last + 1 - pos);
+		if (!found)
+			break;
+		pos = found - data;
+		if (memcmp(found + 1, p + 1, len - 1) == 0)
+			hits.push_back(std::make_pair(pos, id));
+		pos++;
+	}
+}
+
+static void searchFile(uint32 index, void *arg) {
+	SearchContext *ctx = (SearchContext *)arg;
+	const Options &options = *ctx->options;
+	Job &job = ctx->jobs[index];
+	const Common::LabEntry &entry = job.lab->getEntry(job.entry);
+
+	std::vector<byte> raw;
+	const byte *data = job.lab->getData(entry);
+	uint64 size = entry.size;
+	if (!data) {
+		job.failed = true;
+		return;
+	}
+	if (entry.size != entry.rawSize) {
+		if (entry.rawSize != (size_t)entry.rawSize) {
+			job.failed = true;
+			return;
+		}
+		raw.resize(entry.rawSize);
+		if (!job.lab->readData(entry, raw.empty() ? 0 : &raw[0])) {
+			job.failed = true;
+			return;
+		}
+		data = raw.empty() ? 0 : &raw[0];
+		size = raw.size();
+	}
+
+#ifdef USE_ZLIB
+	std::vector<byte> inflated;
+	if (options.gzip && size >= 2 && size == (unsigned long)size && data[0] == 0x1f && data[1] == 0x8b &&
+			Common::decompress(inflated, data, size)) {
+		raw.swap(inflated);
+		data = raw.empty() ? 0 : &raw[0];
+		size = raw.size();
+	}
+#endif
+
+	std::string source;
+	if (options.lua && size >= 4 && size <= 0x7fffffff && data[0] == 27 && !memcmp(data + 1, "Lua", 3)) {
+		std::ostringstream os;
+		ctx->luaMutex.lock();
+		bool ok = decompileChunk(os, (const char *)data, size, entry.name);
+		ctx->luaMutex.unlock();
+		if (ok) {
+			source = os.str();
+			data = (const byte *)source.data();
+			size = source.size();
+		}
+	}
+
+	std::string folded;
+	if (options.ignoreCase) {
+		folded.assign((const char *)data, size);
+		for (uint64 i = 0; i < size; i++)
+			folded[i] = tolower((byte)folded[i]);
+		data = (const byte *)folded.data();
+	}
+
+	for (uint32 i = 0; i < options.patterns.size(); i++)
+		findAll(data, size, options.patterns[i], i, job.hits);
+	if (options.patterns.size() > 1)
+		std::sort(job.hits.begin(), job.hits.end());
+}
+
+int main(int argc, char *argv[]) {
+	Options options;
+	options.ignoreCase = false;
+	options.listOnly = false;
+	options.gzip = false;
+	options.lua = false;
+	uint32 numThreads = Common::getNumCPUs();
+
+	int arg = 1;
+	for (; arg < argc && argv[arg][0] == '-'; arg++) {
+		if (!strcmp(argv[arg], "-e") && arg + 1 < argc) {
+			options.patterns.push_back(argv[++arg]);
+		} else if (!strcmp(argv[arg], "-i")) {
+			options.ignoreCase = true;
+		} else if (!strcmp(argv[arg], "-l")) {
+			options.listOnly = true;
+		} else if (!strcmp(argv[arg], "-z")) {
+#ifndef USE_ZLIB
+			printf("Searching gzipped files needs zlib support\n");
+			return 1;
+#endif
+			options.gzip = true;
+		} else if (!strcmp(argv[arg], "--lua")) {
+			options.lua = true;
+		} else if (!strcmp(argv[arg], "-j") && arg + 1 < argc) {
+			numThreads = atoi(argv[++arg]);
+			if (numThreads == 0)
+				numThreads = Common::getNumCPUs();
+		} else {
+			usage();
+			return 1;
+		}
+	}
+	if (options.patterns.empty() && arg < argc)
+		options.patterns.push_back(argv[arg++]);
+	if (options.patterns.empty() || arg >= argc) {
+		usage();
+		return 1;
+	}
+	if (options.ignoreCase) {
+		for (uint32 i = 0; i < options.patterns.size(); i++)
+			for (uint32 j = 0; j < options.patterns[i].size(); j++)
+				options.patterns[i][j] = tolower((byte)options.patterns[i][j]);
+	}
+	options.printLab = argc - arg > 1;
+
+	std::vector<Common::LabFile *> labs;
+	for (; arg < argc; arg++) {
+		Common::LabFile *lab = new Common::LabFile();
+		labs.push_back(lab);
+		if (!lab->open(argv[arg])) {
+			for (uint32 i = 0; i < labs.size(); i++)
+				delete labs[i];
+			return 2;
+		}
+	}
+
+	SearchContext ctx;
+	ctx.options = &options;
+	for (uint32 i = 0; i < labs.size(); i++) {
+		for (uint32 j = 0; j < labs[i]->getNumEntries(); j++) {
+			Job job;
+			job.lab = labs[i];
+			job.entry = j;
+			job.failed = false;
+			ctx.jobs.push_back(job);
+		}
+	}
+
+	if (options.lua)
+		lua_open();
+	Common::parallelFor(ctx.jobs.size(), numThreads, searchFile, &ctx);
+	if (options.lua)
+		lua_close();
+
+	// Print in lab order, whatever order the workers finished in
+	bool found = false, failed = false;
+	for (uint32 i = 0; i < ctx.jobs.size(); i++) {
+		const Job &job = ctx.jobs[i];
+		const char *name = job.lab->getEntry(job.entry).name;
+		const char *labName = job.lab->getFileName();
+		if (job.failed) {
+			fprintf(stderr, "Could not read %s from %s\n", name, labName);
+			failed = true;
+			continue;
+		}
+		if (job.hits.empty())
+			continue;
+		found = true;
+
+		if (options.listOnly) {
+			if (options.printLab)
+				printf("%s:", labName);
+			printf("%s\n", name);
+			continue;
+		}
+		for (uint32 j = 0; j < job.hits.size(); j++) {
+			if (options.printLab)
+				printf("%s:", labName);
+			printf("%s:%llu", name, (unsigned long long)job.hits[j].first);
+			if (options.patterns.size() > 1)
+				printf(":%s", options.patterns[job.hits[j].second].c_str());
+			printf("\n");
+		}
+	}
+
+	for (uint32 i = 0; i < labs.size(); i++)
+		delete labs[i];
+
+	// Same exit codes as grep
+	if (failed)
+		return 2;
+	return found ? 0 : 1;
+}
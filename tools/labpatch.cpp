@@ -0,0 +1,284 @@
+/* ResidualVM - A 3D game interpreter
+*
+* ResidualVM is the legal property of its developers, whose names
+* are too numerous to list here. Please refer to the AUTHORS
+* file distributed with this source distribution.
+
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+
+* You should have received a copy of the GNU Lesser General Public
+* License along with this library; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*
+*/
+
+/* labpatch: apply patchr patches to the files of a lab, writing a new lab
+ * in a single pass. Unpatched files are copied across as stored, patched
+ * ones are rebuilt in memory, so no file is ever extracted to disk.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "common/lab.h"
+#include "common/fileio.h"
+#include "common/patch.h"
+#include "common/zlib.h"
+
+struct PatchFile {
+	std::string path;
+	std::vector<byte> data;
+	Common::PatchHeader header;
+	int entry;
+};
+
+struct PatchedEntry {
+	std::vector<byte> data;		// As stored in the new lab, deflated if needed
+	uint64 rawSize;
+	bool patched;
+};
+
+void usage() {
+	printf("Usage: labpatch [-q] INPUT.lab OUTPUT.lab PATCH.patchr...\n");
+	printf("Apply patches built by diffr to the files of INPUT.lab and write the result\n");
+	printf("to OUTPUT.lab. A patch named file.patchr, or file_N.patchr, applies to file.\n");
+	printf("When several patches target the same file, the one whose md5 matches is used.\n\n");
+	printf("\t-q\tDon't list the patched files.\n");
+}
+
+static bool readWholeFile(const char *path, std::vector<byte> &data) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	bool ok = fstat(fd, &st) == 0;
+	if (ok) {
+		data.resize(st.st_size);
+		ok = data.empty() || Common::readAt(fd, 0, &data[0], data.size());
+	}
+	close(fd);
+	return ok;
+}
+
+// Find the lab entry a patch applies to, from its file name: either
+// name.patchr or name_N.patchr for alternative versions of the same file.
+static int findTarget(const Common::LabFile &lab, const std::string &path) {
+	std::string name = path.substr(path.find_last_of('/') + 1);
+	size_t ext = name.rfind(".patchr");
+	if (ext == std::string::npos || ext + 7 != name.size())
+		return -1;
+	name.erase(ext);
+
+	int index = lab.findEntry(name.c_str());
+	if (index >= 0)
+		return index;
+
+	size_t sep = name.find_last_of('_');
+	if (sep == std::string::npos || sep + 1 == name.size() ||
+			name.find_first_not_of("0123456789", sep + 1) != std::string::npos)
+		return -1;
+	name.erase(sep);
+	return lab.findEntry(name.c_str());
+}
+
+static bool patchEntry(const Common::LabFile &lab, uint32 index, const std::vector<PatchFile> &patches, PatchedEntry &out) {
+	const Common::LabEntry &entry = lab.getEntry(index);
+	if (entry.rawSize != (size_t)entry.rawSize) {
+		printf("%s is too large to be patched in memory on this system\n", entry.name);
+		return false;
+	}
+	std::vector<byte> raw(entry.rawSize);
+	if (entry.rawSize && !lab.readData(entry, &raw[0]))
+		return false;
+	const byte *oldData = raw.empty() ? 0 : &raw[0];
+
+	for (uint32 i = 0; i < patches.size(); i++) {
+		const PatchFile &patch = patches[i];
+		if (patch.entry != (int)index || !Common::patchMatches(patch.header, oldData, entry.rawSize))
+			continue;
+
+		std::vector<byte> patched;
+		if (!Common::applyPatch(oldData, entry.rawSize, &patch.data[0], patch.data.size(), patched)) {
+			printf("Could not apply %s\n", patch.path.c_str());
+			return false;
+		}
+		out.rawSize = patched.size();
+
+#ifdef USE_ZLIB
+		if (lab.isCompressed() && !patched.empty() &&
+				Common::compress(out.data, &patched[0], patched.size()) && out.data.size() < patched.size()) {
+			out.patched = true;
+			return true;
+		}
+#endif
+		out.data.swap(patched);
+		out.patched = true;
+		return true;
+	}
+
+	printf("No patch for %s matches the copy in %s\n", entry.name, lab.getFileName());
+	return false;
+}
+
+static bool compareByOffset(const Common::LabEntry *a, const Common::LabEntry *b) {
+	return a->offset < b->offset;
+}
+
+// Assign the new offsets, keeping the data in the order it had in the old
+// lab. Unpatched files that shared their data still do, patched ones get a
+// copy of their own. Returns the end of the new lab.
+static uint64 layoutData(const Common::LabFile &lab, const std::vector<const Common::LabEntry *> &order,
+                         const std::vector<PatchedEntry> &patched, uint32 flags,
+                         std::vector<Common::LabEntry> &entries, std::vector<uint32> &copies) {
+	uint64 offset = Common::getLabDataOffset(lab.getGameType(), entries, flags);
+	uint64 lastOffset = 0, lastSize = 0, lastNew = 0;
+	bool haveLast = false;
+	copies.clear();
+	for (uint32 n = 0; n < order.size(); n++) {
+		uint32 i = order[n] - &lab.getEntry(0);
+		const Common::LabEntry &old = lab.getEntry(i);
+		if (!patched[i].patched && haveLast && old.offset == lastOffset && old.size == lastSize) {
+			entries[i].offset = lastNew;
+			continue;
+		}
+		entries[i].offset = offset;
+		offset += entries[i].size;
+		copies.push_back(i);
+		if (!patched[i].patched) {
+			lastOffset = old.offset;
+			lastSize = old.size;
+			lastNew = entries[i].offset;
+			haveLast = true;
+		}
+	}
+	return offset;
+}
+
+int main(int argc, char *argv[]) {
+	bool quiet = false;
+	int arg = 1;
+	if (arg < argc && !strcmp(argv[arg], "-q")) {
+		quiet = true;
+		arg++;
+	}
+	if (argc - arg < 3) {
+		usage();
+		return 1;
+	}
+	const char *inName = argv[arg];
+	const char *outName = argv[arg + 1];
+
+	// Files are looked up without case, the way the engine resolves them
+	Common::LabFile lab;
+	if (!lab.open(inName, true))
+		return 1;
+
+	std::vector<PatchFile> patches(argc - arg - 2);
+	for (uint32 i = 0; i < patches.size(); i++) {
+		PatchFile &patch = patches[i];
+		patch.path = argv[arg + 2 + i];
+		if (!readWholeFile(patch.path.c_str(), patch.data)) {
+			printf("Could not read %s\n", patch.path.c_str());
+			return 1;
+		}
+		if (!Common::readPatchHeader(patch.data.empty() ? 0 : &patch.data[0], patch.data.size(), patch.header)) {
+			printf("%s is not a valid patch\n", patch.path.c_str());
+			return 1;
+		}
+		patch.entry = findTarget(lab, patch.path);
+		if (patch.entry < 0) {
+			printf("%s doesn't apply to any file in %s\n", patch.path.c_str(), inName);
+			return 1;
+		}
+	}
+
+	// Everything that may fail is done before the output is touched
+	uint32 numEntries = lab.getNumEntries();
+	std::vector<PatchedEntry> patched(numEntries);
+	for (uint32 i = 0; i < patches.size(); i++) {
+		uint32 index = patches[i].entry;
+		if (patched[index].patched)
+			continue;
+		if (!patchEntry(lab, index, patches, patched[index]))
+			return 1;
+		if (!quiet)
+			printf("Patched %s\n", lab.getEntry(index).name);
+	}
+
+	std::vector<const Common::LabEntry *> order;
+	for (uint32 i = 0; i < numEntries; i++)
+		order.push_back(&lab.getEntry(i));
+	std::stable_sort(order.begin(), order.end(), compareByOffset);
+
+	std::vector<Common::LabEntry> entries(numEntries);
+	for (uint32 i = 0; i < numEntries; i++) {
+		entries[i] = lab.getEntry(i);
+		if (patched[i].patched) {
+			entries[i].size = patched[i].data.size();
+			entries[i].rawSize = patched[i].rawSize;
+		}
+	}
+
+	for (uint32 n = 0; n < order.size(); n++) {
+		const Common::LabEntry &old = *order[n];
+		if (!patched[order[n] - &lab.getEntry(0)].patched && !lab.getData(old)) {
+			printf("%s lies past the end of %s\n", old.name, inName);
+			return 1;
+		}
+	}
+
+	uint32 flags = lab.getFlags();
+	std::vector<uint32> copies;
+	uint64 offset = layoutData(lab, order, patched, flags, entries, copies);
+	if (Common::needsLab64(entries, offset) && !(flags & LAB_FLAG_64BIT)) {
+		flags |= LAB_FLAG_64BIT;
+		offset = layoutData(lab, order, patched, flags, entries, copies);
+	}
+
+	struct stat inSt, outSt;
+	if (stat(outName, &outSt) == 0 && stat(inName, &inSt) == 0 &&
+			inSt.st_dev == outSt.st_dev && inSt.st_ino == outSt.st_ino) {
+		printf("The output lab must be different from the input one\n");
+		return 1;
+	}
+	int outfd = open(outName, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (outfd < 0) {
+		printf("Could not open file %s for writing\n", outName);
+		return 1;
+	}
+
+	std::vector<byte> directory;
+	Common::buildLabDirectory(lab.getGameType(), entries, directory, flags);
+	bool ok = Common::writeAt(outfd, 0, &directory[0], directory.size());
+
+	// One sequential pass over the output
+	for (uint32 n = 0; ok && n < copies.size(); n++) {
+		uint32 i = copies[n];
+		const Common::LabEntry &entry = entries[i];
+		if (patched[i].patched)
+			ok = patched[i].data.empty() || Common::writeAt(outfd, entry.offset, &patched[i].data[0], entry.size);
+		else
+			ok = Common::copyRange(lab.getDescriptor(), lab.getEntry(i).offset, outfd, entry.offset, entry.size);
+	}
+	ok = ok && ftruncate(outfd, offset) == 0;
+	close(outfd);
+
+	if (!ok) {
+		printf("Could not write to %s\n", outName);
+		unlink(outName);
+		return 1;
+	}
+	return 0;
+}
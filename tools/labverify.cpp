@@ -0,0 +1,264 @@
+/* ResidualVM - A 3D game interpreter
+*
+* ResidualVM is the legal property of its developers, whose names
+* are too numerous to list here. Please refer to the AUTHORS
+* file distributed with this source distribution.
+
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+
+* You should have received a copy of the GNU Lesser General Public
+* License along with this library; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*
+*/
+
+/* labverify - check a lab against a sidecar checksum index
+
+ The index (FILE.lab.sum by default) is little endian:
+
+ Offset	Size	Var
+ 0		4		Signature = 'LSUM'
+ 4		2		VersionMajor = 2
+ 6		2		VersionMinor = 0
+ 8		4		number of entries (n)
+ 12		4		size of the lab directory (header, entries and string table)
+ 16		8		size of the lab
+ 24		8		hash of the lab directory
+ 32		24*n	one record per lab entry, in directory order:
+				8 offset, 8 size, 8 hash of the data
+
+ All hashes are 64 bit XXH64.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "common/lab.h"
+#include "common/endian.h"
+#include "common/hash.h"
+#include "common/thread.h"
+
+#define SUM_VERSION 2
+#define SUM_HEADER_SIZE 32
+#define SUM_RECORD_SIZE 24
+
+struct SumRecord {
+	uint64 offset;
+	uint64 size;
+	uint64 hash;
+};
+
+struct VerifyContext {
+	const Common::LabFile *lab;
+	std::vector<SumRecord> records;
+	std::vector<uint32> checks;	// Entries to verify
+	std::vector<bool> failed;
+	bool create;
+};
+
+void usage() {
+	printf("Usage: labverify [-j N] [-i INDEX] [--create] FILE [NAME...]\n");
+	printf("Check the files of the lab FILE against a checksum index.\n\n");
+	printf("\t--create\tWrite the checksum index of FILE, instead of checking it.\n");
+	printf("\t-i INDEX\tUse INDEX as checksum index (default FILE.sum).\n");
+	printf("\t-j N\t\tHash with N parallel workers, 0 uses one per processor (default).\n");
+	printf("\tNAME...\t\tOnly check the given files, reading nothing else of the lab.\n");
+}
+
+static void hashEntry(uint32 index, void *arg) {
+	VerifyContext *ctx = (VerifyContext *)arg;
+	uint32 i = ctx->checks[index];
+	const Common::LabEntry &entry = ctx->lab->getEntry(i);
+	const byte *data = ctx->lab->getData(entry);
+	SumRecord &record = ctx->records[i];
+
+	if (!data) {
+		if (!ctx->create)
+			ctx->failed[i] = true;
+		return;
+	}
+	uint64 hash = Common::hash64(data, entry.size);
+	if (ctx->create) {
+		record.offset = entry.offset;
+		record.size = entry.size;
+		record.hash = hash;
+	} else if (record.hash != hash) {
+		ctx->failed[i] = true;
+	} else {
+		ctx->failed[i] = record.offset != entry.offset || record.size != entry.size;
+	}
+}
+
+static uint64 hashDirectory(const Common::LabFile &lab) {
+	return Common::hash64(lab.getRawData(), lab.getDataOffset());
+}
+
+static int createIndex(const Common::LabFile &lab, const char *indexname, uint32 numThreads) {
+	VerifyContext ctx;
+	ctx.lab = &lab;
+	ctx.create = true;
+	ctx.records.resize(lab.getNumEntries());
+	for (uint32 i = 0; i < lab.getNumEntries(); i++)
+		ctx.checks.push_back(i);
+	Common::parallelFor(ctx.checks.size(), numThreads, hashEntry, &ctx);
+
+	std::vector<byte> out(SUM_HEADER_SIZE + ctx.records.size() * SUM_RECORD_SIZE, 0);
+	WRITE_BE_UINT32(&out[0], MKTAG('L','S','U','M'));
+	WRITE_LE_UINT16(&out[4], SUM_VERSION);
+	WRITE_LE_UINT16(&out[6], 0);
+	WRITE_LE_UINT32(&out[8], ctx.records.size());
+	WRITE_LE_UINT32(&out[12], lab.getDataOffset());
+	WRITE_LE_UINT64(&out[16], lab.getFileSize());
+	WRITE_LE_UINT64(&out[24], hashDirectory(lab));
+	for (uint32 i = 0; i < ctx.records.size(); i++) {
+		byte *rec = &out[SUM_HEADER_SIZE + i * SUM_RECORD_SIZE];
+		if (!lab.getData(i)) {
+			printf("File \"%s\" past the end of lab \"%s\". Your game files may be corrupt.\n",
+			       lab.getEntry(i).name, lab.getFileName());
+			return 1;
+		}
+		WRITE_LE_UINT64(rec, ctx.records[i].offset);
+		WRITE_LE_UINT64(rec + 8, ctx.records[i].size);
+		WRITE_LE_UINT64(rec + 16, ctx.records[i].hash);
+	}
+
+	FILE *outfile = fopen(indexname, "wb");
+	if (!outfile || fwrite(&out[0], 1, out.size(), outfile) != out.size()) {
+		printf("Could not write %s\n", indexname);
+		return 1;
+	}
+	fclose(outfile);
+	return 0;
+}
+
+static int verifyLab(const Common::LabFile &lab, const char *indexname, const std::vector<const char *> &names, uint32 numThreads) {
+	FILE *infile = fopen(indexname, "rb");
+	if (!infile) {
+		printf("Can not open checksum index %s\n", indexname);
+		return 1;
+	}
+	byte header[SUM_HEADER_SIZE];
+	if (fread(header, 1, SUM_HEADER_SIZE, infile) != SUM_HEADER_SIZE || READ_BE_UINT32(header) != MKTAG('L','S','U','M') ||
+			READ_LE_UINT16(header + 4) != SUM_VERSION) {
+		printf("%s is not a checksum index\n", indexname);
+		fclose(infile);
+		return 1;
+	}
+
+	// The directory is checked first: if it is damaged, the entries can't
+	// be trusted to point at the right data.
+	uint32 numRecords = READ_LE_UINT32(header + 8);
+	uint32 dirSize = READ_LE_UINT32(header + 12);
+	uint64 labSize = READ_LE_UINT64(header + 16);
+	if (labSize != lab.getFileSize()) {
+		printf("%s: the lab size changed from %llu to %llu bytes\n", lab.getFileName(),
+		       (unsigned long long)labSize, (unsigned long long)lab.getFileSize());
+		fclose(infile);
+		return 1;
+	}
+	if (numRecords != lab.getNumEntries() || dirSize != lab.getDataOffset() ||
+			READ_LE_UINT64(header + 24) != hashDirectory(lab)) {
+		printf("%s: the lab directory is corrupt\n", lab.getFileName());
+		fclose(infile);
+		return 1;
+	}
+
+	VerifyContext ctx;
+	ctx.lab = &lab;
+	ctx.create = false;
+	ctx.records.resize(numRecords);
+	ctx.failed.resize(numRecords, false);
+	std::vector<byte> recs((uint64)numRecords * SUM_RECORD_SIZE);
+	if (numRecords && fread(&recs[0], 1, recs.size(), infile) != recs.size()) {
+		printf("%s is truncated\n", indexname);
+		fclose(infile);
+		return 1;
+	}
+	fclose(infile);
+	for (uint32 i = 0; i < numRecords; i++) {
+		const byte *rec = &recs[(uint64)i * SUM_RECORD_SIZE];
+		ctx.records[i].offset = READ_LE_UINT64(rec);
+		ctx.records[i].size = READ_LE_UINT64(rec + 8);
+		ctx.records[i].hash = READ_LE_UINT64(rec + 16);
+	}
+
+	int ret = 0;
+	if (names.empty()) {
+		for (uint32 i = 0; i < numRecords; i++)
+			ctx.checks.push_back(i);
+	} else {
+		for (uint32 i = 0; i < names.size(); i++) {
+			int index = lab.findEntry(names[i]);
+			if (index < 0) {
+				printf("File \"%s\" not found in lab \"%s\"\n", names[i], lab.getFileName());
+				ret = 1;
+			} else {
+				ctx.checks.push_back(index);
+			}
+		}
+	}
+
+	Common::parallelFor(ctx.checks.size(), numThreads, hashEntry, &ctx);
+
+	uint32 errors = 0;
+	for (uint32 n = 0; n < ctx.checks.size(); n++) {
+		uint32 i = ctx.checks[n];
+		if (ctx.failed[i]) {
+			const Common::LabEntry &entry = lab.getEntry(i);
+			printf("%s: corrupt, %llu bytes at offset %llu\n", entry.name,
+			       (unsigned long long)entry.size, (unsigned long long)entry.offset);
+			errors++;
+		}
+	}
+	printf("%s: %u files checked, %u corrupt\n", lab.getFileName(), (uint32)ctx.checks.size(), errors);
+	return (errors || ret) ? 1 : 0;
+}
+
+int main(int argc, char **argv) {
+	uint32 numThreads = Common::getNumCPUs();
+	bool create = false;
+	const char *filename = 0;
+	std::string indexname;
+	std::vector<const char *> names;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+			numThreads = atoi(argv[++i]);
+			if (numThreads == 0)
+				numThreads = Common::getNumCPUs();
+		} else if (!strcmp(argv[i], "-i") && i + 1 < argc) {
+			indexname = argv[++i];
+		} else if (!strcmp(argv[i], "--create")) {
+			create = true;
+		} else if (!strcmp(argv[i], "--help")) {
+			usage();
+			return 0;
+		} else if (!filename) {
+			filename = argv[i];
+		} else {
+			names.push_back(argv[i]);
+		}
+	}
+
+	if (!filename) {
+		usage();
+		return 1;
+	}
+	if (indexname.empty())
+		indexname = std::string(filename) + ".sum";
+
+	Common::LabFile lab;
+	if (!lab.open(filename, true))
+		return 1;
+
+	if (create)
+		return createIndex(lab, indexname.c_str(), numThreads);
+	return verifyLab(lab, indexname.c_str(), names, numThreads);
+}
@@ -0,0 +1,136 @@
+/* ResidualVM - A 3D game interpreter
+*
+* ResidualVM is the legal property of its developers, whose names
+* are too numerous to list here. Please refer to the AUTHORS
+* file distributed with this source distribution.
+
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+
+* You should have received a copy of the GNU Lesser General Public
+* License along with this library; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*
+*/
+
+/* labxorbench - time the kernels of the EMI string table cipher
+
+ Every kernel of xorLabStringTable() is run over the same table, made of
+ file names like those of the EMI labs, and checked against the byte loop.
+ The table is small enough to stay in the cache, so the figures are those
+ of the kernels rather than of the memory.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <vector>
+
+#include "common/lab.h"
+
+#define DEFAULT_TABLE_SIZE 0x10000
+#define DEFAULT_ROUNDS 20000
+
+typedef void (*XorKernel)(char *str, uint32 size);
+
+struct Kernel {
+	const char *name;
+	XorKernel proc;
+};
+
+static const Kernel kernels[] = {
+	{ "scalar", Common::xorLabStringTableScalar },
+	{ "swar", Common::xorLabStringTableSWAR },
+#ifdef __SSE2__
+	{ "sse2", Common::xorLabStringTableSSE2 },
+#endif
+	{ 0, 0 }
+};
+
+static double getTime() {
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Zero terminated names of 4 to 23 characters, like "mi_0_intro.sur"
+static void fillTable(std::vector<char> &table) {
+	static const char chars[] = "abcdefghijklmnopqrstuvwxyz0123456789_.";
+	uint32 seed = 12345;
+	uint32 left = 0;
+	for (uint32 i = 0; i < table.size(); i++) {
+		seed = seed * 1103515245 + 12345;
+		if (left == 0) {
+			left = 4 + (seed >> 16) % 20;
+			table[i] = 0;
+			continue;
+		}
+		table[i] = chars[(seed >> 16) % (sizeof(chars) - 1)];
+		left--;
+	}
+}
+
+void usage() {
+	printf("Usage: labxorbench [size [rounds]]\n");
+	printf("Time every kernel of the EMI string table cipher on a table of size bytes\n");
+	printf("(default %u), encrypted and decrypted rounds times (default %u).\n", DEFAULT_TABLE_SIZE, DEFAULT_ROUNDS);
+}
+
+int main(int argc, char **argv) {
+	uint32 size = DEFAULT_TABLE_SIZE;
+	uint32 rounds = DEFAULT_ROUNDS;
+
+	if (argc > 3 || (argc > 1 && !strcmp(argv[1], "--help"))) {
+		usage();
+		return 1;
+	}
+	if (argc > 1)
+		size = atoi(argv[1]);
+	if (argc > 2)
+		rounds = atoi(argv[2]);
+	if (size == 0 || rounds == 0) {
+		usage();
+		return 1;
+	}
+
+	std::vector<char> table(size), expected(size), work(size);
+	fillTable(table);
+	expected = table;
+	Common::xorLabStringTableScalar(&expected[0], size);
+
+	bool ok = true;
+	for (const Kernel *k = kernels; k->name; k++) {
+		// Every length up to a few words, for the tails, then the whole table
+		for (uint32 len = 0; len <= 64 && len <= size; len++) {
+			work = table;
+			k->proc(&work[0], len);
+			if (memcmp(&work[0], &expected[0], len) != 0 || memcmp(&work[len], &table[len], size - len) != 0) {
+				printf("%s: wrong result for %u bytes\n", k->name, len);
+				ok = false;
+			}
+		}
+		work = table;
+		k->proc(&work[0], size);
+		if (work != expected) {
+			printf("%s: wrong result for %u bytes\n", k->name, size);
+			ok = false;
+			continue;
+		}
+
+		// Each round encrypts then decrypts, so the input stays the same
+		double start = getTime();
+		for (uint32 i = 0; i < rounds; i++) {
+			k->proc(&work[0], size);
+			k->proc(&work[0], size);
+		}
+		double elapsed = getTime() - start;
+		double bytes = 2.0 * size * rounds;
+		printf("%-8s %10.1f MB/s\n", k->name, elapsed > 0 ? bytes / elapsed / (1 << 20) : 0.0);
+	}
+
+	return ok ? 0 : 1;
+}
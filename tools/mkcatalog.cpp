@@ -0,0 +1,142 @@
+/* ResidualVM - A 3D game interpreter
+*
+* ResidualVM is the legal property of its developers, whose names
+* are too numerous to list here. Please refer to the AUTHORS
+* file distributed with this source distribution.
+
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+
+* You should have received a copy of the GNU Lesser General Public
+* License along with this library; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*
+*/
+
+/* mkcatalog - merge the directories of all the labs of a game into one
+ catalog, see common/catalog.h for the format.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <dirent.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "common/catalog.h"
+
+#define DEFAULT_CATALOG_NAME "labs.cat"
+
+void usage() {
+	printf("Usage: mkcatalog [-p LAB]... DIRECTORY [NAME]\n");
+	printf("Index all the labs in DIRECTORY into the catalog DIRECTORY/NAME (default %s).\n\n", DEFAULT_CATALOG_NAME);
+	printf("When a file is in several labs, the catalog points at the one with the highest\n");
+	printf("priority: first the labs given with -p, in that order, then the patch labs\n");
+	printf("(any name containing \"patch\"), then datausr.lab, then the others by name.\n");
+}
+
+// Lower is read first
+static int defaultPriority(const std::string &name) {
+	std::string lower = name;
+	for (size_t i = 0; i < lower.size(); i++)
+		lower[i] = tolower((byte)lower[i]);
+	if (lower.find("patch") != std::string::npos)
+		return 0;
+	if (lower == "datausr.lab")
+		return 1;
+	return 2;
+}
+
+struct PriorityOrder {
+	const std::vector<const char *> *overrides;
+
+	int rank(const std::string &name) const {
+		for (uint32 i = 0; i < overrides->size(); i++)
+			if (strcasecmp((*overrides)[i], name.c_str()) == 0)
+				return i;
+		return overrides->size() + defaultPriority(name);
+	}
+
+	bool operator()(const std::string &a, const std::string &b) const {
+		int ra = rank(a), rb = rank(b);
+		if (ra != rb)
+			return ra < rb;
+		return strcasecmp(a.c_str(), b.c_str()) < 0;
+	}
+};
+
+int main(int argc, char **argv) {
+	std::vector<const char *> overrides;
+	const char *dirname = 0;
+	const char *catname = DEFAULT_CATALOG_NAME;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-p") && i + 1 < argc) {
+			overrides.push_back(argv[++i]);
+		} else if (!strcmp(argv[i], "--help")) {
+			usage();
+			return 0;
+		} else if (!dirname) {
+			dirname = argv[i];
+		} else {
+			catname = argv[i];
+		}
+	}
+	if (!dirname) {
+		usage();
+		return 1;
+	}
+
+	DIR *dir = opendir(dirname);
+	if (!dir) {
+		printf("Can not open source dir: %s\n", dirname);
+		return 2;
+	}
+	std::vector<std::string> names;
+	struct dirent *dirfile;
+	while ((dirfile = readdir(dir))) {
+		size_t len = strlen(dirfile->d_name);
+		if (len > 4 && !strcasecmp(dirfile->d_name + len - 4, ".lab"))
+			names.push_back(dirfile->d_name);
+	}
+	closedir(dir);
+
+	if (names.empty()) {
+		printf("There are no labs in %s\n", dirname);
+		return 2;
+	}
+	PriorityOrder order;
+	order.overrides = &overrides;
+	std::sort(names.begin(), names.end(), order);
+
+	std::vector<Common::LabFile *> files;
+	std::vector<Common::CatalogLab> labs;
+	for (uint32 i = 0; i < names.size(); i++) {
+		std::string path = std::string(dirname) + "/" + names[i];
+		Common::LabFile *lab = new Common::LabFile();
+		if (!lab->open(path.c_str(), true))
+			return 2;
+		files.push_back(lab);
+
+		Common::CatalogLab entry;
+		entry.name = names[i];
+		entry.lab = lab;
+		labs.push_back(entry);
+	}
+
+	std::string catpath = std::string(dirname) + "/" + catname;
+	if (!Common::writeLabCatalog(catpath.c_str(), labs))
+		return 2;
+
+	for (uint32 i = 0; i < files.size(); i++) {
+		printf("%s: %u files\n", names[i].c_str(), files[i]->getNumEntries());
+		delete files[i];
+	}
+	return 0;
+}
@@ -22,62 +22,84 @@
 
 #include <stdlib.h>
 #include <stdio.h>
-#include <stdint.h>
 #include <string.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
-
-
-#define GT_GRIM 1
-#define GT_EMI 2
-
-typedef struct {
-	uint32_t magic;
-	uint32_t magic2;
-	uint32_t num_entries;
-	uint32_t string_table_size;
-	uint32_t string_table_offset;
-} lab_header;
-
-typedef struct {
-	uint32_t fname_offset;
-	uint32_t start;
-	uint32_t size;
-	uint32_t reserved;
-} lab_entry;
-
-uint32_t READ_LE_UINT32(const void *ptr) {
-	const uint8_t *b = (const uint8_t *)ptr;
-	return (b[3] << 24) + (b[2] << 16) + (b[1] << 8) + (b[0]);
-}
-
-void WRITE_LE_UINT16(void *ptr, uint16_t value) {
-	uint8_t *b = (uint8_t *)ptr;
-	b[0] = (uint8_t)(value >> 0);
-	b[1] = (uint8_t)(value >> 8);
-}
-void WRITE_LE_UINT32(void *ptr, uint32_t value) {
-	uint8_t *b = (uint8_t *)ptr;
-	b[0] = (uint8_t)(value >>  0);
-	b[1] = (uint8_t)(value >>  8);
-	b[2] = (uint8_t)(value >> 16);
-	b[3] = (uint8_t)(value >> 24);
-}
-
-void writeUint16(FILE *file, uint16_t value) {
-	char v[2];
-	WRITE_LE_UINT16(&v, value);
-	fwrite(&v, 1, 2, file);
-}
-
-void writeUint32(FILE *file, uint32_t value) {
-	char v[4];
-	WRITE_LE_UINT32(&v, value);
-	fwrite(&v, 1, 4, file);
-}
+#include <sys/types.h>
+#include <time.h>
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "common/lab.h"
+#include "common/endian.h"
+#include "common/hash.h"
+#include "common/fileio.h"
+#include "common/thread.h"
+#include "common/zlib.h"
+
+#define DEFAULT_COMPACT_THRESHOLD 25
+// Bytes of files deflated before they are written out, for compressed labs
+#define PACK_BATCH_SIZE (64 << 20)
+
+/* The stamps of a lab (FILE.stamps) remember the file every entry was
+ built from, so that --update only reads the files that changed. They are
+ little endian:
+
+ Offset	Size	Var
+ 0		4		Signature = 'LSTP'
+ 4		2		VersionMajor = 1
+ 6		2		VersionMinor = 0
+ 8		4		number of entries (n)
+ 12		4		reserved
+ 16		8		hash of the lab directory, the stamps of another lab are ignored
+ 24		8		time the files were scanned, in seconds since the epoch
+ 32		24*n	one record per lab entry, in directory order:
+				8 size, 8 modification time, 8 hash of the contents
+*/
+#define STAMP_HEADER_SIZE 32
+#define STAMP_RECORD_SIZE 24
+
+struct SourceFile {
+	std::string path;
+	std::string name;
+	uint64 size;
+	int64 mtime;
+	bool ok;
+};
+
+struct Stamp {
+	uint64 size;
+	int64 mtime;
+	uint64 hash;
+};
+
+struct BuildContext {
+	std::vector<SourceFile> files;
+	std::vector<Common::LabEntry> entries;
+	std::vector<uint32> copies;	// Files whose data still has to be written
+	std::vector<uint64> hashes;
+	std::vector<bool> hashed;
+	std::vector<uint32> original;	// First file with the same contents
+	std::vector<uint32> layout;	// Order of the files' data in the lab
+	std::vector<std::vector<byte> > packed;	// Deflated data, for compressed labs
+	uint32 flags;
+	uint32 align;
+	int64 scanTime;
+	uint64 dirHash;
+	int outfd;
+	bool failed;
+};
 
 void usage() {
-	printf("Usage: mklab --grim/--emi DIRECTORY FILE\n");
+	printf("Usage: mklab [OPTIONS] --grim/--emi DIRECTORY FILE\n");
+	printf("       mklab [OPTIONS] --manifest LIST --grim/--emi FILE\n");
+	printf("       mklab [OPTIONS] [--compact PERCENT] --update FILE DIRECTORY\n");
+	printf("       mklab [OPTIONS] [--compact PERCENT] --manifest LIST --update FILE\n");
 }
 
 void help() {
@@ -85,206 +107,718 @@ void help() {
 	printf("Create a lab file containing all the files into the specified directory\n\n");
 	printf("\t--grim\tCreate a Grim-compatible lab.\n");
 	printf("\t--emi\tCreate an EMI-compatible lab.\n");
+	printf("\t--update\tUpdate an existing lab to match the directory. Unchanged files\n");
+	printf("\t\tare kept in place, only new and modified ones are appended. Files\n");
+	printf("\t\twhose size and modification time match FILE.stamps, written along\n");
+	printf("\t\twith the lab, aren't read; the others are compared by hash, or byte\n");
+	printf("\t\tby byte when the lab has no stamps.\n");
+	printf("\t--compact PERCENT\tWith --update, rebuild the whole lab when more than\n");
+	printf("\t\tPERCENT of it would be wasted space (default %d).\n", DEFAULT_COMPACT_THRESHOLD);
+	printf("\t--manifest LIST\tTake the files from LIST instead of walking a directory, - for\n");
+	printf("\t\tstdin. Each line holds the name to store, a tab and the path of the\n");
+	printf("\t\tfile to read. A line with only a path stores the file under its base name.\n");
+	printf("\t--order TRACE\tLay the data out in the order the files are listed in TRACE,\n");
+	printf("\t\tone name per line in first access order. Unlisted files follow.\n");
+	printf("\t--align BYTES\tStart the data of every file on a multiple of BYTES, e.g. 4096.\n");
+	printf("\t--no-dedup\tStore files with identical contents separately, instead of once.\n");
+	printf("\t--compress\tDeflate every file on its own, so each one can still be read\n");
+	printf("\t\twithout the others. Only these tools can read such labs, not the games.\n");
+	printf("\tLabs larger than 4 GiB get a 64 bit directory. Only these tools can read them.\n");
+	printf("\t-j N\tStat and copy the files with N parallel workers, 0 uses one per processor (default).\n");
 	printf("\t--help\tPrint this help.\n");
 	exit(0);
 }
 
-static char *appendPath(const char *name, const char *dir) {
-	int namelen = strlen(name);
-	int dirlen = strlen(dir);
-	char *path = (char *)malloc(namelen + dirlen + 2);
-	strcpy(path, dir);
-	path[dirlen] = '/';
-	strcpy(path + dirlen + 1, name);
-	return path;
-}
+// Collect all the files below dirname in a single walk. Only the names are
+// gathered here, the sizes are filled in afterwards by parallel stat() calls.
+static void scanDirectory(const std::string &dirname, std::vector<SourceFile> &files) {
+	DIR *dir = opendir(dirname.c_str());
+	if (!dir) {
+		printf("Can not open source dir: %s\n", dirname.c_str());
+		exit(2);
+	}
 
-static void countFiles(lab_header *head, DIR *dir, const char *dirname, int additionalLen) {
 	struct dirent *dirfile;
 	while ((dirfile = readdir(dir))) {
 		if (!strcmp(dirfile->d_name, ".") || !strcmp(dirfile->d_name, ".."))
 			continue;
 
-		if (dirfile->d_type == S_IFDIR) {
-			char *d = appendPath(dirfile->d_name, dirname);
-			DIR *subdir = opendir(d);
-			countFiles(head, subdir, d, additionalLen + strlen(dirfile->d_name) + 1);
-			free(d);
-			closedir(subdir);
+		std::string path = dirname + "/" + dirfile->d_name;
+		bool isDir = false;
+#ifdef _DIRENT_HAVE_D_TYPE
+		if (dirfile->d_type == DT_DIR) {
+			isDir = true;
+		} else if (dirfile->d_type == DT_UNKNOWN)
+#endif
+		{
+			struct stat st;
+			isDir = stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+		}
+
+		if (isDir) {
+			scanDirectory(path, files);
 		} else {
-			++head->num_entries;
-			head->string_table_size += strlen(dirfile->d_name) + 1 + additionalLen;
+			SourceFile file;
+			file.path = path;
+			file.name = dirfile->d_name;	// Labs only store the base name
+			file.size = 0;
+			file.mtime = 0;
+			file.ok = false;
+			files.push_back(file);
 		}
 	}
+	closedir(dir);
 }
 
-static void createEntries(DIR *dir, lab_entry *entries, char *str_table, const char *dirname, uint32_t &offset) {
-	static uint32_t num_entry = 0;
-	static uint32_t name_offset = 0;
-	static char *str_offset = str_table;
-	struct dirent *dirfile;
-	while ((dirfile = readdir(dir))) {
-		if (!strcmp(dirfile->d_name, ".") || !strcmp(dirfile->d_name, ".."))
+// Read the files to store from a manifest, as given by a build system
+// that already knows them. Names may include directories, unlike the
+// base names a directory walk stores.
+static void readManifest(const char *listname, std::vector<SourceFile> &files) {
+	FILE *list = strcmp(listname, "-") ? fopen(listname, "r") : stdin;
+	if (!list) {
+		printf("Can not open manifest %s\n", listname);
+		exit(2);
+	}
+
+	char line[2048];
+	while (fgets(line, sizeof(line), list)) {
+		line[strcspn(line, "\r\n")] = 0;
+		if (!line[0] || line[0] == '#')
 			continue;
 
-		if (dirfile->d_type == S_IFDIR) {
-			char *d = appendPath(dirfile->d_name, dirname);
-			DIR *subdir = opendir(d);
-			createEntries(subdir, entries, str_table, d, offset);
-			free(d);
-			closedir(subdir);
+		SourceFile file;
+		char *tab = strchr(line, '\t');
+		if (tab) {
+			*tab = 0;
+			file.name = line;
+			file.path = tab + 1;
 		} else {
-			lab_entry &entry = entries[num_entry++];
+			file.path = line;
+			const char *base = strrchr(line, '/');
+			file.name = base ? base + 1 : line;
+		}
+		if (file.name.empty() || file.path.empty()) {
+			printf("Invalid line in manifest %s\n", listname);
+			exit(2);
+		}
+		file.size = 0;
+		file.mtime = 0;
+		file.ok = false;
+		files.push_back(file);
+	}
+	if (list != stdin)
+		fclose(list);
+}
 
-			WRITE_LE_UINT32(&entry.fname_offset, name_offset);
-			WRITE_LE_UINT32(&entry.start, offset);
-			entry.reserved = 0; //What is this??
+static void statFile(uint32 index, void *arg) {
+	SourceFile &file = ((BuildContext *)arg)->files[index];
+	struct stat st;
+	if (stat(file.path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+		file.size = st.st_size;
+		file.mtime = st.st_mtime;
+		file.ok = true;
+	}
+}
 
-			char *path = appendPath(dirfile->d_name, dirname);
-			char *name = strrchr(path, '/') + 1;
-			strcpy(str_offset, name);
-			str_offset[strlen(name)] = 0;
-			name_offset += strlen(name) + 1;
-			str_offset = str_table + name_offset;
+static void hashFile(uint32 index, void *arg) {
+	BuildContext *ctx = (BuildContext *)arg;
+	if (ctx->hashed[index])
+		return;
+	if (!Common::hash64_file(ctx->files[index].path.c_str(), ctx->hashes[index])) {
+		printf("Could not read file %s\n", ctx->files[index].path.c_str());
+		ctx->failed = true;
+	}
+	ctx->hashed[index] = true;
+}
 
-			struct stat st;
-			stat(path, &st);
+// Hash the files whose hash isn't known from the stamps yet
+static void hashFiles(uint32 numThreads, BuildContext &ctx) {
+	Common::parallelFor(ctx.files.size(), numThreads, hashFile, &ctx);
+	if (ctx.failed)
+		exit(2);
+}
 
-			// 		printf("entry of file %s, at offset %d and of size %d\n", path, offset, st.st_size);
-			free(path);
+static bool sameFiles(const char *path1, const char *path2, uint64 size) {
+	int fd1 = open(path1, O_RDONLY);
+	int fd2 = open(path2, O_RDONLY);
+	bool same = fd1 >= 0 && fd2 >= 0;
 
-			offset += st.st_size;
-			WRITE_LE_UINT32(&entry.size, st.st_size);
+	byte buf1[0x8000], buf2[0x8000];
+	for (uint64 pos = 0; same && pos < size; pos += sizeof(buf1)) {
+		uint32 len = size - pos < sizeof(buf1) ? size - pos : sizeof(buf1);
+		same = Common::readAt(fd1, pos, buf1, len) && Common::readAt(fd2, pos, buf2, len) &&
+		       memcmp(buf1, buf2, len) == 0;
+	}
+	if (fd1 >= 0)
+		close(fd1);
+	if (fd2 >= 0)
+		close(fd2);
+	return same;
+}
+
+// Point each file at the first file with the same contents. Identical
+// files then share a single copy of the data.
+static void findDuplicates(BuildContext &ctx) {
+	std::map<std::pair<uint64, uint64>, uint32> seen;
+	for (uint32 i = 0; i < ctx.files.size(); i++) {
+		std::pair<uint64, uint64> key(ctx.hashes[i], ctx.files[i].size);
+		std::map<std::pair<uint64, uint64>, uint32>::iterator it = seen.find(key);
+		if (it == seen.end()) {
+			seen[key] = i;
+		} else if (sameFiles(ctx.files[it->second].path.c_str(), ctx.files[i].path.c_str(), ctx.files[i].size)) {
+			ctx.original[i] = it->second;
 		}
 	}
 }
 
-int main(int argc, char **argv) {
-	if (argc > 1 && !strcmp(argv[1], "--help")) {
-		help();
+static std::string toLower(const char *name) {
+	std::string lower(name);
+	for (size_t i = 0; i < lower.size(); i++)
+		lower[i] = tolower((byte)lower[i]);
+	return lower;
+}
+
+// Order the data of the files following an access trace: the files are
+// stored in the order they are first read, so that loading a scene reads
+// the lab almost sequentially. Files missing from the trace keep the
+// order of the directory walk, after the traced ones.
+static void orderFiles(const char *tracename, BuildContext &ctx) {
+	ctx.layout.clear();
+	std::vector<bool> placed(ctx.files.size(), false);
+
+	if (tracename) {
+		FILE *trace = fopen(tracename, "r");
+		if (!trace) {
+			printf("Can not open trace file %s\n", tracename);
+			exit(2);
+		}
+
+		std::map<std::string, uint32> byName;
+		for (uint32 i = 0; i < ctx.files.size(); i++)
+			byName.insert(std::make_pair(toLower(ctx.files[i].name.c_str()), i));
+
+		char line[1024];
+		while (fgets(line, sizeof(line), trace)) {
+			line[strcspn(line, "\r\n")] = 0;
+			if (!line[0] || line[0] == '#')
+				continue;
+			std::map<std::string, uint32>::iterator it = byName.find(toLower(line));
+			if (it == byName.end() || placed[it->second])
+				continue;
+			placed[it->second] = true;
+			ctx.layout.push_back(it->second);
+		}
+		fclose(trace);
 	}
 
-	if (argc < 4) {
-		usage();
-		exit(1);
+	for (uint32 i = 0; i < ctx.files.size(); i++)
+		if (!placed[i])
+			ctx.layout.push_back(i);
+}
+
+static uint64 alignOffset(uint64 offset, uint32 align) {
+	return (offset + align - 1) & ~(uint64)(align - 1);
+}
+
+// Deflate a pending file. It is stored as is if that doesn't make it smaller.
+static void packFile(uint32 index, void *arg) {
+	BuildContext *ctx = (BuildContext *)arg;
+	uint32 i = ctx->copies[index];
+	const SourceFile &file = ctx->files[i];
+	Common::LabEntry &entry = ctx->entries[i];
+
+	std::vector<byte> data(entry.rawSize);
+	int fd = open(file.path.c_str(), O_RDONLY);
+	if (fd < 0 || (entry.rawSize && !Common::readAt(fd, 0, &data[0], entry.rawSize))) {
+		printf("Could not read file %s\n", file.path.c_str());
+		ctx->failed = true;
+		if (fd >= 0)
+			close(fd);
+		return;
 	}
+	close(fd);
 
-	const char *type = argv[1];
-	const char *dirname = argv[2];
-	const char *out = argv[3];
+	std::vector<byte> &packed = ctx->packed[i];
+#ifdef USE_ZLIB
+	if (!data.empty() && Common::compress(packed, &data[0], data.size()) && packed.size() < data.size()) {
+		entry.size = packed.size();
+		return;
+	}
+#endif
+	std::vector<byte>().swap(packed);
+	entry.size = entry.rawSize;
+}
 
-	uint8_t g_type;
-	if (!strcmp(type, "--grim")) {
-		g_type = GT_GRIM;
-	} else if (!strcmp(type, "--emi")) {
-		g_type = GT_EMI;
-	} else {
-		usage();
-		exit(1);
+static void copyFile(uint32 index, void *arg);
+
+// Deflate the pending files in batches of about PACK_BATCH_SIZE bytes,
+// writing each batch at the end of the lab before starting the next one,
+// so that only one batch is ever held in memory. The files get their
+// offsets from end on, in order, and the new end of the lab is returned.
+// Every pending file has been written when it returns.
+static uint64 packFiles(uint32 numThreads, uint64 end, BuildContext &ctx) {
+	std::vector<uint32> pending;
+	pending.swap(ctx.copies);
+	ctx.packed.resize(ctx.files.size());
+
+	for (uint32 next = 0; next < pending.size();) {
+		uint64 batchSize = 0;
+		ctx.copies.clear();
+		while (next < pending.size() && (ctx.copies.empty() ||
+				batchSize + ctx.entries[pending[next]].rawSize <= PACK_BATCH_SIZE)) {
+			batchSize += ctx.entries[pending[next]].rawSize;
+			ctx.copies.push_back(pending[next++]);
+		}
+
+		Common::parallelFor(ctx.copies.size(), numThreads, packFile, &ctx);
+		if (ctx.failed)
+			exit(2);
+		for (uint32 n = 0; n < ctx.copies.size(); n++) {
+			Common::LabEntry &entry = ctx.entries[ctx.copies[n]];
+			end = alignOffset(end, ctx.align);
+			entry.offset = end;
+			end += entry.size;
+		}
+		Common::parallelFor(ctx.copies.size(), numThreads, copyFile, &ctx);
+		if (ctx.failed)
+			exit(2);
+		for (uint32 n = 0; n < ctx.copies.size(); n++)
+			std::vector<byte>().swap(ctx.packed[ctx.copies[n]]);
 	}
 
-	DIR *dir = opendir(dirname);
-	if (dir == 0) {
-		printf("Can not open source dir: %s\n", dirname);
-		exit(2);
+	ctx.copies.clear();
+	return end;
+}
+
+static void copyFile(uint32 index, void *arg) {
+	BuildContext *ctx = (BuildContext *)arg;
+	const SourceFile &file = ctx->files[ctx->copies[index]];
+	const Common::LabEntry &entry = ctx->entries[ctx->copies[index]];
+
+	if (!ctx->packed.empty() && !ctx->packed[ctx->copies[index]].empty()) {
+		if (!Common::writeAt(ctx->outfd, entry.offset, &ctx->packed[ctx->copies[index]][0], entry.size)) {
+			printf("Could not copy file %s\n", file.path.c_str());
+			ctx->failed = true;
+		}
+		return;
+	}
+
+	int fd = open(file.path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		printf("Could not open file %s\n", file.path.c_str());
+		ctx->failed = true;
+		return;
+	}
+	if (!Common::copyRange(fd, 0, ctx->outfd, entry.offset, entry.size)) {
+		printf("Could not copy file %s\n", file.path.c_str());
+		ctx->failed = true;
 	}
+	close(fd);
+}
 
-	lab_header head;
+// Gather the files from the manifest if there is one, from the directory otherwise
+static void collectFiles(const char *dirname, const char *manifest, uint32 numThreads, BuildContext &ctx) {
+	// Files modified from now on may not be seen by this run, their
+	// stamps can't be trusted
+	ctx.scanTime = time(0);
+	if (manifest)
+		readManifest(manifest, ctx.files);
+	else
+		scanDirectory(dirname, ctx.files);
+	Common::parallelFor(ctx.files.size(), numThreads, statFile, &ctx);
+
+	ctx.entries.resize(ctx.files.size());
+	ctx.original.resize(ctx.files.size());
+	for (uint32 i = 0; i < ctx.files.size(); i++) {
+		ctx.original[i] = i;
+		if (!ctx.files[i].ok) {
+			printf("Can not stat file %s\n", ctx.files[i].path.c_str());
+			exit(2);
+		}
+		ctx.entries[i].name = ctx.files[i].name.c_str();
+		ctx.entries[i].size = ctx.files[i].size;
+		ctx.entries[i].rawSize = ctx.files[i].size;
+	}
+	ctx.hashes.resize(ctx.files.size());
+	ctx.hashed.assign(ctx.files.size(), false);
+}
 
-	head.num_entries = 0;
-	head.string_table_size = 0;
+static std::string getStampsName(const char *labname) {
+	return std::string(labname) + ".stamps";
+}
 
-	countFiles(&head, dir, dirname, 0);
+// Load the stamps of the lab, if it has some and they were written for it.
+static bool readStamps(const Common::LabFile &lab, std::vector<Stamp> &stamps, int64 &scanTime) {
+	std::string name = getStampsName(lab.getFileName());
+	FILE *infile = fopen(name.c_str(), "rb");
+	if (!infile)
+		return false;
+
+	byte header[STAMP_HEADER_SIZE];
+	uint32 numRecords = 0;
+	bool ok = fread(header, 1, STAMP_HEADER_SIZE, infile) == STAMP_HEADER_SIZE &&
+	          READ_BE_UINT32(header) == MKTAG('L','S','T','P') && READ_LE_UINT16(header + 4) == 1;
+	if (ok) {
+		numRecords = READ_LE_UINT32(header + 8);
+		ok = numRecords == lab.getNumEntries() &&
+		     READ_LE_UINT64(header + 16) == Common::hash64(lab.getRawData(), lab.getDataOffset());
+	}
+	std::vector<byte> recs((uint64)numRecords * STAMP_RECORD_SIZE);
+	ok = ok && (recs.empty() || fread(&recs[0], 1, recs.size(), infile) == recs.size());
+	fclose(infile);
+	if (!ok)
+		return false;
+
+	scanTime = READ_LE_UINT64(header + 24);
+	stamps.resize(numRecords);
+	for (uint32 i = 0; i < numRecords; i++) {
+		const byte *rec = &recs[(uint64)i * STAMP_RECORD_SIZE];
+		stamps[i].size = READ_LE_UINT64(rec);
+		stamps[i].mtime = READ_LE_UINT64(rec + 8);
+		stamps[i].hash = READ_LE_UINT64(rec + 16);
+	}
+	return true;
+}
 
-// 	printf("%d files, string table of size %d\n", head.num_entries, head.string_table_size);
+// Stamps are only an optimization, a lab without them is still complete
+static void writeStamps(const char *labname, const BuildContext &ctx) {
+	std::vector<byte> out(STAMP_HEADER_SIZE + ctx.files.size() * STAMP_RECORD_SIZE, 0);
+	WRITE_BE_UINT32(&out[0], MKTAG('L','S','T','P'));
+	WRITE_LE_UINT16(&out[4], 1);
+	WRITE_LE_UINT16(&out[6], 0);
+	WRITE_LE_UINT32(&out[8], ctx.files.size());
+	WRITE_LE_UINT64(&out[16], ctx.dirHash);
+	WRITE_LE_UINT64(&out[24], ctx.scanTime);
+	for (uint32 i = 0; i < ctx.files.size(); i++) {
+		byte *rec = &out[STAMP_HEADER_SIZE + i * STAMP_RECORD_SIZE];
+		WRITE_LE_UINT64(rec, ctx.files[i].size);
+		WRITE_LE_UINT64(rec + 8, ctx.files[i].mtime);
+		WRITE_LE_UINT64(rec + 16, ctx.hashes[i]);
+	}
 
-	lab_entry *entries = (lab_entry *)malloc(head.num_entries * sizeof(lab_entry));
-	char *str_table = (char *)malloc(head.string_table_size);
-	if (!str_table || !entries) {
-		printf("Could not allocate memory\n");
-		exit(3);
+	std::string name = getStampsName(labname);
+	FILE *outfile = fopen(name.c_str(), "wb");
+	bool ok = outfile && fwrite(&out[0], 1, out.size(), outfile) == out.size();
+	if (outfile)
+		ok = fclose(outfile) == 0 && ok;
+	if (!ok) {
+		printf("Could not write %s, the next update will read every file\n", name.c_str());
+		unlink(name.c_str());
 	}
+}
 
-	rewinddir(dir);
-	uint32_t offset = 16 + head.num_entries * sizeof(lab_entry) + head.string_table_size + 16;
-	createEntries(dir, entries, str_table, dirname, offset);
+// Write the directory at the start of the lab, then the data of the
+// pending files at their assigned offsets.
+static void writeLab(uint8 g_type, uint32 numThreads, const char *out, BuildContext &ctx) {
+	std::vector<byte> directory;
+	Common::buildLabDirectory(g_type, ctx.entries, directory, ctx.flags);
 
-	closedir(dir);
+	Common::parallelFor(ctx.copies.size(), numThreads, copyFile, &ctx);
+	if (ctx.failed)
+		exit(2);
+
+	if (!Common::writeAt(ctx.outfd, 0, &directory[0], directory.size())) {
+		printf("Could not write to %s\n", out);
+		exit(2);
+	}
+	ctx.dirHash = Common::hash64(&directory[0], directory.size());
+}
+
+// Duplicates share the data of their original
+static void shareDuplicates(BuildContext &ctx) {
+	for (uint32 i = 0; i < ctx.entries.size(); i++) {
+		const Common::LabEntry &original = ctx.entries[ctx.original[i]];
+		ctx.entries[i].offset = original.offset;
+		ctx.entries[i].size = original.size;
+		ctx.entries[i].rawSize = original.rawSize;
+	}
+}
+
+// Assign consecutive offsets to the pending files, and return the end of the lab
+static uint64 layoutFiles(uint8 g_type, BuildContext &ctx) {
+	uint64 offset = Common::getLabDataOffset(g_type, ctx.entries, ctx.flags);
+	for (uint32 n = 0; n < ctx.copies.size(); n++) {
+		uint32 i = ctx.copies[n];
+		offset = alignOffset(offset, ctx.align);
+		ctx.entries[i].offset = offset;
+		offset += ctx.entries[i].size;
+	}
+	return offset;
+}
+
+static void createLab(uint8 g_type, uint32 numThreads, const char *out, BuildContext &ctx) {
+	ctx.copies.clear();
+	for (uint32 n = 0; n < ctx.layout.size(); n++) {
+		uint32 i = ctx.layout[n];
+		ctx.entries[i].size = ctx.entries[i].rawSize;
+		if (ctx.original[i] == i)
+			ctx.copies.push_back(i);
+	}
+
+	// Use the 64 bit directory only when the data doesn't fit without it.
+	// Files are deflated only as they are written, so for compressed labs
+	// this is decided on their raw sizes, the most they can take.
+	uint64 offset = layoutFiles(g_type, ctx);
+	shareDuplicates(ctx);
+	if (Common::needsLab64(ctx.entries, offset) && !(ctx.flags & LAB_FLAG_64BIT)) {
+		ctx.flags |= LAB_FLAG_64BIT;
+		offset = layoutFiles(g_type, ctx);
+		shareDuplicates(ctx);
+	}
 
 	// Open the output file after we've finished with the dir, so that we're sure
 	// we don't include the lab into itself if it was asked to be created into the same dir.
-	FILE *outfile = fopen(out, "wb");
-	if (!outfile) {
+	ctx.outfd = open(out, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (ctx.outfd < 0) {
 		printf("Could not open file %s for writing\n", out);
 		exit(2);
 	}
 
-	fwrite("LABN", 1, 4, outfile);
-	fwrite("\x00\x00\x01\x00", 1, 4, outfile); //version
-	writeUint32(outfile, head.num_entries);
-	writeUint32(outfile, head.string_table_size);
+	// Size the output up front, so that every file can be copied in place
+	// independently of the others. Compressed files are appended instead.
+	if (ctx.flags & LAB_FLAG_COMPRESSED) {
+		offset = packFiles(numThreads, Common::getLabDataOffset(g_type, ctx.entries, ctx.flags), ctx);
+		shareDuplicates(ctx);
+	}
+	if (ftruncate(ctx.outfd, offset) != 0) {
+		printf("Could not write to %s\n", out);
+		exit(2);
+	}
+
+	writeLab(g_type, numThreads, out, ctx);
+	close(ctx.outfd);
+}
 
-	if (g_type == GT_GRIM) {
-		uint32_t s_offset = 0; // First entry of the table has offset 0 for Grim
-		fwrite(&s_offset, 1, 4, outfile);
-		fseek(outfile, -4, SEEK_CUR);
-	} else { // EMI has an offset instead.
-		writeUint32(outfile, 20 + head.num_entries * sizeof(lab_entry) + 0x13d0f);
+static bool sameContents(const char *path, const byte *data, uint64 size) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	byte buf[0x10000];
+	bool same = true;
+	for (uint64 pos = 0; same && pos < size; pos += sizeof(buf)) {
+		uint32 len = size - pos < sizeof(buf) ? size - pos : sizeof(buf);
+		same = Common::readAt(fd, pos, buf, len) && memcmp(buf, data + pos, len) == 0;
 	}
+	close(fd);
+	return same;
+}
 
-	fwrite(entries, 1, head.num_entries * sizeof(lab_entry), outfile);
-	if (g_type == GT_GRIM) {
-		fwrite(str_table, 1, head.string_table_size, outfile);
-	} else {
-		char *s = (char *)malloc(head.string_table_size);
-		memset(s, 0, head.string_table_size);
-		for (uint32_t j = 0; j < head.string_table_size; j++) {
-			if (str_table[j] != 0)
-				s[j] = str_table[j] ^ 0x96;
+// Bring an existing lab in sync with the directory. Files whose contents
+// didn't change keep their data where it is, the others are appended and
+// the directory is rewritten. When too much of the result would be dead
+// space, the lab is rebuilt from scratch instead.
+static void updateLab(const char *labname, uint32 numThreads, uint32 threshold, bool compress, bool dedup, BuildContext &ctx) {
+	Common::LabFile lab;
+	if (!lab.open(labname))
+		exit(2);
+
+	// A file with the size and modification time of its stamp wasn't touched
+	// since the lab was written, unless it was modified within the second
+	// the files were scanned.
+	std::vector<Stamp> stamps;
+	int64 stampTime = 0;
+	bool stamped = readStamps(lab, stamps, stampTime);
+	std::vector<int> index(ctx.entries.size(), -1);
+	for (uint32 i = 0; i < ctx.entries.size(); i++) {
+		index[i] = lab.findEntry(ctx.entries[i].name);
+		if (!stamped || index[i] < 0)
+			continue;
+		const Stamp &stamp = stamps[index[i]];
+		if (stamp.size == ctx.files[i].size && stamp.mtime == ctx.files[i].mtime && stamp.mtime < stampTime) {
+			ctx.hashes[i] = stamp.hash;
+			ctx.hashed[i] = true;
 		}
-		fwrite(s, 1, head.string_table_size, outfile);
-		free(s);
+	}
+	hashFiles(numThreads, ctx);
+	if (dedup)
+		findDuplicates(ctx);
+
+	uint8 g_type = lab.getGameType();
+	if (compress && !lab.isCompressed()) {
+		printf("Rebuilding %s compressed\n", labname);
+		lab.close();
+		createLab(g_type, numThreads, labname, ctx);
+		return;
+	}
+	ctx.flags = lab.getFlags();
+
+	// The hashes of the stamps tell which files changed. Without them the
+	// files are compared with the lab byte by byte.
+	std::vector<bool> kept(ctx.entries.size(), false);
+	std::vector<byte> raw;
+	for (uint32 i = 0; i < ctx.entries.size(); i++) {
+		if (index[i] < 0)
+			continue;
+		const Common::LabEntry &old = lab.getEntry(index[i]);
+		const byte *data = lab.getData(old);
+		if (!data || old.rawSize != ctx.entries[i].rawSize)
+			continue;
+		if (stamped) {
+			if (stamps[index[i]].hash != ctx.hashes[i])
+				continue;
+		} else {
+			if (old.size != old.rawSize) {
+				raw.resize(old.rawSize);
+				if (!lab.readData(old, &raw[0]))
+					continue;
+				data = &raw[0];
+			}
+			if (!sameContents(ctx.files[i].path.c_str(), data, old.rawSize))
+				continue;
+		}
+		ctx.entries[i].offset = old.offset;
+		ctx.entries[i].size = old.size;
+		kept[i] = true;
 	}
 
-	uint32_t bufsize = 1024*1024;
-	char *buf = (char *)malloc(bufsize);
+	// Data overlapping the new directory has to move as well
+	uint32 dataOffset = Common::getLabDataOffset(g_type, ctx.entries, ctx.flags);
+	for (uint32 i = 0; i < ctx.entries.size(); i++)
+		if (kept[i] && ctx.entries[i].offset < dataOffset)
+			kept[i] = false;
+
+	ctx.copies.clear();
+	for (uint32 n = 0; n < ctx.layout.size(); n++) {
+		uint32 i = ctx.layout[n];
+		if (ctx.original[i] == i && !kept[i])
+			ctx.copies.push_back(i);
+	}
 
-	for (uint32_t i = 0; i < head.num_entries; ++i) {
-		lab_entry &entry = entries[i];
-		const char *fname = str_table + READ_LE_UINT32(&entry.fname_offset);
+	// New files of a compressed lab are counted with their raw size, they
+	// are only deflated as they are written.
+	uint64 appendAt = lab.getFileSize() > dataOffset ? lab.getFileSize() : dataOffset;
+	uint64 end = appendAt;
+	uint64 used = dataOffset;
+	for (uint32 n = 0; n < ctx.layout.size(); n++) {
+		uint32 i = ctx.layout[n];
+		if (ctx.original[i] != i)
+			continue;
+		used = alignOffset(used, ctx.align) + ctx.entries[i].size;
+		if (kept[i])
+			continue;
+		end = alignOffset(end, ctx.align);
+		ctx.entries[i].offset = end;
+		end += ctx.entries[i].size;
+	}
+	shareDuplicates(ctx);
+	lab.close();
+
+	if (end > used && (end - used) * 100 > end * threshold) {
+		printf("Rebuilding %s, %llu of its %llu bytes would be unused\n", labname,
+		       (unsigned long long)(end - used), (unsigned long long)end);
+		createLab(g_type, numThreads, labname, ctx);
+		return;
+	}
+	if (Common::needsLab64(ctx.entries, end) && !(ctx.flags & LAB_FLAG_64BIT)) {
+		printf("Rebuilding %s with a 64 bit directory\n", labname);
+		createLab(g_type, numThreads, labname, ctx);
+		return;
+	}
 
-		char *path = appendPath(fname, dirname);
+	ctx.outfd = open(labname, O_RDWR);
+	if (ctx.outfd < 0) {
+		printf("Could not open file %s for writing\n", labname);
+		exit(2);
+	}
+	printf("Updating %u of %u files in %s\n", (uint32)ctx.copies.size(), (uint32)ctx.entries.size(), labname);
+	if (ctx.flags & LAB_FLAG_COMPRESSED) {
+		packFiles(numThreads, appendAt, ctx);
+		shareDuplicates(ctx);
+	}
+	writeLab(g_type, numThreads, labname, ctx);
+	close(ctx.outfd);
+}
 
-		FILE *file = fopen(path, "rb");
-		free(path);
+int main(int argc, char **argv) {
+	uint32 numThreads = Common::getNumCPUs();
+	uint32 threshold = DEFAULT_COMPACT_THRESHOLD;
+	bool dedup = true;
+	bool compress = false;
+	const char *tracename = 0;
+	const char *manifest = 0;
+	uint32 align = 1;
+	int arg = 1;
 
-		uint32_t offset = READ_LE_UINT32(&entry.start);
-		uint32_t size = READ_LE_UINT32(&entry.size);
+	if (argc > 1 && !strcmp(argv[1], "--help")) {
+		help();
+	}
 
-		if (size > bufsize) {
-			char *newbuf = (char *)realloc(buf, size);
-			if (!newbuf) {
-				free(buf);
-				printf("Could not allocate memory\n");
-				exit(3);
+	while (argc > arg + 1) {
+		if (!strcmp(argv[arg], "--no-dedup")) {
+			dedup = false;
+			arg++;
+			continue;
+		} else if (!strcmp(argv[arg], "--compress")) {
+#ifndef USE_ZLIB
+			printf("Compressed labs need zlib support\n");
+			exit(1);
+#endif
+			compress = true;
+			arg++;
+			continue;
+		} else if (!strcmp(argv[arg], "-j")) {
+			numThreads = atoi(argv[arg + 1]);
+			if (numThreads == 0)
+				numThreads = Common::getNumCPUs();
+		} else if (!strcmp(argv[arg], "--compact")) {
+			threshold = atoi(argv[arg + 1]);
+		} else if (!strcmp(argv[arg], "--manifest")) {
+			manifest = argv[arg + 1];
+		} else if (!strcmp(argv[arg], "--order")) {
+			tracename = argv[arg + 1];
+		} else if (!strcmp(argv[arg], "--align")) {
+			align = atoi(argv[arg + 1]);
+			if (align == 0 || (align & (align - 1)) != 0) {
+				printf("The alignment must be a power of two\n");
+				exit(1);
 			}
-			bufsize = size;
-			buf = newbuf;
+		} else {
+			break;
 		}
+		arg += 2;
+	}
+
+	// With a manifest there is no directory argument
+	if (argc - arg < (manifest ? 2 : 3)) {
+		usage();
+		exit(1);
+	}
 
-// 		printf("writing file %s, at offset %d and of size %d\n", fname, offset, size);
+	const char *type = argv[arg];
+	BuildContext ctx;
+	ctx.failed = false;
+	ctx.align = align;
+	ctx.flags = compress ? LAB_FLAG_COMPRESSED : 0;
+
+	if (!strcmp(type, "--update")) {
+		collectFiles(manifest ? 0 : argv[arg + 2], manifest, numThreads, ctx);
+		orderFiles(tracename, ctx);
+		updateLab(argv[arg + 1], numThreads, threshold, compress, dedup, ctx);
+		writeStamps(argv[arg + 1], ctx);
+		return 0;
+	}
 
-		fread(buf, 1, size, file);
-		fseek(outfile, offset, SEEK_SET);
-		fwrite(buf, 1, size, outfile);
+	const char *dirname = manifest ? 0 : argv[arg + 1];
+	const char *out = argv[arg + (manifest ? 1 : 2)];
 
-		fclose(file);
+	uint8 g_type;
+	if (!strcmp(type, "--grim")) {
+		g_type = GT_GRIM;
+	} else if (!strcmp(type, "--emi")) {
+		g_type = GT_EMI;
+	} else {
+		usage();
+		exit(1);
 	}
 
-	fclose(outfile);
-	free(buf);
-	free(entries);
-	free(str_table);
+	collectFiles(dirname, manifest, numThreads, ctx);
+	hashFiles(numThreads, ctx);
+	if (dedup)
+		findDuplicates(ctx);
+	orderFiles(tracename, ctx);
+	createLab(g_type, numThreads, out, ctx);
+	writeStamps(out, ctx);
 
 	return 0;
 }
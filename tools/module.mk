@@ -23,6 +23,12 @@ TOOLS := \
 	tools/mklab$(EXEEXT) \
 	tools/vima$(EXEEXT) \
 	tools/labcopy$(EXEEXT) \
+	tools/labverify$(EXEEXT) \
+	tools/labpatch$(EXEEXT) \
+	tools/labgrep$(EXEEXT) \
+	tools/labcompact$(EXEEXT) \
+	tools/labxorbench$(EXEEXT) \
+	tools/mkcatalog$(EXEEXT) \
 	tools/luac/luac$(EXEEXT) \
 	tools/patchex/patchex$(EXEEXT) \
 	tools/diffr$(EXEEXT) \
@@ -39,9 +45,14 @@ clean: clean-tools
 # Main target
 tools: $(TOOLS)
 
+# Round trip checks of the lab and patch tools
+check: tools
+	$(SHELL) $(srcdir)/test/roundtrip.sh tools
+
 clean-tools:
 	-$(RM) $(TOOLS)
 	-$(RM) tools/emi/*.o
+	-$(RM) tools/delua-engine.o
 	-$(RM) tools/patchex/*.o
 	-$(RM) -r tools/patchex/.deps
 	-$(RM) -r tools/luac/*.o
@@ -51,21 +62,32 @@ clean-tools:
 # Build rules for the tools
 #
 
-tools/diffr$(EXEEXT): $(srcdir)/tools/diffr.cpp $(srcdir)/common/md5.o $(srcdir)/common/zlib.o
+tools/diffr$(EXEEXT): $(srcdir)/tools/diffr.cpp $(srcdir)/common/md5.o $(srcdir)/common/zlib.o $(srcdir)/common/thread.o $(srcdir)/common/fileio.o
 	$(MKDIR) tools/$(DEPDIR)
 	$(CXX) $(CFLAGS) $(DEFINES) -DHAVE_CONFIG_H -I$(srcdir) -I. -Wall \
-	-L$(srcdir)/common $(srcdir)/common/md5.o  $(srcdir)/common/zlib.o -lz -o $@ $< $(LDFLAGS)
+	-L$(srcdir)/common $(srcdir)/common/md5.o  $(srcdir)/common/zlib.o $(srcdir)/common/thread.o $(srcdir)/common/fileio.o \
+	-lz -lpthread -o $@ $< $(LDFLAGS)
 
-tools/patchr$(EXEEXT): $(srcdir)/tools/patchr.cpp $(srcdir)/common/md5.o $(srcdir)/common/zlib.o
+tools/patchr$(EXEEXT): $(srcdir)/tools/patchr.cpp $(srcdir)/common/md5.o $(srcdir)/common/zlib.o $(srcdir)/common/patch.o $(srcdir)/common/fileio.o
 	$(MKDIR) tools/$(DEPDIR)
 	$(CXX) $(CFLAGS) $(DEFINES) -DHAVE_CONFIG_H -I$(srcdir) -I. -Wall \
-	-L$(srcdir)/common $(srcdir)/common/md5.o  $(srcdir)/common/zlib.o -lz -o $@ $< $(LDFLAGS)
+	-L$(srcdir)/common $(srcdir)/common/md5.o  $(srcdir)/common/zlib.o $(srcdir)/common/patch.o $(srcdir)/common/fileio.o -lz -o $@ $< $(LDFLAGS)
 
 tools/delua$(EXEEXT): $(srcdir)/tools/delua.cpp
 	$(MKDIR) tools/$(DEPDIR)
 	$(CXX) $(CFLAGS) $(DEFINES) -DHAVE_CONFIG_H -I$(srcdir) -I. -Wall \
 	-L$(srcdir)/common -Ltools/lua -o $@ $< $(LDFLAGS) -llua
 
+# labgrep links the decompiler of delua, without its main()
+tools/delua-engine.o: $(srcdir)/tools/delua.cpp
+	$(CXX) $(CFLAGS) $(DEFINES) -DHAVE_CONFIG_H -DDELUA_NO_MAIN -I$(srcdir) -I. -Wall -c -o $@ $<
+
+tools/labgrep$(EXEEXT): $(srcdir)/tools/labgrep.cpp tools/delua-engine.o $(srcdir)/common/lab.o $(srcdir)/common/zlib.o $(srcdir)/common/thread.o
+	$(MKDIR) tools/$(DEPDIR)
+	$(CXX) $(CFLAGS) $(DEFINES) -DHAVE_CONFIG_H -I$(srcdir) -I. -Wall \
+	-L$(srcdir)/common -Ltools/lua tools/delua-engine.o $(srcdir)/common/lab.o $(srcdir)/common/zlib.o $(srcdir)/common/thread.o \
+	-o $@ $< $(LDFLAGS) -llua -lpthread -lz
+
 #g++ -DHAVE_CONFIG_H -DUNIX -I. -I./tools/luac  -I ./tools/lua   -c -o tools/luac/print.o tools/luac/print.c
 
 tools/luac/luac$(EXEEXT):
@@ -99,51 +121,86 @@ tools/cosb2cos$(EXEEXT): $(srcdir)/tools/emi/cosb2cos.cpp
 	$(CXX) $(CFLAGS) $(DEFINES) -DHAVE_CONFIG_H -I$(srcdir) -I. -Wall \
 	-L$(srcdir)/common -o $@ $< $(LDFLAGS)
 
-tools/meshb2obj$(EXEEXT): $(srcdir)/tools/emi/meshb2obj.o $(srcdir)/tools/emi/lab.o
+tools/meshb2obj$(EXEEXT): $(srcdir)/tools/emi/meshb2obj.o $(srcdir)/tools/emi/lab.o $(srcdir)/common/lab.o $(srcdir)/common/catalog.o $(srcdir)/common/zlib.o $(srcdir)/common/fileio.o $(srcdir)/common/thread.o
 	$(MKDIR) tools/$(DEPDIR)
 	$(CXX) $(CFLAGS) $(DEFINES) -DHAVE_CONFIG_H -I$(srcdir) -I. -Wall \
-	-L$(srcdir)/common tools/emi/lab.o -o $@ $< $(LDFLAGS)
+	-L$(srcdir)/common tools/emi/lab.o $(srcdir)/common/lab.o $(srcdir)/common/catalog.o $(srcdir)/common/zlib.o $(srcdir)/common/fileio.o $(srcdir)/common/thread.o -o $@ $< $(LDFLAGS) -lpthread -lz
 
-tools/animb2txt$(EXEEXT): $(srcdir)/tools/emi/animb2txt.cpp $(srcdir)/tools/emi/lab.o
+tools/animb2txt$(EXEEXT): $(srcdir)/tools/emi/animb2txt.cpp $(srcdir)/tools/emi/lab.o $(srcdir)/common/lab.o $(srcdir)/common/catalog.o $(srcdir)/common/zlib.o $(srcdir)/common/fileio.o $(srcdir)/common/thread.o
 	$(MKDIR) tools/$(DEPDIR)
 	$(CXX) $(CFLAGS) $(DEFINES) -DHAVE_CONFIG_H -I$(srcdir) -I. -Wall \
-	-L$(srcdir)/common tools/emi/lab.o -o $@ $< $(LDFLAGS)
+	-L$(srcdir)/common tools/emi/lab.o $(srcdir)/common/lab.o $(srcdir)/common/catalog.o $(srcdir)/common/zlib.o $(srcdir)/common/fileio.o $(srcdir)/common/thread.o -o $@ $< $(LDFLAGS) -lpthread -lz
 
-tools/setb2set$(EXEEXT): $(srcdir)/tools/emi/setb2set.cpp $(srcdir)/tools/emi/lab.o
+tools/setb2set$(EXEEXT): $(srcdir)/tools/emi/setb2set.cpp $(srcdir)/tools/emi/lab.o $(srcdir)/common/lab.o $(srcdir)/common/catalog.o $(srcdir)/common/zlib.o $(srcdir)/common/fileio.o $(srcdir)/common/thread.o
 	$(MKDIR) tools/$(DEPDIR)
 	$(CXX) $(CFLAGS) $(DEFINES) -DHAVE_CONFIG_H -I$(srcdir) -I. -Wall \
-	-L$(srcdir)/common tools/emi/lab.o -o $@ $< $(LDFLAGS)
+	-L$(srcdir)/common tools/emi/lab.o $(srcdir)/common/lab.o $(srcdir)/common/catalog.o $(srcdir)/common/zlib.o $(srcdir)/common/fileio.o $(srcdir)/common/thread.o -o $@ $< $(LDFLAGS) -lpthread -lz
 
-tools/sklb2txt$(EXEEXT): $(srcdir)/tools/emi/sklb2txt.cpp $(srcdir)/tools/emi/lab.o
+tools/sklb2txt$(EXEEXT): $(srcdir)/tools/emi/sklb2txt.cpp $(srcdir)/tools/emi/lab.o $(srcdir)/common/lab.o $(srcdir)/common/catalog.o $(srcdir)/common/zlib.o $(srcdir)/common/fileio.o $(srcdir)/common/thread.o
 	$(MKDIR) tools/$(DEPDIR)
 	$(CXX) $(CFLAGS) $(DEFINES) -DHAVE_CONFIG_H -I$(srcdir) -I. -Wall \
-	-L$(srcdir)/common tools/emi/lab.o -o $@ $< $(LDFLAGS)
+	-L$(srcdir)/common tools/emi/lab.o $(srcdir)/common/lab.o $(srcdir)/common/catalog.o $(srcdir)/common/zlib.o $(srcdir)/common/fileio.o $(srcdir)/common/thread.o -o $@ $< $(LDFLAGS) -lpthread -lz
 
 tools/set2fig$(EXEEXT): $(srcdir)/tools/set2fig.cpp
 	$(MKDIR) tools/$(DEPDIR)
 	$(CXX) $(CFLAGS) -Wall -o $@ $< $(LDFLAGS)
 
-tools/til2bmp$(EXEEXT): $(srcdir)/tools/emi/til2bmp.cpp $(srcdir)/tools/emi/lab.o
+tools/til2bmp$(EXEEXT): $(srcdir)/tools/emi/til2bmp.cpp $(srcdir)/tools/emi/lab.o $(srcdir)/common/lab.o $(srcdir)/common/catalog.o $(srcdir)/common/zlib.o $(srcdir)/common/fileio.o $(srcdir)/common/thread.o
 	$(MKDIR) tools/$(DEPDIR)
 	$(CXX) $(CFLAGS) $(DEFINES) -DHAVE_CONFIG_H -I$(srcdir) -I. -Wall \
-	-L$(srcdir)/common tools/emi/lab.o -o $@ $< $(LDFLAGS) -lz
+	-L$(srcdir)/common tools/emi/lab.o $(srcdir)/common/lab.o $(srcdir)/common/catalog.o $(srcdir)/common/zlib.o $(srcdir)/common/fileio.o $(srcdir)/common/thread.o -o $@ $< $(LDFLAGS) -lpthread -lz
 
-tools/unlab$(EXEEXT): $(srcdir)/tools/unlab.cpp
+tools/unlab$(EXEEXT): $(srcdir)/tools/unlab.cpp $(srcdir)/common/lab.o $(srcdir)/common/zlib.o $(srcdir)/common/fileio.o $(srcdir)/common/thread.o
 	$(MKDIR) tools/$(DEPDIR)
-	$(CXX) $(CFLAGS) -Wall -o $@ $< $(LDFLAGS)
+	$(CXX) $(CFLAGS) $(DEFINES) -DHAVE_CONFIG_H -I$(srcdir) -I. -Wall \
+	-L$(srcdir)/common $(srcdir)/common/lab.o $(srcdir)/common/zlib.o $(srcdir)/common/fileio.o $(srcdir)/common/thread.o \
+	-o $@ $< $(LDFLAGS) -lpthread -lz
 
-tools/mklab$(EXEEXT): $(srcdir)/tools/mklab.cpp
+tools/mklab$(EXEEXT): $(srcdir)/tools/mklab.cpp $(srcdir)/common/lab.o $(srcdir)/common/zlib.o $(srcdir)/common/fileio.o $(srcdir)/common/thread.o $(srcdir)/common/hash.o
 	$(MKDIR) tools/$(DEPDIR)
-	$(CXX) $(CFLAGS) -Wall -o $@ $< $(LDFLAGS)
+	$(CXX) $(CFLAGS) $(DEFINES) -DHAVE_CONFIG_H -I$(srcdir) -I. -Wall \
+	-L$(srcdir)/common $(srcdir)/common/lab.o $(srcdir)/common/zlib.o $(srcdir)/common/fileio.o $(srcdir)/common/thread.o $(srcdir)/common/hash.o \
+	-o $@ $< $(LDFLAGS) -lpthread -lz
 
 tools/vima$(EXEEXT): $(srcdir)/tools/vima.cpp
 	$(MKDIR) tools/$(DEPDIR)
 	$(CXX) $(CFLAGS) -Wall -o $@ $< $(LDFLAGS)
 
-tools/labcopy$(EXEEXT): $(srcdir)/tools/labcopy.cpp
+tools/labcopy$(EXEEXT): $(srcdir)/tools/labcopy.cpp $(srcdir)/common/lab.o $(srcdir)/common/zlib.o $(srcdir)/common/fileio.o $(srcdir)/common/hash.o
 	$(MKDIR) tools/$(DEPDIR)
 	$(CXX) $(CFLAGS) $(DEFINES) -DHAVE_CONFIG_H -I$(srcdir) -Wall \
-	-L$(srcdir)/common -o $@ $< $(LDFLAGS)
+	-L$(srcdir)/common $(srcdir)/common/lab.o $(srcdir)/common/zlib.o $(srcdir)/common/fileio.o $(srcdir)/common/hash.o \
+	-o $@ $< $(LDFLAGS) -lz
+
+tools/labverify$(EXEEXT): $(srcdir)/tools/labverify.cpp $(srcdir)/common/lab.o $(srcdir)/common/zlib.o $(srcdir)/common/hash.o $(srcdir)/common/thread.o
+	$(MKDIR) tools/$(DEPDIR)
+	$(CXX) $(CFLAGS) $(DEFINES) -DHAVE_CONFIG_H -I$(srcdir) -I. -Wall \
+	-L$(srcdir)/common $(srcdir)/common/lab.o $(srcdir)/common/zlib.o $(srcdir)/common/hash.o $(srcdir)/common/thread.o \
+	-o $@ $< $(LDFLAGS) -lpthread -lz
+
+tools/labxorbench$(EXEEXT): $(srcdir)/tools/labxorbench.cpp $(srcdir)/common/lab.o $(srcdir)/common/zlib.o
+	$(MKDIR) tools/$(DEPDIR)
+	$(CXX) $(CFLAGS) $(DEFINES) -DHAVE_CONFIG_H -I$(srcdir) -I. -Wall \
+	-L$(srcdir)/common $(srcdir)/common/lab.o $(srcdir)/common/zlib.o \
+	-o $@ $< $(LDFLAGS) -lz
+
+tools/labpatch$(EXEEXT): $(srcdir)/tools/labpatch.cpp $(srcdir)/common/lab.o $(srcdir)/common/patch.o $(srcdir)/common/md5.o $(srcdir)/common/zlib.o $(srcdir)/common/fileio.o
+	$(MKDIR) tools/$(DEPDIR)
+	$(CXX) $(CFLAGS) $(DEFINES) -DHAVE_CONFIG_H -I$(srcdir) -I. -Wall \
+	-L$(srcdir)/common $(srcdir)/common/lab.o $(srcdir)/common/patch.o $(srcdir)/common/md5.o $(srcdir)/common/zlib.o $(srcdir)/common/fileio.o \
+	-o $@ $< $(LDFLAGS) -lz
+
+tools/labcompact$(EXEEXT): $(srcdir)/tools/labcompact.cpp $(srcdir)/common/lab.o $(srcdir)/common/zlib.o $(srcdir)/common/fileio.o
+	$(MKDIR) tools/$(DEPDIR)
+	$(CXX) $(CFLAGS) $(DEFINES) -DHAVE_CONFIG_H -I$(srcdir) -I. -Wall \
+	-L$(srcdir)/common $(srcdir)/common/lab.o $(srcdir)/common/zlib.o $(srcdir)/common/fileio.o \
+	-o $@ $< $(LDFLAGS) -lz
+
+tools/mkcatalog$(EXEEXT): $(srcdir)/tools/mkcatalog.cpp $(srcdir)/common/lab.o $(srcdir)/common/catalog.o $(srcdir)/common/zlib.o
+	$(MKDIR) tools/$(DEPDIR)
+	$(CXX) $(CFLAGS) $(DEFINES) -DHAVE_CONFIG_H -I$(srcdir) -I. -Wall \
+	-L$(srcdir)/common $(srcdir)/common/lab.o $(srcdir)/common/catalog.o $(srcdir)/common/zlib.o \
+	-o $@ $< $(LDFLAGS) -lz
 
 tools/patchex/patchex$(EXEEXT): tools/patchex/patchex.o tools/patchex/mszipd.o tools/patchex/cabd.o
 	$(MKDIR) tools/patchex/$(DEPDIR)
@@ -43,48 +43,37 @@
  */
 
 #include <iostream>
-#include <fstream>
 #include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <vector>
 #include "common/endian.h"
-#include "common/zlib.h"
-#include "common/md5.h"
+#include "common/fileio.h"
 #include "common/getopt.h"
+#include "common/patch.h"
 
-uint8 *old_block, *new_block;
-GZipReadStream *ctrlDec, *diffDec, *extraDec;
-
-void free_memory() {
-	if (old_block)
-		delete[] old_block;
-	if (new_block)
-		delete[] new_block;
-
-	if (ctrlDec)
-		delete ctrlDec;
-	if (diffDec)
-		delete diffDec;
-	if (extraDec && extraDec != diffDec)
-		delete extraDec;
-}
+// The new file is produced and written this many bytes at a time
+#define CHUNK_SIZE 0x10000
 
-void show_header_info(uint8 *header) {
-	printf("PatchR v%d.%d\n", READ_LE_UINT16(header + 4), READ_LE_UINT16(header + 6));
+void show_header_info(const Common::PatchHeader &header) {
+	printf("PatchR v%d.%d\n", header.versionMajor, header.versionMinor);
 	printf("Md5: ");
 	for (int i = 0; i < 16; ++i)
-		printf("%x", *(header + 12 + i));
+		printf("%x", header.md5[i]);
 	printf("\n");
 
-	uint32 flags = READ_LE_UINT32(header + 8);
-	printf("MIX_DIFF_EXTRA %s\n", (flags & 1 << 0) ? "YES" : "NO");
-	printf("COMPRESS_CTRL %s\n", (flags & 1 << 1) ? "YES" : "NO");
+	printf("MIX_DIFF_EXTRA %s\n", (header.flags & 1 << 0) ? "YES" : "NO");
+	printf("COMPRESS_CTRL %s\n", (header.flags & 1 << 1) ? "YES" : "NO");
 	printf("\n");
 
-	printf("OLD FILE SIZE %d\n", READ_LE_UINT32(header + 28));
-	printf("NEW FILE SIZE %d\n", READ_LE_UINT32(header + 32));
+	printf("OLD FILE SIZE %llu\n", (unsigned long long)header.oldSize);
+	printf("NEW FILE SIZE %llu\n", (unsigned long long)header.newSize);
 	printf("\n");
-	printf("CTRL STREAM SIZE %d\n", READ_LE_UINT32(header + 36));
-	printf("DIFF STREAM SIZE %d\n", READ_LE_UINT32(header + 40));
-	printf("EXTRA STREAM SIZE %d\n", READ_LE_UINT32(header + 44));
+	printf("CTRL STREAM SIZE %llu\n", (unsigned long long)header.ctrlSize);
+	printf("DIFF STREAM SIZE %llu\n", (unsigned long long)header.diffSize);
+	printf("EXTRA STREAM SIZE %llu\n", (unsigned long long)header.extraSize);
 	printf("\n");
 }
 
@@ -129,51 +118,89 @@ arguments parse_args(int argc, char *argv[]) {
 	return arg;
 }
 
+static bool file_size(int fd, uint64 &size) {
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+		return false;
+	size = st.st_size;
+	return true;
+}
+
+// Print the raw diff bytes, the new data xored back with the old one, as
+// runs of changed and unchanged bytes. The runs go on across calls, as the
+// diff of a command is read a chunk at a time.
+static bool show_diff(int oldfd, uint64 oldsize, const Common::PatchCommand &cmd, uint64 done,
+                      byte *data, uint64 len, int &run, uint64 &copied) {
+	std::vector<byte> old(len);
+	uint64 oldpos = cmd.oldPos + done;
+	if (oldpos < oldsize) {
+		uint64 avail = oldsize - oldpos < len ? oldsize - oldpos : len;
+		if (!Common::readAt(oldfd, oldpos, &old[0], avail))
+			return false;
+		for (uint64 i = 0; i < avail; i++)
+			data[i] ^= old[i];
+	}
+
+	for (uint64 i = 0; i < len; i++) {
+		if (data[i] != 0) {
+			if (run == 2)
+				printf("COPY %llu\n", (unsigned long long)copied);
+			if (run != 1)
+				printf("XOR");
+			printf(" %02x", data[i]);
+			run = 1;
+		} else {
+			if (run == 1)
+				printf("\n");
+			if (run != 2)
+				copied = 0;
+			copied++;
+			run = 2;
+		}
+	}
+
+	// Restore the new data
+	if (oldpos < oldsize) {
+		uint64 avail = oldsize - oldpos < len ? oldsize - oldpos : len;
+		for (uint64 i = 0; i < avail; i++)
+			data[i] ^= old[i];
+	}
+	return true;
+}
+
+static void end_diff(int &run, uint64 copied) {
+	if (run == 1)
+		printf("\n");
+	else if (run == 2)
+		printf("COPY %llu\n", (unsigned long long)copied);
+	run = 0;
+}
+
 int main(int argc,char * argv[]) {
-	uint32 oldsize, newsize;
-	uint32 zctrllen, zdatalen, zextralen;
-	uint8 header[48], buf[4];
-	uint32 oldpos, newpos;
-	uint32 ctrl[3];
-	uint32 lenread;
-	uint32 flags;
-	uint8 md5[16];
-	std::ifstream oldfile, patch, ctrlStream, diffStream, extraStream;
-	std::ofstream newfile;
-	bool comp_ctrl, mix;
+	uint64 oldsize, patchsize, newpos;
+	uint8 header[PATCH_HEADER64_SIZE];
+	Common::PatchHeader info;
 	arguments args;
 
-	old_block = 0;
-	new_block = 0;
-	atexit(free_memory);
-
 	args = parse_args(argc, argv);
 
 	/* Opens the old file */
-	oldfile.open(args.oldfile, std::ios::in | std::ios::binary);
-	if (oldfile.fail()) {
-		std::cerr << "Unable to open" << args.oldfile << std::endl;
+	int oldfd = open(args.oldfile, O_RDONLY);
+	if (oldfd < 0 || !file_size(oldfd, oldsize)) {
+		std::cerr << "Unable to open " << args.oldfile << std::endl;
 		return 1;
 	}
 
-	//Get the file size
-	oldfile.seekg(0, std::ios::end);
-	oldsize = oldfile.tellg();
-
 	/* Open patch file */
-	patch.open(args.patchfile, std::ios::in | std::ios::binary);
-	ctrlStream.open(args.patchfile, std::ios::in | std::ios::binary);
-	diffStream.open(args.patchfile, std::ios::in | std::ios::binary);
-	extraStream.open(args.patchfile, std::ios::in | std::ios::binary);
-
-	if (patch.fail() || ctrlStream.fail() || diffStream.fail() || extraStream.fail()) {
+	int patchfd = open(args.patchfile, O_RDONLY);
+	if (patchfd < 0 || !file_size(patchfd, patchsize)) {
 		std::cerr << "Unable to open " << args.patchfile << std::endl;
 		return 1;
 	}
 
-	/* Read header */
-	patch.read((char*)header, 48);
-	if (patch.eof() || patch.bad() || patch.fail()) {
+	/* Read header, the version 2 one is shorter than the version 3 one */
+	uint32 headersize = patchsize < PATCH_HEADER64_SIZE ? patchsize : PATCH_HEADER64_SIZE;
+	if (headersize < PATCH_HEADER_SIZE || !Common::readAt(patchfd, 0, header, headersize)) {
 		std::cerr << "Corrupt patch\n";
 		return 1;
 	}
@@ -185,169 +212,100 @@ int main(int argc,char * argv[]) {
 	}
 
 	/* Check the version */
-	if (READ_LE_UINT16(header + 4) != 2 || READ_LE_UINT16(header + 6) > 0) {
+	if (!Common::parsePatchHeader(header, headersize, info)) {
 		std::cerr << "Wrong version number\n";
 		return 1;
 	}
 
-	//Set flags
-	flags = READ_LE_UINT32(header + 8);
-	mix = (flags & 1 << 0) ? true : false;
-	comp_ctrl = (flags & 1 << 1) ? true : false;
+	/* The old file and the patch are read on demand, only a few chunks
+	 * of them are held in memory whatever their size */
+	Common::PatchReadStream stream(Common::DataRange(oldfd, 0, oldsize), Common::DataRange(patchfd, 0, patchsize));
+	if (stream.err()) {
+		std::cerr << "Corrupt patch\n";
+		return 1;
+	}
 
 	/* Check if the file to patch match */
-	Common::md5_file(args.oldfile, md5, 5000);
-	if (memcmp(md5, header + 12, 16) != 0 || oldsize != READ_LE_UINT32(header + 28)) {
+	if (!stream.matches()) {
 		std::cerr << args.patchfile << " targets a different file\n";
 		return 1;
 	}
 
-	/* Read lengths from header */
-	newsize = READ_LE_UINT32(header + 32);
-	zctrllen = READ_LE_UINT32(header + 36);
-	zdatalen = READ_LE_UINT32(header + 40);
-	zextralen = READ_LE_UINT32(header + 44);
-
-	patch.close();
 	if (args.show_info)
-		show_header_info(header);
-
-	// Open the compressed sub-streams
-	//Check if the ctrl is compressed
-	ctrlStream.seekg(48, std::ios::beg);
-	if (comp_ctrl)
-		ctrlDec = new GZipReadStream(&ctrlStream, 48, zctrllen);
-
-	diffDec = new GZipReadStream(&diffStream, 48 + zctrllen, zdatalen);
-	if (mix)
-		extraDec = diffDec;
-	else
-		extraDec = new GZipReadStream(&extraStream, 48 + zctrllen + zdatalen, zextralen);
-
-	old_block = new uint8[oldsize];
-	new_block = new byte[newsize];
-	if (old_block == NULL || new_block == NULL) {
-		std::cerr << "Not enough memory\n";
-		return 1;
-	}
-	
-	//Read the oldfile
-	oldfile.seekg(0, std::ios::beg);
-	oldfile.read((char*)old_block, oldsize);
-	oldfile.close();
-	if (oldfile.bad() || oldfile.fail()) {
-		std::cerr << "Input error\n";
+		show_header_info(info);
+
+	int newfd = open(args.newfile, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (newfd < 0) {
+		std::cerr << "Unable to open " << args.newfile << std::endl;
 		return 1;
 	}
 
-	oldpos=0;
-	newpos=0;
-	while(newpos < newsize) {
-		/* Read control data */
-		for (uint i = 0; i < 3; i++) {
-			if (comp_ctrl)
-				lenread = ctrlDec->read(buf, 4);
-			else {
-				ctrlStream.read((char*)buf, 4);
-				lenread = ctrlStream.gcount();
-			}
-			if (lenread < 4) {
+	std::vector<byte> chunk(CHUNK_SIZE);
+	newpos = 0;
+	if (!args.show_info) {
+		while (!stream.eos()) {
+			uint64 len = stream.read(&chunk[0], CHUNK_SIZE);
+			if (stream.err() || len == 0) {
 				std::cerr << "Corrupt patch\n";
 				return 1;
 			}
-			ctrl[i] = READ_LE_UINT32(buf);
-		};
-
-		/* Sanity-check */
-		if (newpos + ctrl[0] > newsize) {
-			std::cerr << "Corrupt patch\n";
-			return 1;
-		}
-
-		/* Read diff string */
-		lenread = diffDec->read(new_block + newpos, ctrl[0]);
-		if ((lenread < ctrl[0]) || diffDec->err()) {
-			std::cerr << "Corrupt patch\n";
-			return 1;
+			if (!Common::writeAt(newfd, newpos, &chunk[0], len)) {
+				std::cerr << "Output error.\n";
+				return 1;
+			}
+			newpos += len;
 		}
+	} else {
+		/* Walk the commands one by one to show them */
+		Common::PatchCommand cmd;
+		while (!stream.eos()) {
+			if (!stream.nextCommand(cmd)) {
+				std::cerr << "Corrupt patch\n";
+				return 1;
+			}
 
-		//Show info
-		if (args.show_info && ctrl[0] > 0) {
-			uint i = 0;
-			while (i < ctrl[0]) {
-				if (*(new_block + newpos + i) != 0) {
-					printf("XOR");
-					do {
-						printf(" %02x", *(new_block + newpos + i));
-						++i;
-					} while (i < ctrl[0] && *(new_block + newpos + i) != 0);
-					printf("\n");
+			int run = 0;
+			uint64 copied = 0;
+			for (uint64 done = 0; done < cmd.diffLen + cmd.extraLen; ) {
+				uint64 left = done < cmd.diffLen ? cmd.diffLen - done : cmd.diffLen + cmd.extraLen - done;
+				uint64 len = stream.read(&chunk[0], left < CHUNK_SIZE ? left : CHUNK_SIZE);
+				if (stream.err() || len == 0) {
+					std::cerr << "Corrupt patch\n";
+					return 1;
+				}
+				if (done < cmd.diffLen) {
+					if (!show_diff(oldfd, oldsize, cmd, done, &chunk[0], len, run, copied)) {
+						std::cerr << "Input error\n";
+						return 1;
+					}
+					if (done + len == cmd.diffLen)
+						end_diff(run, copied);
 				} else {
-					uint pos = i;
-					while (i < ctrl[0] && *(new_block + newpos + i) == 0)
-						++i;
-					printf("COPY %d\n", i - pos);
+					if (done == cmd.diffLen)
+						printf("INSERT");
+					for (uint64 i = 0; i < len; i++)
+						printf(" %02x", chunk[i]);
+					if (done + len == cmd.diffLen + cmd.extraLen)
+						printf("\n");
 				}
-			}
-		}
-
-		/* Add old data to diff string */
-		for (uint i = 0; i < ctrl[0]; i++)
-			if ((oldpos + i >= 0) && (oldpos + i < oldsize))
-				new_block[newpos + i] ^= old_block[oldpos + i];
-
-		/* Adjust pointers */
-		newpos += ctrl[0];
-		oldpos += ctrl[0];
-
-		/* Sanity-check */
-		if (newpos + ctrl[1] > newsize) {
-			std::cerr << "Corrupt patch\n";
-			return 1;
-		}
-
-		/* Read extra string */
-		lenread = extraDec->read(new_block + newpos, ctrl[1]);
-		if ((lenread < ctrl[1]) || extraDec->err()) {
-			std::cerr << "Corrupt patch\n";
-			return 1;
-		}
-
-		//Show info
-		if (args.show_info) {
-			if (ctrl[1] > 0) {
-				printf("INSERT");
-				for (uint i = 0; i < ctrl[1]; i++)
-					printf(" %02x", *(new_block + newpos + i));
-				printf("\n");
+				if (!Common::writeAt(newfd, newpos, &chunk[0], len)) {
+					std::cerr << "Output error.\n";
+					return 1;
+				}
+				done += len;
+				newpos += len;
 			}
 
-			if (ctrl[2] != 0)
-				printf("JUMP %d\n", ctrl[2]);
+			if (cmd.seek != 0)
+				printf("JUMP %lld\n", (long long)cmd.seek);
 		}
-
-		/* Adjust pointers */
-		newpos += ctrl[1];
-		oldpos += int32(ctrl[2]);
-	};
-
-	/* Clean up the bzip2 reads */
-	ctrlStream.close();
-	diffStream.close();
-	extraStream.close();
-
-	/* Write the new file */
-	newfile.open(args.newfile, std::ios::out | std::ios::binary);
-	if (newfile.fail()) {
-		std::cerr << "Unable to open" << args.newfile << std::endl;
-		return 1;
 	}
 
-	newfile.write((char*)new_block, newsize);
-	if (patch.bad()) {
+	if (close(newfd) != 0) {
 		std::cerr << "Output error.\n";
 		return 1;
 	}
-
+	close(patchfd);
+	close(oldfd);
 	return 0;
 }
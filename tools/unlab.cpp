@@ -22,172 +22,325 @@
 
 #include <stdlib.h>
 #include <stdio.h>
-#include <stdint.h>
 #include <string.h>
 
+#include <algorithm>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "common/lab.h"
+#include "common/thread.h"
+
 #ifdef WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#define PATH_SEPARATOR '\\'
+#else
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <regex.h>
+#include "common/fileio.h"
+#define PATH_SEPARATOR '/'
 #endif
 
-#define GT_GRIM 1
-#define GT_EMI 2
-
-struct lab_header {
-	uint32_t magic;
-	uint32_t magic2;
-	uint32_t num_entries;
-	uint32_t string_table_size;
-	uint32_t string_table_offset;
+struct ExtractJob {
+	const Common::LabEntry *entry;
+	std::string path;
 };
 
-struct lab_entry {
-	uint32_t fname_offset;
-	uint32_t start;
-	uint32_t size;
-	uint32_t reserved;
+struct ExtractContext {
+	const Common::LabFile *lab;
+	std::vector<ExtractJob> jobs;
 };
 
-uint16_t READ_LE_UINT16(const void *ptr) {
-	const uint8_t *b = (const uint8_t *)ptr;
-	return (b[1] << 8) + b[0];
+static bool compareByOffset(const ExtractJob &a, const ExtractJob &b) {
+	return a.entry->offset < b.entry->offset;
+}
+
+static void usage() {
+	printf("Usage: unlab [OPTIONS] FILE [NAME...]\n");
+	printf("Extract the files contained into the lab FILE into the current directory.\n");
+	printf("If names or filters are given, only the matching files are extracted.\n\n");
+	printf("\t-j N\t\tExtract with N parallel workers, 0 uses one per processor.\n");
+	printf("\t-g GLOB\t\tSelect the files matching GLOB (* and ? wildcards).\n");
+	printf("\t-r REGEX\tSelect the files matching the extended regular expression.\n");
+	printf("\t-l LIST\t\tSelect the files named in LIST, one per line (- for stdin).\n");
+	printf("\t-c, --cat, --stdout\n\t\t\tWrite the selected files to stdout instead of extracting them.\n");
+	printf("\t--help\t\tPrint this help.\n");
+}
+
+static bool matchGlob(const char *pattern, const char *name) {
+	while (*pattern) {
+		if (*pattern == '*') {
+			while (*pattern == '*')
+				pattern++;
+			if (!*pattern)
+				return true;
+			for (; *name; name++)
+				if (matchGlob(pattern, name))
+					return true;
+			return false;
+		}
+		if (!*name || (*pattern != '?' && tolower((byte)*pattern) != tolower((byte)*name)))
+			return false;
+		pattern++;
+		name++;
+	}
+	return !*name;
+}
+
+static bool readList(const char *listname, std::vector<std::string> &names) {
+	FILE *list = strcmp(listname, "-") ? fopen(listname, "r") : stdin;
+	if (!list) {
+		fprintf(stderr, "Can not open list file: %s\n", listname);
+		return false;
+	}
+	char line[1024];
+	while (fgets(line, sizeof(line), list)) {
+		size_t len = strcspn(line, "\r\n");
+		line[len] = 0;
+		if (len > 0)
+			names.push_back(line);
+	}
+	if (list != stdin)
+		fclose(list);
+	return true;
 }
-uint32_t READ_LE_UINT32(const void *ptr) {
-	const uint8_t *b = (const uint8_t *)ptr;
-	return (b[3] << 24) + (b[2] << 16) + (b[1] << 8) + (b[0]);
+
+// Convert the stored name to a local path, EMI names use backslashes as
+// directory separators. Returns false for names escaping the current directory.
+static bool makeOutputPath(const char *name, std::string &path) {
+	while (*name == '\\' || *name == '/')
+		name++;
+	path = name;
+	for (size_t i = 0; i < path.size(); i++)
+		if (path[i] == '\\' || path[i] == '/')
+			path[i] = PATH_SEPARATOR;
+
+	size_t start = 0;
+	while (start <= path.size()) {
+		size_t end = path.find(PATH_SEPARATOR, start);
+		if (end == std::string::npos)
+			end = path.size();
+		if (path.compare(start, end - start, "..") == 0)
+			return false;
+		start = end + 1;
+	}
+	return !path.empty();
 }
 
-static void createDirectoryStructure(char *name) {
+// Create every directory leading to path. Directories already created are
+// remembered, so each one costs a single system call per run.
+static void createDirectoryStructure(const std::string &path, std::set<std::string> &created) {
+	size_t sep = 0;
+	while ((sep = path.find(PATH_SEPARATOR, sep + 1)) != std::string::npos) {
+		std::string dir = path.substr(0, sep);
+		if (!created.insert(dir).second)
+			continue;
 #ifdef WIN32
-	char *dir = strrchr(name, '\\');
-	if (dir) {
-		dir[0] = 0;
-		CreateDirectory(name, NULL);
-		dir[0] = '\\';
+		CreateDirectory(dir.c_str(), NULL);
+#else
+		mkdir(dir.c_str(), 0777);
+#endif
 	}
+}
+
+static bool isDeflated(const Common::LabEntry &entry) {
+	return entry.size != entry.rawSize && entry.rawSize != 0;
+}
+
+// Contents of the entry: straight out of the mapping when it is stored as
+// is, or inflated into raw for compressed labs. Returns 0 on error.
+static const byte *getContents(const Common::LabFile &lab, const Common::LabEntry &entry, std::vector<byte> &raw) {
+	if (!isDeflated(entry))
+		return lab.getData(entry);
+	raw.resize(entry.rawSize);
+	if (!lab.readData(entry, &raw[0]))
+		return 0;
+	return &raw[0];
+}
+
+static void extractEntry(uint32 index, void *arg) {
+	ExtractContext *ctx = (ExtractContext *)arg;
+	const ExtractJob &job = ctx->jobs[index];
+	const Common::LabEntry &entry = *job.entry;
+	std::vector<byte> raw;
+	const byte *data = getContents(*ctx->lab, entry, raw);
+	if (!data)
+		return;
+
+#ifdef WIN32
+	FILE *outfile = fopen(job.path.c_str(), "wb");
+	if (!outfile) {
+		fprintf(stderr, "Could not open file: %s\n", job.path.c_str());
+		return;
+	}
+	fwrite(data, 1, entry.rawSize, outfile);
+	fclose(outfile);
+#else
+	int fd = open(job.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		fprintf(stderr, "Could not open file: %s\n", job.path.c_str());
+		return;
+	}
+	// Let the kernel copy straight from the archive, falling back to
+	// writing out of the mapping.
+	if (isDeflated(entry) || !Common::copyRange(ctx->lab->getDescriptor(), entry.offset, fd, 0, entry.size)) {
+		if (!Common::writeAt(fd, 0, data, entry.rawSize))
+			fprintf(stderr, "Could not write file: %s\n", job.path.c_str());
+	}
+	close(fd);
 #endif
 }
 
 int main(int argc, char **argv) {
-	FILE *infile, *outfile;
-	struct lab_header head;
-	struct lab_entry *entries;
-	char *str_table;
-	uint32_t i;
-	uint32_t offset;
-	uint8_t g_type;
-
-	if (argc < 2) {
-		printf("No file specified\n");
-		exit(1);
-	}
-	const char *filename = argv[1];
+	Common::LabFile lab;
+	ExtractContext ctx;
+	uint32 numThreads = 1;
+	bool toStdout = false;
+	const char *filename = 0;
+	std::vector<std::string> names;
+	std::vector<const char *> globs;
+#ifdef POSIX
+	std::vector<regex_t> regexes;
+#endif
 
-	infile = fopen(filename, "rb");
-	if (infile == 0) {
-		printf("Can not open source file: %s\n", filename);
-		exit(1);
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+			numThreads = atoi(argv[++i]);
+			if (numThreads == 0)
+				numThreads = Common::getNumCPUs();
+		} else if (!strcmp(argv[i], "-g") && i + 1 < argc) {
+			globs.push_back(argv[++i]);
+		} else if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+#ifdef POSIX
+			regex_t re;
+			if (regcomp(&re, argv[++i], REG_EXTENDED | REG_NOSUB | REG_ICASE) != 0) {
+				fprintf(stderr, "Invalid regular expression: %s\n", argv[i]);
+				exit(1);
+			}
+			regexes.push_back(re);
+#else
+			fprintf(stderr, "Regular expressions are not supported on this platform\n");
+			exit(1);
+#endif
+		} else if (!strcmp(argv[i], "-l") && i + 1 < argc) {
+			if (!readList(argv[++i], names))
+				exit(1);
+		} else if (!strcmp(argv[i], "-c") || !strcmp(argv[i], "--cat") || !strcmp(argv[i], "--stdout")) {
+			toStdout = true;
+		} else if (!strcmp(argv[i], "--help")) {
+			usage();
+			exit(0);
+		} else if (argv[i][0] == '-' && argv[i][1]) {
+			usage();
+			exit(1);
+		} else if (!filename) {
+			filename = argv[i];
+		} else {
+			names.push_back(argv[i]);
+		}
 	}
 
-	fseek(infile, 0, SEEK_END);
-	int filesize = ftell(infile);
-	fseek(infile, 0, SEEK_SET);
-
-	fread(&head.magic, 1, 4, infile);
-	fread(&head.magic2, 1, 4, infile);
-	uint32_t num, s_size, s_offset;
-	fread(&num, 1, 4, infile);
-	fread(&s_size, 1, 4, infile);
-
-	uint32_t typeTest = 0;
-	fread(&typeTest, 1, 4, infile);
-	if (typeTest == 0) { // First entry of the table has offset 0 for Grim
-		g_type = GT_GRIM;
-		fseek(infile, -4, SEEK_CUR);
-	} else { // EMI has an offset instead.
-		s_offset = typeTest;
-		g_type = GT_EMI;
-	}
-	head.num_entries = READ_LE_UINT32(&num);
-	head.string_table_size = READ_LE_UINT32(&s_size);
-	if (0 != memcmp(&head.magic, "LABN", 4)) {
-		printf("There is no LABN header in source file\n");
+	if (!filename) {
+		printf("No file specified\n");
 		exit(1);
 	}
 
-	entries = (struct lab_entry *)malloc(head.num_entries * sizeof(struct lab_entry));
-	str_table = (char *)malloc(head.string_table_size);
-	if (!str_table || !entries) {
-		printf("Could not allocate memory\n");
+	// Names are matched case-insensitively, like the engine does
+	if (!lab.open(filename, true))
 		exit(1);
-	}
-	// Grim-stuff
-	if(g_type == GT_GRIM) {
-		fread(entries, 1, head.num_entries * sizeof(struct lab_entry), infile);
-
-		fread(str_table, 1, head.string_table_size, infile);
-	} else if(g_type == GT_EMI) { // EMI-stuff
-		// EMI has a string-table-offset
-		head.string_table_offset = READ_LE_UINT32(&s_offset) - 0x13d0f;
-		// Find the string-table
-		fseek(infile, head.string_table_offset, SEEK_SET);
-		// Read the entire string table into str-table
-		fread(str_table, 1, head.string_table_size, infile);
-		fseek(infile, 20, SEEK_SET);
-
-		// Decrypt the string table
-		uint32_t j;
-		for (j = 0; j < head.string_table_size; j++)
-			if (str_table[j] != 0)
-				str_table[j] ^= 0x96;
-		fread(entries, 1, head.num_entries * sizeof(struct lab_entry), infile);
 
+	// Pick the entries: explicitly named files first, in the given order,
+	// then everything matching a filter. No selector means every file.
+	std::vector<uint32> selection;
+	std::vector<bool> selected(lab.getNumEntries(), false);
+	bool hasFilters = !globs.empty();
+#ifdef POSIX
+	hasFilters = hasFilters || !regexes.empty();
+#endif
+	for (uint32 i = 0; i < names.size(); i++) {
+		int index = lab.findEntry(names[i].c_str());
+		if (index < 0) {
+			fprintf(stderr, "File \"%s\" not found in lab \"%s\"\n", names[i].c_str(), filename);
+		} else if (!selected[index]) {
+			selected[index] = true;
+			selection.push_back(index);
+		}
 	}
-	// allocate a 1mb buffer to start with
-	uint32_t bufSize = 1024*1024;
-	char *buf = (char *)malloc(bufSize);
-	if (!buf) {
-		printf("Could not allocate memory\n");
-		exit(1);
+	for (uint32 i = 0; i < lab.getNumEntries(); i++) {
+		if (selected[i])
+			continue;
+		bool match = names.empty() && !hasFilters;
+		for (uint32 j = 0; !match && j < globs.size(); j++)
+			match = matchGlob(globs[j], lab.getEntry(i).name);
+#ifdef POSIX
+		for (uint32 j = 0; !match && j < regexes.size(); j++)
+			match = regexec(&regexes[j], lab.getEntry(i).name, 0, 0, 0) == 0;
+#endif
+		if (match) {
+			selected[i] = true;
+			selection.push_back(i);
+		}
 	}
-	for (i = 0; i < head.num_entries; i++) {
-		char *fname = str_table + READ_LE_UINT32(&entries[i].fname_offset);
+#ifdef POSIX
+	for (uint32 j = 0; j < regexes.size(); j++)
+		regfree(&regexes[j]);
+#endif
 
-		offset = READ_LE_UINT32(&entries[i].start);
-		uint32_t size = READ_LE_UINT32(&entries[i].size);
+	for (uint32 i = 0; i < selection.size(); i++) {
+		const Common::LabEntry &entry = lab.getEntry(selection[i]);
 
-		if (offset + size > filesize) {
-			printf("File \"%s\" past the end of lab \"%s\". Your game files may be corrupt.", fname, filename);
+		if (!lab.getData(entry)) {
+			fprintf(stderr, "File \"%s\" past the end of lab \"%s\". Your game files may be corrupt.\n", entry.name, filename);
 			break;
 		}
 
-		createDirectoryStructure(fname);
-		outfile = fopen(fname, "wb");
-		if (!outfile) {
-			printf("Could not open file: %s\n", fname);
-			continue;
-		}
-		if (bufSize < size) {
-			bufSize = size;
-			char *newBuf = (char *)realloc(buf, bufSize);
-			if (!newBuf) {
-				printf("Could not reallocate memory\n");
+		if (toStdout) {
+			// Stream the file straight out of the mapping, in the requested order
+#ifdef WIN32
+			_setmode(_fileno(stdout), _O_BINARY);
+#endif
+			std::vector<byte> raw;
+			const byte *data = getContents(lab, entry, raw);
+			if (!data)
+				exit(1);
+			if (fwrite(data, 1, entry.rawSize, stdout) != entry.rawSize) {
+				fprintf(stderr, "Could not write file \"%s\" to stdout\n", entry.name);
 				exit(1);
-			} else {
-				buf = newBuf;
 			}
+			continue;
 		}
 
-		fseek(infile, offset, SEEK_SET);
-		fread(buf, 1, READ_LE_UINT32(&entries[i].size), infile);
-		fwrite(buf, 1, READ_LE_UINT32(&entries[i].size), outfile);
-		fclose(outfile);
+		ExtractJob job;
+		job.entry = &entry;
+		if (!makeOutputPath(entry.name, job.path)) {
+			fprintf(stderr, "Skipping file with unsafe name: %s\n", entry.name);
+			continue;
+		}
+		ctx.jobs.push_back(job);
+	}
 
+	if (toStdout) {
+		fflush(stdout);
+		return 0;
 	}
-	free(buf);
-	free(entries);
-	free(str_table);
 
-	fclose(infile);
+	// Read the archive front to back, whatever the directory order is
+	std::stable_sort(ctx.jobs.begin(), ctx.jobs.end(), compareByOffset);
+
+	// Directories are created up front, so the workers only write files
+	std::set<std::string> created;
+	for (uint32 i = 0; i < ctx.jobs.size(); i++)
+		createDirectoryStructure(ctx.jobs[i].path, created);
+
+	ctx.lab = &lab;
+	Common::parallelFor(ctx.jobs.size(), numThreads, extractEntry, &ctx);
+
 	return 0;
 }